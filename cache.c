@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/*
+ * Data derived from input files, or learned from devices, is kept across
+ * runs in one file per entry under $XDG_CACHE_HOME/qdl, or ~/.cache/qdl.
+ * Entries are named by their users after everything they depend on, so
+ * they never need to be invalidated.
+ */
+
+static int cache_path(const char *name, char *path, size_t len, bool create)
+{
+	const char *base;
+	const char *home;
+	char *p;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base && *base) {
+		snprintf(path, len, "%s/qdl", base);
+	} else {
+		home = getenv("HOME");
+		if (!home || !*home)
+			return -ENOENT;
+		snprintf(path, len, "%s/.cache/qdl", home);
+	}
+
+	if (create) {
+		for (p = strchr(path + 1, '/'); ; p = strchr(p + 1, '/')) {
+			if (p)
+				*p = '\0';
+			if (mkdir(path, 0755) < 0 && errno != EEXIST)
+				return -errno;
+			if (!p)
+				break;
+			*p = '/';
+		}
+	}
+
+	if ((size_t)snprintf(path + strlen(path), len - strlen(path), "/%s", name) >=
+	    len - strlen(path))
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/**
+ * cache_load() - read a cache entry
+ * @name:	name of the entry
+ * @buf:	buffer receiving the entry
+ * @len:	expected size of the entry
+ *
+ * Return: 0 on success, negative errno if the entry is missing or doesn't
+ * have the expected size
+ */
+int cache_load(const char *name, void *buf, size_t len)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	ssize_t n;
+	int ret;
+	int fd;
+
+	ret = cache_path(name, path, sizeof(path), false);
+	if (ret < 0)
+		return ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstat(fd, &sb);
+	if (ret < 0 || sb.st_size != (off_t)len) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	n = pread(fd, buf, len, 0);
+	close(fd);
+
+	return n == (ssize_t)len ? 0 : -EIO;
+}
+
+/**
+ * cache_read() - read a cache entry of any size
+ * @name:	name of the entry
+ * @buf:	set to the content of the entry, to be freed by the caller
+ * @len:	set to the size of the entry
+ *
+ * Return: 0 on success, negative errno if the entry is missing
+ */
+int cache_read(const char *name, void **buf, size_t *len)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	void *data;
+	ssize_t n;
+	int ret;
+	int fd;
+
+	ret = cache_path(name, path, sizeof(path), false);
+	if (ret < 0)
+		return ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &sb) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	data = malloc(sb.st_size ? sb.st_size : 1);
+	if (!data) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	n = pread(fd, data, sb.st_size, 0);
+	close(fd);
+	if (n != sb.st_size) {
+		free(data);
+		return -EIO;
+	}
+
+	*buf = data;
+	*len = sb.st_size;
+	return 0;
+}
+
+/**
+ * cache_store() - write a cache entry
+ * @name:	name of the entry
+ * @buf:	content of the entry
+ * @len:	size of @buf
+ *
+ * The entry is written to a temporary file, which is renamed in place, so
+ * concurrent users never see partial entries.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int cache_store(const char *name, const void *buf, size_t len)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	ssize_t n;
+	int ret;
+	int fd;
+
+	ret = cache_path(name, path, sizeof(path), true);
+	if (ret < 0)
+		return ret;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+
+	n = write(fd, buf, len);
+	ret = close(fd);
+	if (n != (ssize_t)len || ret < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+/**
+ * cache_mtime() - modification time of a file, for naming entries
+ * @sb:		status of the file
+ *
+ * Return: modification time in nanoseconds, so that rewrites within the
+ * same second still change the names derived from it
+ */
+int64_t cache_mtime(const struct stat *sb)
+{
+	return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+/**
+ * cache_ctime() - status change time of a file, for naming entries
+ * @sb:		status of the file
+ *
+ * Return: status change time in nanoseconds
+ */
+int64_t cache_ctime(const struct stat *sb)
+{
+	return (int64_t)sb->st_ctim.tv_sec * 1000000000 + sb->st_ctim.tv_nsec;
+}
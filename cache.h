@@ -0,0 +1,16 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct stat;
+
+int cache_load(const char *name, void *buf, size_t len);
+int cache_read(const char *name, void **buf, size_t *len);
+int cache_store(const char *name, const void *buf, size_t len);
+
+int64_t cache_mtime(const struct stat *sb);
+int64_t cache_ctime(const struct stat *sb);
+
+#endif
@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <lzma.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+#define DECOMPRESS_IN_SIZE	(256 * 1024)
+
+/*
+ * A deflate stream expands at most 1032 times, so the size modulo 2^32
+ * stored in the gzip trailer is exact for files smaller than this
+ */
+#define GZIP_ISIZE_EXACT	(((off_t)1 << 32) / 1032)
+
+static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static bool decompress_has_suffix(const char *filename, const char *suffix)
+{
+	size_t len = strlen(filename);
+	size_t n = strlen(suffix);
+
+	return len > n && !strcmp(filename + len - n, suffix);
+}
+
+/* A gzip header needs the deflate method and no reserved flags */
+static bool decompress_gzip_header(const uint8_t *magic, ssize_t n)
+{
+	return n >= 4 && !memcmp(magic, gzip_magic, sizeof(gzip_magic)) &&
+	       magic[2] == 0x08 && !(magic[3] & 0xe0);
+}
+
+/**
+ * decompress_detect() - detect the compression format of an image
+ * @fd:		file to check
+ * @filename:	name of the file, or NULL
+ * @any:	detect the format of files not named as compressed too
+ *
+ * Only files with a .gz, .xz or .zst extension, or any file with @any, are
+ * checked for the magic bytes of a compressed format. Other files are taken
+ * as raw, so an image merely starting like a compressed one is flashed as is.
+ *
+ * Return: DECOMPRESS_* format, or -EINVAL for a compressed file extension
+ * without the matching magic
+ */
+int decompress_detect(int fd, const char *filename, bool any)
+{
+	uint8_t magic[8];
+	bool named;
+	ssize_t n;
+
+	named = filename && (decompress_has_suffix(filename, ".gz") ||
+			     decompress_has_suffix(filename, ".xz") ||
+			     decompress_has_suffix(filename, ".zst"));
+	if (!named && !any)
+		return DECOMPRESS_NONE;
+
+	do {
+		n = pread(fd, magic, sizeof(magic), 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (decompress_gzip_header(magic, n))
+		return DECOMPRESS_GZIP;
+	if (n >= (ssize_t)sizeof(xz_magic) && !memcmp(magic, xz_magic, sizeof(xz_magic)))
+		return DECOMPRESS_XZ;
+	if (n >= (ssize_t)sizeof(zstd_magic) && !memcmp(magic, zstd_magic, sizeof(zstd_magic)))
+		return DECOMPRESS_ZSTD;
+
+	return named ? -EINVAL : DECOMPRESS_NONE;
+}
+
+const char *decompress_name(int format)
+{
+	switch (format) {
+	case DECOMPRESS_GZIP:
+		return "gzip";
+	case DECOMPRESS_XZ:
+		return "xz";
+	case DECOMPRESS_ZSTD:
+		return "zstd";
+	default:
+		return "raw";
+	}
+}
+
+static int decompress_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	do {
+		n = pread(fd, buf, len, offset);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -errno;
+
+	return (size_t)n == len ? 0 : -EINVAL;
+}
+
+/* Decompress the whole file, for formats that don't record the size */
+static int decompress_count(int fd, int format, off_t *size)
+{
+	struct decompress dec;
+	size_t len = 1024 * 1024;
+	ssize_t n;
+	void *buf;
+	int ret;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = decompress_open(&dec, fd, format);
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+
+	*size = 0;
+	while ((n = decompress_read(&dec, buf, len)) > 0)
+		*size += n;
+
+	decompress_close(&dec);
+	free(buf);
+
+	return n < 0 ? n : 0;
+}
+
+/*
+ * Look for what could be the header of another member past the first one:
+ * the magic, the deflate method, no reserved flags, one of the extra flags
+ * and operating systems gzip writes. Compressed data looking alike merely
+ * costs a count.
+ */
+static bool decompress_gzip_multiple(const uint8_t *map, size_t len)
+{
+	static const uint8_t member[] = { 0x1f, 0x8b, 0x08 };
+	const uint8_t *end = map + len;
+	const uint8_t *p = map + 10;
+
+	while (p + 10 <= end) {
+		p = memmem(p, end - p, member, sizeof(member));
+		if (!p || p + 10 > end)
+			return false;
+
+		if (!(p[3] & 0xe0) && (p[8] == 0 || p[8] == 2 || p[8] == 4) &&
+		    (p[9] <= 13 || p[9] == 255))
+			return true;
+		p++;
+	}
+
+	return false;
+}
+
+/*
+ * The trailer records the size of the last member modulo 2^32. It's taken as
+ * the size when it can't be off by a multiple of 2^32: for files too small to
+ * expand that much, or when @limit leaves no room for 2^32 more bytes. Only
+ * files possibly made of several members, or too large for the trailer to
+ * tell, are decompressed to count their bytes.
+ */
+static int decompress_gzip_size(int fd, off_t limit, off_t *size)
+{
+	struct stat sb;
+	uint8_t isize[4];
+	bool multiple;
+	void *map;
+	int ret;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	if (sb.st_size < 18)
+		return -EINVAL;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return decompress_count(fd, DECOMPRESS_GZIP, size);
+
+	multiple = decompress_gzip_multiple(map, sb.st_size);
+	munmap(map, sb.st_size);
+
+	if (multiple)
+		return decompress_count(fd, DECOMPRESS_GZIP, size);
+
+	ret = decompress_pread(fd, isize, sizeof(isize), sb.st_size - sizeof(isize));
+	if (ret < 0)
+		return ret;
+
+	*size = isize[0] | isize[1] << 8 | isize[2] << 16 | (uint32_t)isize[3] << 24;
+
+	if (sb.st_size >= GZIP_ISIZE_EXACT && (!limit || limit >= *size + ((off_t)1 << 32)))
+		return decompress_count(fd, DECOMPRESS_GZIP, size);
+
+	return 0;
+}
+
+/* Sum up the uncompressed sizes recorded in the index of each stream */
+static int decompress_xz_size(int fd, off_t *size)
+{
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags flags;
+	lzma_index *index;
+	uint64_t memlimit;
+	struct stat sb;
+	size_t in_pos;
+	uint8_t *buf;
+	lzma_ret lret;
+	off_t pos;
+	int ret;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	*size = 0;
+	pos = sb.st_size;
+	while (pos > 0) {
+		if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+			return -EINVAL;
+
+		ret = decompress_pread(fd, footer, sizeof(footer), pos - sizeof(footer));
+		if (ret < 0)
+			return ret;
+
+		/* Stream padding comes in multiples of four zero bytes */
+		if (!footer[8] && !footer[9] && !footer[10] && !footer[11]) {
+			pos -= 4;
+			continue;
+		}
+
+		if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK)
+			return -EINVAL;
+
+		if (pos - LZMA_STREAM_HEADER_SIZE < (off_t)flags.backward_size)
+			return -EINVAL;
+
+		buf = malloc(flags.backward_size);
+		if (!buf)
+			return -ENOMEM;
+
+		ret = decompress_pread(fd, buf, flags.backward_size,
+				       pos - LZMA_STREAM_HEADER_SIZE - flags.backward_size);
+		if (ret < 0) {
+			free(buf);
+			return ret;
+		}
+
+		index = NULL;
+		in_pos = 0;
+		memlimit = UINT64_MAX;
+		lret = lzma_index_buffer_decode(&index, &memlimit, NULL, buf, &in_pos,
+						flags.backward_size);
+		free(buf);
+		if (lret != LZMA_OK)
+			return -EINVAL;
+
+		*size += lzma_index_uncompressed_size(index);
+		pos -= lzma_index_stream_size(index);
+		lzma_index_end(index, NULL);
+	}
+
+	return pos == 0 ? 0 : -EINVAL;
+}
+
+#ifdef HAVE_ZSTD
+/* Sum up the content sizes from the frame headers */
+static int decompress_zstd_size(int fd, off_t *size)
+{
+	unsigned long long content = 0;
+	struct stat sb;
+	size_t frame;
+	off_t pos;
+	char *map;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return decompress_count(fd, DECOMPRESS_ZSTD, size);
+
+	*size = 0;
+	for (pos = 0; pos < sb.st_size; pos += frame) {
+		content = ZSTD_getFrameContentSize(map + pos, sb.st_size - pos);
+		frame = ZSTD_findFrameCompressedSize(map + pos, sb.st_size - pos);
+		if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR ||
+		    ZSTD_isError(frame))
+			break;
+
+		*size += content;
+	}
+
+	munmap(map, sb.st_size);
+
+	if (pos < sb.st_size) {
+		if (content == ZSTD_CONTENTSIZE_UNKNOWN)
+			return decompress_count(fd, DECOMPRESS_ZSTD, size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * decompress_size() - size of the decompressed data of a file
+ * @fd:		compressed file
+ * @format:	DECOMPRESS_* format of @fd
+ * @limit:	number of decompressed bytes used, or 0 if unbounded
+ * @size:	decompressed size
+ *
+ * The size is taken from the gzip trailer of single member files, the xz
+ * index or the zstd frame headers. A gzip size recorded modulo 2^32 is
+ * resolved with @limit; data beyond the size found this way is caught
+ * while decompressing. Only when none of these provide the size is the
+ * file decompressed to count the bytes.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int decompress_size(int fd, int format, off_t limit, off_t *size)
+{
+	switch (format) {
+	case DECOMPRESS_GZIP:
+		return decompress_gzip_size(fd, limit, size);
+	case DECOMPRESS_XZ:
+		return decompress_xz_size(fd, size);
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		return decompress_zstd_size(fd, size);
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/**
+ * decompress_open() - start decompressing a file
+ * @dec:	decompressor to initialize
+ * @fd:		compressed file, read from its start
+ * @format:	DECOMPRESS_* format of @fd
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int decompress_open(struct decompress *dec, int fd, int format)
+{
+	lzma_stream *xz;
+	z_stream *gz;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->fd = fd;
+	dec->format = format;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -errno;
+
+	dec->in_size = DECOMPRESS_IN_SIZE;
+	dec->in = malloc(dec->in_size);
+	if (!dec->in)
+		return -ENOMEM;
+
+	switch (format) {
+	case DECOMPRESS_GZIP:
+		gz = calloc(1, sizeof(*gz));
+		if (!gz)
+			goto err;
+
+		/* Accept the gzip wrapper only */
+		if (inflateInit2(gz, 16 + MAX_WBITS) != Z_OK) {
+			free(gz);
+			goto err;
+		}
+		dec->stream = gz;
+		break;
+	case DECOMPRESS_XZ:
+		xz = calloc(1, sizeof(*xz));
+		if (!xz)
+			goto err;
+
+		*xz = (lzma_stream)LZMA_STREAM_INIT;
+		if (lzma_stream_decoder(xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+			free(xz);
+			goto err;
+		}
+		dec->stream = xz;
+		break;
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		dec->stream = ZSTD_createDStream();
+		if (!dec->stream)
+			goto err;
+		break;
+#endif
+	default:
+		free(dec->in);
+		dec->in = NULL;
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+
+err:
+	free(dec->in);
+	dec->in = NULL;
+	return -ENOMEM;
+}
+
+static int decompress_fill(struct decompress *dec)
+{
+	ssize_t n;
+
+	if (dec->in_pos < dec->in_len || dec->eof)
+		return 0;
+
+	do {
+		n = read(dec->fd, dec->in, dec->in_size);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -errno;
+
+	dec->in_len = n;
+	dec->in_pos = 0;
+	dec->eof = n == 0;
+	return 0;
+}
+
+static ssize_t decompress_gzip(struct decompress *dec, void *buf, size_t len)
+{
+	z_stream *gz = dec->stream;
+	int ret;
+
+	gz->next_in = dec->in + dec->in_pos;
+	gz->avail_in = dec->in_len - dec->in_pos;
+	gz->next_out = buf;
+	gz->avail_out = len;
+
+	ret = inflate(gz, Z_NO_FLUSH);
+	dec->in_pos = dec->in_len - gz->avail_in;
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		return -EIO;
+
+	if (ret == Z_STREAM_END) {
+		if (decompress_fill(dec) < 0)
+			return -EIO;
+
+		/* Continue with the next member, ignoring trailing garbage */
+		if (dec->in_len - dec->in_pos >= sizeof(gzip_magic) &&
+		    !memcmp(dec->in + dec->in_pos, gzip_magic, sizeof(gzip_magic)))
+			inflateReset(gz);
+		else
+			dec->done = true;
+	}
+
+	return len - gz->avail_out;
+}
+
+static ssize_t decompress_xz(struct decompress *dec, void *buf, size_t len)
+{
+	lzma_stream *xz = dec->stream;
+	lzma_ret ret;
+
+	xz->next_in = dec->in + dec->in_pos;
+	xz->avail_in = dec->in_len - dec->in_pos;
+	xz->next_out = buf;
+	xz->avail_out = len;
+
+	ret = lzma_code(xz, dec->eof ? LZMA_FINISH : LZMA_RUN);
+	dec->in_pos = dec->in_len - xz->avail_in;
+	if (ret == LZMA_STREAM_END)
+		dec->done = true;
+	else if (ret != LZMA_OK)
+		return -EIO;
+
+	return len - xz->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static ssize_t decompress_zstd(struct decompress *dec, void *buf, size_t len)
+{
+	ZSTD_outBuffer out = { buf, len, 0 };
+	ZSTD_inBuffer in = { dec->in, dec->in_len, dec->in_pos };
+	size_t ret;
+
+	/* The data ends with the input, provided it ends on a frame boundary */
+	if (dec->eof && dec->boundary) {
+		dec->done = true;
+		return 0;
+	}
+
+	ret = ZSTD_decompressStream(dec->stream, &out, &in);
+	dec->in_pos = in.pos;
+	if (ZSTD_isError(ret))
+		return -EIO;
+
+	dec->boundary = !ret;
+	return out.pos;
+}
+#endif
+
+/**
+ * decompress_read() - read decompressed data
+ * @dec:	decompressor
+ * @buf:	destination buffer
+ * @len:	number of bytes to read
+ *
+ * Return: number of bytes read, less than @len only at the end of the data,
+ * or negative errno on failure, including truncated input
+ */
+ssize_t decompress_read(struct decompress *dec, void *buf, size_t len)
+{
+	size_t count = 0;
+	ssize_t n;
+	int ret;
+
+	while (count < len && !dec->done) {
+		ret = decompress_fill(dec);
+		if (ret < 0)
+			return ret;
+
+		switch (dec->format) {
+		case DECOMPRESS_GZIP:
+			n = decompress_gzip(dec, (char *)buf + count, len - count);
+			break;
+		case DECOMPRESS_XZ:
+			n = decompress_xz(dec, (char *)buf + count, len - count);
+			break;
+#ifdef HAVE_ZSTD
+		case DECOMPRESS_ZSTD:
+			n = decompress_zstd(dec, (char *)buf + count, len - count);
+			break;
+#endif
+		default:
+			return -EOPNOTSUPP;
+		}
+		if (n < 0)
+			return n;
+
+		/* Out of input, yet more data expected */
+		if (!n && dec->eof && !dec->done)
+			return -EIO;
+
+		count += n;
+	}
+
+	return count;
+}
+
+void decompress_close(struct decompress *dec)
+{
+	switch (dec->format) {
+	case DECOMPRESS_GZIP:
+		if (dec->stream)
+			inflateEnd(dec->stream);
+		free(dec->stream);
+		break;
+	case DECOMPRESS_XZ:
+		if (dec->stream)
+			lzma_end(dec->stream);
+		free(dec->stream);
+		break;
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		ZSTD_freeDStream(dec->stream);
+		break;
+#endif
+	}
+
+	free(dec->in);
+	dec->stream = NULL;
+	dec->in = NULL;
+}
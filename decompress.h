@@ -0,0 +1,51 @@
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum {
+	DECOMPRESS_NONE,
+	DECOMPRESS_GZIP,
+	DECOMPRESS_XZ,
+	DECOMPRESS_ZSTD,
+};
+
+/**
+ * struct decompress - streaming decompressor reading from a file
+ * @fd:		compressed file
+ * @format:	one of DECOMPRESS_GZIP, DECOMPRESS_XZ or DECOMPRESS_ZSTD
+ * @in:		buffer of compressed data read from @fd
+ * @in_size:	allocated size of @in
+ * @in_len:	number of bytes in @in
+ * @in_pos:	number of bytes of @in consumed
+ * @eof:	all of @fd was read into @in
+ * @done:	the end of the last stream was decoded
+ * @boundary:	the input consumed so far ends on a frame boundary
+ * @stream:	format specific decoder state
+ */
+struct decompress {
+	int fd;
+	int format;
+
+	uint8_t *in;
+	size_t in_size;
+	size_t in_len;
+	size_t in_pos;
+	bool eof;
+	bool done;
+	bool boundary;
+
+	void *stream;
+};
+
+int decompress_detect(int fd, const char *filename, bool any);
+const char *decompress_name(int format);
+int decompress_size(int fd, int format, off_t limit, off_t *size);
+int decompress_open(struct decompress *dec, int fd, int format);
+ssize_t decompress_read(struct decompress *dec, void *buf, size_t len);
+void decompress_close(struct decompress *dec);
+
+#endif
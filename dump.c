@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "dump.h"
+#include "qdl.h"
+#include "zero.h"
+
+#include "python_logging.h"
+
+/* Granularity of the holes left in place of all-zero data */
+#define DUMP_HOLE_SIZE	4096
+
+static struct dump *dumps;
+static struct dump *dumps_last;
+
+int dump_load(const char *dump_file)
+{
+	struct dump *dump;
+	xmlNode *node;
+	xmlNode *root;
+	xmlDoc *doc;
+	int errors;
+
+	doc = xmlReadFile(dump_file, NULL, 0);
+	if (!doc) {
+		log_msg(log_error, "[READ] failed to parse %s\n", dump_file);
+		return -EINVAL;
+	}
+
+	root = xmlDocGetRootElement(doc);
+	for (node = root->children; node ; node = node->next) {
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+
+		if (xmlStrcmp(node->name, (xmlChar*)"read")) {
+			log_msg(log_error, "[READ] unrecognized tag \"%s\", ignoring\n", node->name);
+			continue;
+		}
+
+		errors = 0;
+
+		dump = calloc(1, sizeof(struct dump));
+
+		dump->sector_size = attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
+		dump->filename = attr_as_string(node, "filename", &errors);
+		dump->label = attr_as_string(node, "label", &errors);
+		dump->num_sectors = attr_as_unsigned(node, "num_partition_sectors", &errors);
+		dump->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
+		dump->start_sector = attr_as_string(node, "start_sector", &errors);
+
+		if (!errors && (!dump->num_sectors || !dump->filename[0])) {
+			log_msg(log_error, "[READ] nothing to read for \"%s\"\n", dump->label);
+			errors++;
+		}
+
+		if (errors) {
+			log_msg(log_error, "[READ] errors while parsing read\n");
+			free(dump);
+			continue;
+		}
+
+		if (dumps) {
+			dumps_last->next = dump;
+			dumps_last = dump;
+		} else {
+			dumps = dump;
+			dumps_last = dump;
+		}
+	}
+
+	xmlFreeDoc(doc);
+
+	return 0;
+}
+
+static bool dump_suffix(const char *filename, const char *suffix)
+{
+	size_t len = strlen(filename);
+	size_t n = strlen(suffix);
+
+	return len > n && !strcmp(filename + len - n, suffix);
+}
+
+/* Trades ratio for speed, to keep up with the link */
+#define DUMP_GZIP_LEVEL	1
+#define DUMP_GZIP_OUT	(256 * 1024)
+
+static int dump_gzip_open(struct dump_file *file)
+{
+	z_stream *gz;
+
+	gz = calloc(1, sizeof(*gz));
+	if (!gz)
+		return -ENOMEM;
+
+	if (deflateInit2(gz, DUMP_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(gz);
+		return -ENOMEM;
+	}
+
+	file->out_size = DUMP_GZIP_OUT;
+	file->out = malloc(file->out_size);
+	if (!file->out) {
+		deflateEnd(gz);
+		free(gz);
+		return -ENOMEM;
+	}
+
+	file->gzip = gz;
+	return 0;
+}
+
+static int dump_gzip_write(struct dump_file *file, const void *buf, size_t len, int flush)
+{
+	z_stream *gz = file->gzip;
+	size_t n;
+	int ret;
+
+	gz->next_in = (Bytef *)buf;
+	gz->avail_in = len;
+
+	do {
+		gz->next_out = file->out;
+		gz->avail_out = file->out_size;
+
+		ret = deflate(gz, flush);
+		if (ret == Z_STREAM_ERROR) {
+			log_msg(log_error, "[READ] failed to compress\n");
+			return -EIO;
+		}
+
+		n = file->out_size - gz->avail_out;
+		if (n && write(file->fd, file->out, n) != (ssize_t)n) {
+			log_msg(log_error, "[READ] failed to write: %s\n", strerror(errno));
+			return -EIO;
+		}
+	} while (flush == Z_FINISH ? ret != Z_STREAM_END : gz->avail_in);
+
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int dump_zstd_open(struct dump_file *file)
+{
+	ZSTD_CCtx *cctx;
+	long cpus;
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return -ENOMEM;
+
+	/* Compress on all CPUs, when libzstd is built with threading support */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, cpus)) &&
+	    qdl_debug)
+		log_msg(log_info, "[READ] zstd compression is single threaded\n");
+
+	file->out_size = ZSTD_CStreamOutSize();
+	file->out = malloc(file->out_size);
+	if (!file->out) {
+		ZSTD_freeCCtx(cctx);
+		return -ENOMEM;
+	}
+
+	file->zstd = cctx;
+	return 0;
+}
+
+static int dump_zstd_write(struct dump_file *file, const void *buf, size_t len,
+			   ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { buf, len, 0 };
+	ZSTD_outBuffer out;
+	size_t left;
+
+	do {
+		out.dst = file->out;
+		out.size = file->out_size;
+		out.pos = 0;
+
+		left = ZSTD_compressStream2(file->zstd, &out, &in, mode);
+		if (ZSTD_isError(left)) {
+			log_msg(log_error, "[READ] failed to compress: %s\n",
+				ZSTD_getErrorName(left));
+			return -EIO;
+		}
+
+		if (out.pos && write(file->fd, file->out, out.pos) != (ssize_t)out.pos) {
+			log_msg(log_error, "[READ] failed to write: %s\n", strerror(errno));
+			return -EIO;
+		}
+	} while (mode == ZSTD_e_end ? left != 0 : in.pos < in.size);
+
+	return 0;
+}
+#endif
+
+/**
+ * dump_open() - create the output file of a dump
+ * @file:	output file to initialize
+ * @filename:	path of the file, compressed with gzip if it ends with ".gz",
+ *		or zstd if it ends with ".zst"
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dump_open(struct dump_file *file, const char *filename)
+{
+	int ret;
+
+	memset(file, 0, sizeof(*file));
+
+	file->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file->fd < 0) {
+		log_msg(log_error, "[READ] unable to open %s: %s\n", filename, strerror(errno));
+		return -errno;
+	}
+
+	if (dump_suffix(filename, ".gz")) {
+		ret = dump_gzip_open(file);
+	} else if (dump_suffix(filename, ".zst")) {
+#ifdef HAVE_ZSTD
+		ret = dump_zstd_open(file);
+#else
+		log_msg(log_error, "[READ] zstd compression of %s not supported\n", filename);
+		ret = -EOPNOTSUPP;
+#endif
+	} else {
+		return 0;
+	}
+
+	if (ret < 0) {
+		close(file->fd);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * dump_write() - append data read from the device to a dump file
+ * @file:	the output file
+ * @buf:	data to append
+ * @len:	number of bytes in @buf
+ *
+ * Compressed files are written through their encoder, otherwise all-zero
+ * blocks are skipped, leaving holes in the file.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int dump_write(struct dump_file *file, const void *buf, size_t len)
+{
+	const char *data = buf;
+	size_t block;
+	size_t n;
+	ssize_t ret;
+
+	if (file->gzip) {
+		file->offset += len;
+		return dump_gzip_write(file, buf, len, Z_NO_FLUSH);
+	}
+
+#ifdef HAVE_ZSTD
+	if (file->zstd) {
+		file->offset += len;
+		return dump_zstd_write(file, buf, len, ZSTD_e_continue);
+	}
+#endif
+
+	while (len) {
+		/* Skip the all-zero blocks, aligned to the file offset */
+		for (n = 0; n < len; n += block) {
+			block = DUMP_HOLE_SIZE - (file->offset + n) % DUMP_HOLE_SIZE;
+			if (block > len - n)
+				block = len - n;
+			if (!zero_check(data + n, block))
+				break;
+		}
+
+		if (n) {
+			file->hole = true;
+			file->offset += n;
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		/* Write out the blocks holding data in one go */
+		for (n = 0; n < len; n += block) {
+			block = DUMP_HOLE_SIZE - (file->offset + n) % DUMP_HOLE_SIZE;
+			if (block > len - n)
+				block = len - n;
+			if (zero_check(data + n, block))
+				break;
+		}
+
+		ret = pwrite(file->fd, data, n, file->offset);
+		if (ret != (ssize_t)n) {
+			log_msg(log_error, "[READ] failed to write: %s\n", strerror(errno));
+			return -EIO;
+		}
+
+		file->hole = false;
+		file->offset += n;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int dump_close(struct dump_file *file)
+{
+	int ret = 0;
+
+	if (file->gzip) {
+		ret = dump_gzip_write(file, NULL, 0, Z_FINISH);
+		deflateEnd(file->gzip);
+		free(file->gzip);
+		free(file->out);
+	}
+
+#ifdef HAVE_ZSTD
+	if (file->zstd) {
+		ret = dump_zstd_write(file, NULL, 0, ZSTD_e_end);
+		ZSTD_freeCCtx(file->zstd);
+		free(file->out);
+	}
+#endif
+
+	/* Extend the file over a trailing hole */
+	if (file->hole && ftruncate(file->fd, file->offset) < 0) {
+		log_msg(log_error, "[READ] failed to extend output: %s\n", strerror(errno));
+		ret = -EIO;
+	}
+
+	if (close(file->fd) < 0 && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+int dump_execute(struct qdl_device *qdl,
+		 int (*apply)(struct qdl_device *qdl, struct dump *dump, struct dump_file *file))
+{
+	struct dump_file file;
+	struct dump *dump;
+	int ret;
+
+	for (dump = dumps; dump; dump = dump->next) {
+		ret = dump_open(&file, dump->filename);
+		if (ret < 0)
+			return ret;
+
+		ret = apply(qdl, dump, &file);
+		if (ret) {
+			dump_close(&file);
+			return ret;
+		}
+
+		ret = dump_close(&file);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
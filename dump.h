@@ -0,0 +1,59 @@
+#ifndef __DUMP_H__
+#define __DUMP_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct qdl_device;
+
+/**
+ * struct dump - sectors to read back from the device into a file
+ * @sector_size:	size of the sectors, in bytes
+ * @filename:		file receiving the data, gzip or zstd compressed if
+ *			it ends with ".gz" or ".zst"
+ * @label:		name of the partition
+ * @num_sectors:	number of sectors to read
+ * @partition:		physical partition, or LUN, to read from
+ * @start_sector:	first sector to read
+ */
+struct dump {
+	unsigned sector_size;
+	const char *filename;
+	const char *label;
+	unsigned num_sectors;
+	unsigned partition;
+	const char *start_sector;
+
+	struct dump *next;
+};
+
+/**
+ * struct dump_file - output file of a dump
+ * @fd:		the output file
+ * @offset:	number of bytes of data written so far
+ * @hole:	the data ends with a hole not backed by the file yet
+ * @gzip:	gzip compression stream, or NULL
+ * @zstd:	zstd compression context, or NULL
+ * @out:	buffer of compressed data, when compressing
+ * @out_size:	allocated size of @out
+ */
+struct dump_file {
+	int fd;
+	off_t offset;
+	bool hole;
+
+	void *gzip;
+	void *zstd;
+	void *out;
+	size_t out_size;
+};
+
+int dump_load(const char *dump_file);
+int dump_execute(struct qdl_device *qdl,
+		 int (*apply)(struct qdl_device *qdl, struct dump *dump, struct dump_file *file));
+int dump_open(struct dump_file *file, const char *filename);
+int dump_write(struct dump_file *file, const void *buf, size_t len);
+int dump_close(struct dump_file *file);
+
+#endif
@@ -46,400 +46,1847 @@
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include "cache.h"
+#include "dump.h"
+#include "image.h"
 #include "qdl.h"
+#include "sha256.h"
+#include "sparse.h"
 #include "ufs.h"
+#include "zero.h"
 
 #include "python_logging.h"
 
-static void xml_setpropf(xmlNode *node, const char *attr, const char *fmt, ...)
+
+/* Responses are received in chunks of this size, at most up to RX_MAX */
+#define FIREHOSE_RX_CHUNK	4096
+#define FIREHOSE_RX_MAX		(1024 * 1024)
+
+#define FIREHOSE_ATTRS_MAX	32
+
+struct firehose_attr {
+	const char *name;
+	const char *value;
+};
+
+/**
+ * struct firehose_element - element received from the programmer
+ * @name:	name of the element
+ * @attrs:	attributes, pointing into the receive buffer
+ * @count:	number of entries in @attrs
+ */
+struct firehose_element {
+	const char *name;
+	struct firehose_attr attrs[FIREHOSE_ATTRS_MAX];
+	unsigned count;
+};
+
+/* Replace the entity and character references of an attribute value */
+static void firehose_unescape(char *s)
+{
+	static const struct {
+		const char *name;
+		char c;
+	} entities[] = {
+		{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+		{ "&quot;", '"' }, { "&apos;", '\'' },
+	};
+	char *dst = s;
+	unsigned long c;
+	char *end;
+	size_t i;
+
+	while (*s) {
+		if (*s != '&') {
+			*dst++ = *s++;
+			continue;
+		}
+
+		if (s[1] == '#') {
+			if (s[2] == 'x')
+				c = strtoul(s + 3, &end, 16);
+			else
+				c = strtoul(s + 2, &end, 10);
+			if (*end == ';' && c && c < 0x80) {
+				*dst++ = c;
+				s = end + 1;
+				continue;
+			}
+		}
+
+		for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+			if (!strncmp(s, entities[i].name, strlen(entities[i].name)))
+				break;
+		}
+
+		if (i < sizeof(entities) / sizeof(entities[0])) {
+			*dst++ = entities[i].c;
+			s += strlen(entities[i].name);
+		} else {
+			*dst++ = *s++;
+		}
+	}
+
+	*dst = '\0';
+}
+
+/*
+ * Split the start tag between @s and @end, excluding the angle brackets, in
+ * place into its name and attributes
+ */
+static int firehose_element_parse(struct firehose_element *elem, char *s, char *end)
+{
+	char *name;
+	char *value;
+	char quote;
+
+	elem->name = s;
+	elem->count = 0;
+
+	while (s < end && !isspace(*s) && *s != '/')
+		s++;
+	if (s == elem->name)
+		return -EINVAL;
+
+	for (;;) {
+		if (s < end)
+			*s++ = '\0';
+		while (s < end && isspace(*s))
+			s++;
+		if (s >= end || *s == '/')
+			break;
+
+		name = s;
+		while (s < end && *s != '=' && !isspace(*s))
+			s++;
+		value = s;
+		while (value < end && isspace(*value))
+			value++;
+		if (value >= end || *value != '=')
+			return -EINVAL;
+		*s = '\0';
+
+		for (value++; value < end && isspace(*value); value++)
+			;
+		if (value >= end || (*value != '"' && *value != '\''))
+			return -EINVAL;
+
+		quote = *value++;
+		s = memchr(value, quote, end - value);
+		if (!s)
+			return -EINVAL;
+		*s = '\0';
+		firehose_unescape(value);
+
+		if (elem->count < FIREHOSE_ATTRS_MAX) {
+			elem->attrs[elem->count].name = name;
+			elem->attrs[elem->count].value = value;
+			elem->count++;
+		}
+	}
+
+	return 0;
+}
+
+static const char *firehose_attr(struct firehose_element *elem, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < elem->count; i++) {
+		if (!strcmp(elem->attrs[i].name, name))
+			return elem->attrs[i].value;
+	}
+
+	return NULL;
+}
+
+/* Parse the "Digest <hex>" log reported by getsha256digest */
+static void firehose_response_digest(struct qdl_device *qdl, const char *value)
+{
+	unsigned int byte;
+	int i;
+
+	value += strlen("Digest");
+	while (*value == ':' || isspace(*value))
+		value++;
+	if (!strncasecmp(value, "0x", 2))
+		value += 2;
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		if (!isxdigit(value[2 * i]) || !isxdigit(value[2 * i + 1]) ||
+		    sscanf(value + 2 * i, "%2x", &byte) != 1)
+			return;
+		qdl->digest[i] = byte;
+	}
+
+	qdl->digest_valid = true;
+}
+
+static void firehose_response_log(struct qdl_device *qdl, struct firehose_element *elem)
+{
+	const char *value = firehose_attr(elem, "value");
+
+	log_msg(log_info, "LOG: %s\n", value ? value : "(null)");
+
+	if (value && !strncmp(value, "Digest", strlen("Digest")))
+		firehose_response_digest(qdl, value);
+}
+
+/* Find the '>' closing the markup at @s, skipping quoted attribute values */
+static char *firehose_markup_end(char *s, char *end)
 {
-	xmlChar buf[128];
+	char quote = 0;
+
+	for (; s < end; s++) {
+		if (quote) {
+			if (*s == quote)
+				quote = 0;
+		} else if (*s == '"' || *s == '\'') {
+			quote = *s;
+		} else if (*s == '>') {
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * firehose_rx_parse() - handle the complete elements in the receive buffer
+ * @qdl:		device the data was received from
+ * @response_parser:	handler of <response> elements
+ * @ret:		updated with the result of @response_parser
+ * @rawmode:		set when the response announces raw data
+ *
+ * Only <log> and <response> elements are of interest, anything else is
+ * skipped. Incomplete markup is left in the buffer, to be completed by the
+ * next read. Handling stops right after the response, leaving any trailing
+ * logs to the next call, or for a response announcing raw data at the end of
+ * its message, leaving the start of the data in the buffer.
+ *
+ * Return: true once the response has been handled
+ */
+static bool firehose_rx_parse(struct qdl_device *qdl,
+			      int (*response_parser)(struct qdl_device *qdl,
+						     struct firehose_element *elem),
+			      int *ret, bool *rawmode)
+{
+	struct firehose_element elem;
+	char *end = qdl->rx + qdl->rx_len;
+	char *s = qdl->rx;
+	const char *value;
+	bool complete = false;
+	char *close;
+
+	while (s < end && !complete) {
+		s = memchr(s, '<', end - s);
+		if (!s) {
+			s = end;
+			break;
+		}
+
+		if (end - s >= 4 && !memcmp(s, "<!--", 4)) {
+			for (close = s + 4; close + 3 <= end && memcmp(close, "-->", 3); close++)
+				;
+			if (close + 3 > end)
+				break;
+			s = close + 3;
+			continue;
+		}
+
+		close = firehose_markup_end(s, end);
+		if (!close)
+			break;
+
+		/* Declarations and end tags carry nothing */
+		if (s[1] == '?' || s[1] == '/' || s[1] == '!') {
+			if (*rawmode && !strncmp(s, "</data", 6))
+				complete = true;
+			s = close + 1;
+			continue;
+		}
+
+		if (close[-1] == '/')
+			close[-1] = ' ';
+
+		if (firehose_element_parse(&elem, s + 1, close) < 0) {
+			log_msg(log_error, "firehose response malformed\n");
+			s = close + 1;
+			continue;
+		}
+		s = close + 1;
+
+		if (!strcmp(elem.name, "log")) {
+			firehose_response_log(qdl, &elem);
+		} else if (!strcmp(elem.name, "response")) {
+			if (!response_parser)
+				log_msg(log_error, "received response with no parser\n");
+			else
+				*ret = response_parser(qdl, &elem);
+
+			value = firehose_attr(&elem, "rawmode");
+			*rawmode = value && !strcmp(value, "true");
+			complete = !*rawmode;
+		}
+	}
+
+	qdl->rx_len = end - s;
+	memmove(qdl->rx, s, qdl->rx_len);
+
+	return complete;
+}
+
+/* Make room for a read of at least FIREHOSE_RX_CHUNK bytes */
+static int firehose_rx_reserve(struct qdl_device *qdl)
+{
+	size_t size = qdl->rx_size ? qdl->rx_size : FIREHOSE_RX_CHUNK * 2;
+	char *rx;
+
+	if (qdl->rx_len + FIREHOSE_RX_CHUNK <= qdl->rx_size)
+		return 0;
+
+	while (qdl->rx_len + FIREHOSE_RX_CHUNK > size)
+		size *= 2;
+
+	if (size > FIREHOSE_RX_MAX) {
+		log_msg(log_error, "firehose response too large, discarding it\n");
+		qdl->rx_len = 0;
+		return 0;
+	}
+
+	rx = realloc(qdl->rx, size);
+	if (!rx)
+		return -ENOMEM;
+
+	qdl->rx = rx;
+	qdl->rx_size = size;
+	return 0;
+}
+
+/**
+ * firehose_read() - wait for the response to a command
+ * @qdl:		device to read from
+ * @wait:		timeout of each read in ms, or <= 0 for the default
+ * @response_parser:	handler of the response
+ *
+ * Logs preceding the response are printed along the way. The call returns as
+ * soon as the response has been received; whatever the programmer sends
+ * after it is handled by the next call.
+ *
+ * Return: the result of @response_parser, or negative errno on failure
+ */
+static int firehose_read(struct qdl_device *qdl, int wait,
+			 int (*response_parser)(struct qdl_device *qdl,
+						struct firehose_element *elem))
+{
+	bool rawmode = false;
+	int ret = -ENXIO;
+	int n;
+	int timeout = 1000;
+
+	if (wait > 0)
+		timeout = wait;
+
+	while (!firehose_rx_parse(qdl, response_parser, &ret, &rawmode)) {
+		if (firehose_rx_reserve(qdl) < 0)
+			return -ENOMEM;
+
+		n = qdl_read(qdl, qdl->rx + qdl->rx_len, qdl->rx_size - qdl->rx_len, timeout);
+		if (n < 0) {
+			/* The message announcing raw data wasn't terminated */
+			if (rawmode)
+				break;
+
+			warn("failed to read");
+			return -ETIMEDOUT;
+		}
+
+		if (qdl_debug)
+			log_msg(log_info, "FIREHOSE READ: %.*s\n", n, qdl->rx + qdl->rx_len);
+
+		qdl->rx_len += n;
+	}
+
+	return ret;
+}
+
+/*
+ * Commands are serialized straight into qdl->cmd, which is kept across
+ * commands, rather than built as a libxml2 document; after the first few
+ * commands no memory is allocated. Errors are sticky until
+ * firehose_cmd_send() reports them.
+ */
+/* Initial size of the command buffer, enough for any single command */
+#define FIREHOSE_CMD_SIZE	1024
+/* Closes the last element of a command */
+#define FIREHOSE_CMD_TRAILER	" />\n</data>\n"
+
+static int firehose_cmd_reserve(struct qdl_device *qdl, size_t len)
+{
+	size_t size = qdl->cmd_size ? qdl->cmd_size : FIREHOSE_CMD_SIZE;
+	char *cmd;
+
+	if (qdl->cmd_len + len + 1 <= qdl->cmd_size)
+		return 0;
+
+	while (qdl->cmd_len + len + 1 > size)
+		size *= 2;
+
+	cmd = realloc(qdl->cmd, size);
+	if (!cmd) {
+		qdl->cmd_error = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	qdl->cmd = cmd;
+	qdl->cmd_size = size;
+	return 0;
+}
+
+static void firehose_cmd_append(struct qdl_device *qdl, const char *s, size_t len)
+{
+	if (firehose_cmd_reserve(qdl, len) < 0)
+		return;
+
+	memcpy(qdl->cmd + qdl->cmd_len, s, len);
+	qdl->cmd_len += len;
+	qdl->cmd[qdl->cmd_len] = '\0';
+}
+
+static void firehose_cmd_vprintf(struct qdl_device *qdl, const char *fmt, va_list ap)
+{
+	size_t avail = qdl->cmd_size - qdl->cmd_len;
+	va_list copy;
+	int n;
+
+	va_copy(copy, ap);
+	n = vsnprintf(qdl->cmd + qdl->cmd_len, avail, fmt, copy);
+	va_end(copy);
+
+	if (n >= 0 && (size_t)n >= avail) {
+		if (firehose_cmd_reserve(qdl, n) < 0)
+			return;
+		n = vsnprintf(qdl->cmd + qdl->cmd_len, n + 1, fmt, ap);
+	}
+
+	if (n < 0) {
+		qdl->cmd_error = -EINVAL;
+		return;
+	}
+
+	qdl->cmd_len += n;
+}
+
+/* Escape the value of an attribute, starting at offset @start of qdl->cmd */
+static void firehose_cmd_escape(struct qdl_device *qdl, size_t start)
+{
+	static const char * const entities[256] = {
+		['&'] = "&amp;", ['<'] = "&lt;", ['>'] = "&gt;", ['"'] = "&quot;",
+		['\t'] = "&#9;", ['\n'] = "&#10;", ['\r'] = "&#13;",
+	};
+	const char *entity;
+	size_t extra = 0;
+	size_t src;
+	size_t dst;
+
+	for (src = start; src < qdl->cmd_len; src++) {
+		entity = entities[(unsigned char)qdl->cmd[src]];
+		if (entity)
+			extra += strlen(entity) - 1;
+	}
+
+	if (!extra || firehose_cmd_reserve(qdl, extra) < 0)
+		return;
+
+	/* Expand in place, from the end */
+	dst = qdl->cmd_len + extra;
+	qdl->cmd[dst] = '\0';
+	for (src = qdl->cmd_len; src-- > start;) {
+		entity = entities[(unsigned char)qdl->cmd[src]];
+		if (!entity) {
+			qdl->cmd[--dst] = qdl->cmd[src];
+			continue;
+		}
+		dst -= strlen(entity);
+		memcpy(qdl->cmd + dst, entity, strlen(entity));
+	}
+	qdl->cmd_len += extra;
+}
+
+/* Start a new command, made of a single @tag element */
+static void firehose_cmd_begin(struct qdl_device *qdl, const char *tag)
+{
+	static const char header[] = "<?xml version=\"1.0\" ?>\n<data>\n<";
+
+	qdl->cmd_len = 0;
+	qdl->cmd_error = 0;
+
+	firehose_cmd_append(qdl, header, sizeof(header) - 1);
+	firehose_cmd_append(qdl, tag, strlen(tag));
+}
+
+/* Close the current element and start a @tag element in the same command */
+static void firehose_cmd_next(struct qdl_device *qdl, const char *tag)
+{
+	firehose_cmd_append(qdl, " />\n<", 5);
+	firehose_cmd_append(qdl, tag, strlen(tag));
+}
+
+static void firehose_cmd_attr(struct qdl_device *qdl, const char *attr, const char *fmt, ...)
+{
+	size_t start;
 	va_list ap;
 
+	firehose_cmd_append(qdl, " ", 1);
+	firehose_cmd_append(qdl, attr, strlen(attr));
+	firehose_cmd_append(qdl, "=\"", 2);
+	if (qdl->cmd_error)
+		return;
+
+	start = qdl->cmd_len;
 	va_start(ap, fmt);
-	vsnprintf((char*)buf, sizeof(buf), fmt, ap);
-	xmlSetProp(node, (xmlChar*)attr, buf);
+	firehose_cmd_vprintf(qdl, fmt, ap);
 	va_end(ap);
+	if (qdl->cmd_error)
+		return;
+
+	firehose_cmd_escape(qdl, start);
+	firehose_cmd_append(qdl, "\"", 1);
+}
+
+static int firehose_cmd_send(struct qdl_device *qdl)
+{
+	int ret;
+
+	firehose_cmd_append(qdl, FIREHOSE_CMD_TRAILER, sizeof(FIREHOSE_CMD_TRAILER) - 1);
+	if (qdl->cmd_error)
+		return qdl->cmd_error;
+
+	if (qdl_debug)
+		log_msg(log_info, "FIREHOSE WRITE: %s\n", qdl->cmd);
+
+	ret = qdl_write(qdl, qdl->cmd, qdl->cmd_len, true);
+	return ret < 0 ? -EIO : 0;
 }
 
-static xmlNode *firehose_response_parse(const void *buf, size_t len, int *error)
+static int firehose_nop_parser(struct qdl_device *qdl, struct firehose_element *elem)
 {
-	xmlNode *node;
-	xmlNode *root;
-	xmlDoc *doc;
+	const char *value = firehose_attr(elem, "value");
 
-	doc = xmlReadMemory(buf, len, NULL, NULL, 0);
-	if (!doc) {
-		log_msg(log_error, "failed to parse firehose packet\n");
-		*error = -EINVAL;
-		return NULL;
+	return !value || strcmp(value, "ACK");
+}
+
+#define FIREHOSE_DEFAULT_PAYLOAD_SIZE 1048576
+/* Size of the XML documents accepted by programmers not announcing theirs */
+#define FIREHOSE_DEFAULT_XML_SIZE	4096
+
+/**
+ * firehose_configure_response_parser() - parse a configure response
+ * @qdl:	device the response was received from
+ * @elem:	the response element
+ *
+ * The size of the XML documents accepted by the programmer is recorded in
+ * @qdl along the way.
+ *
+ * Return: max size supported by the remote, or negative errno on failure
+ */
+static int firehose_configure_response_parser(struct qdl_device *qdl,
+					      struct firehose_element *elem)
+{
+	const char *xml_size;
+	const char *payload;
+	const char *value;
+	size_t max_size;
+
+	value = firehose_attr(elem, "value");
+	payload = firehose_attr(elem, "MaxPayloadSizeToTargetInBytes");
+	if (!value || !payload)
+		return -EINVAL;
+
+	max_size = strtoul(payload, NULL, 10);
+
+	xml_size = firehose_attr(elem, "MaxXMLSizeInBytes");
+	if (xml_size)
+		qdl->max_xml_size = strtoul(xml_size, NULL, 10);
+
+	/*
+	 * When receiving an ACK the remote may indicate that we should attempt
+	 * a larger payload size
+	 */
+	if (!strcmp(value, "ACK")) {
+		payload = firehose_attr(elem, "MaxPayloadSizeToTargetInBytesSupported");
+		if (!payload)
+			return -EINVAL;
+
+		max_size = strtoul(payload, NULL, 10);
 	}
 
-	root = xmlDocGetRootElement(doc);
-	for (node = root; node; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-		if (xmlStrcmp(node->name, (xmlChar*)"data") == 0)
+	return max_size;
+}
+
+static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size, bool skip_storage_init, const char *storage)
+{
+	int ret;
+
+	firehose_cmd_begin(qdl, "configure");
+	firehose_cmd_attr(qdl, "MemoryName", "%s", storage);
+	firehose_cmd_attr(qdl, "MaxPayloadSizeToTargetInBytes", "%d", payload_size);
+	firehose_cmd_attr(qdl, "verbose", "%d", 0);
+	firehose_cmd_attr(qdl, "ZLPAwareHost", "%d", 1);
+	firehose_cmd_attr(qdl, "SkipStorageInit", "%d", skip_storage_init);
+	/* The raw data is streamed, never waiting for intermediate ACKs */
+	firehose_cmd_attr(qdl, "AckRawDataEveryNumPackets", "%d", 0);
+
+	ret = firehose_cmd_send(qdl);
+	if (ret < 0)
+		return ret;
+
+	return firehose_read(qdl, -1, firehose_configure_response_parser);
+}
+
+static long firehose_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Payload sizes probed with auto-tuning, each over a slice of
+ * FIREHOSE_TUNE_STEP bytes of the first image large enough
+ */
+static const size_t firehose_tune_sizes[] = {
+	128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024, 2048 * 1024, 4096 * 1024,
+};
+
+#define FIREHOSE_TUNE_COUNT	(sizeof(firehose_tune_sizes) / sizeof(firehose_tune_sizes[0]))
+#define FIREHOSE_TUNE_STEP	(16 * 1024 * 1024)
+
+/*
+ * The payload size picked by auto-tuning is cached per programmer, by the
+ * SHA-256 of its image, and per storage type
+ */
+static int firehose_tune_name(struct qdl_device *qdl, char *name, size_t len)
+{
+	size_t n;
+	int i;
+
+	if (!qdl->programmer_hashed)
+		return -ENOENT;
+
+	n = snprintf(name, len, "payload-%s-", qdl->storage);
+	for (i = 0; i < 32 && n < len; i++)
+		n += snprintf(name + n, len - n, "%02x", qdl->programmer_hash[i]);
+
+	return n < len ? 0 : -ENAMETOOLONG;
+}
+
+/* Return the payload size cached for the programmer and storage, or 0 */
+static size_t firehose_tune_load(struct qdl_device *qdl)
+{
+	char name[128];
+	uint32_t size;
+
+	if (firehose_tune_name(qdl, name, sizeof(name)) < 0)
+		return 0;
+
+	if (cache_load(name, &size, sizeof(size)) < 0)
+		return 0;
+
+	return size;
+}
+
+static void firehose_tune_store(struct qdl_device *qdl, size_t payload_size)
+{
+	uint32_t size = payload_size;
+	char name[128];
+
+	if (firehose_tune_name(qdl, name, sizeof(name)) < 0) {
+		if (qdl_debug)
+			log_msg(log_info, "[TUNE] programmer unknown, not caching the payload size\n");
+		return;
+	}
+
+	if (cache_store(name, &size, sizeof(size)) < 0 && qdl_debug)
+		log_msg(log_info, "[TUNE] failed to cache the payload size\n");
+}
+
+static int firehose_configure(struct qdl_device *qdl, bool skip_storage_init, const char *storage)
+{
+	size_t cached = 0;
+	int ret;
+
+	qdl->storage = storage;
+	qdl->max_xml_size = FIREHOSE_DEFAULT_XML_SIZE;
+
+	if (!qdl->max_payload_size)
+		qdl->max_payload_size = FIREHOSE_DEFAULT_PAYLOAD_SIZE;
+
+	/*
+	 * Without a size picked by an earlier session, ask for the largest
+	 * size to probe, to learn how far the programmer goes
+	 */
+	if (qdl->auto_tune) {
+		cached = firehose_tune_load(qdl);
+		if (cached)
+			qdl->max_payload_size = cached;
+		else
+			qdl->max_payload_size = firehose_tune_sizes[FIREHOSE_TUNE_COUNT - 1];
+		qdl->tune_pending = !cached;
+	}
+
+	ret = firehose_send_configure(qdl, qdl->max_payload_size, skip_storage_init, storage);
+	if (ret < 0)
+		return ret;
+
+	/* The cached size is in effect unless the programmer wants less */
+	if (cached && (size_t)ret >= cached) {
+		if (qdl_debug)
+			log_msg(log_info, "[TUNE] using cached payload size of %zu kB\n",
+				cached / 1024);
+		ret = cached;
+	}
+
+	/* Retry if remote proposed different size */
+	if (ret != qdl->max_payload_size) {
+		ret = firehose_send_configure(qdl, ret, skip_storage_init, storage);
+		if (ret < 0)
+			return ret;
+
+		qdl->max_payload_size = ret;
+	}
+
+	if (qdl_debug) {
+		log_msg(log_info, "[CONFIGURE] max payload size: %zu, max XML size: %zu\n",
+			qdl->max_payload_size, qdl->max_xml_size);
+	}
+
+	return 0;
+}
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/* Time allowed for getsha256digest, in ms, plus 1 ms per RATE bytes hashed */
+#define FIREHOSE_DIGEST_TIMEOUT	10000
+#define FIREHOSE_DIGEST_RATE	(32 * 1024)
+
+static int firehose_program_start(struct qdl_device *qdl, struct program *program,
+				  unsigned num_sectors, const char *start_sector)
+{
+	int ret;
+
+	firehose_cmd_begin(qdl, "program");
+	firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	firehose_cmd_attr(qdl, "num_partition_sectors", "%d", num_sectors);
+	firehose_cmd_attr(qdl, "physical_partition_number", "%d", program->partition);
+	firehose_cmd_attr(qdl, "start_sector", "%s", start_sector);
+	if (program->filename)
+		firehose_cmd_attr(qdl, "filename", "%s", program->filename);
+
+	ret = firehose_cmd_send(qdl);
+	if (ret < 0) {
+		log_msg(log_error, "[PROGRAM] failed to write program command\n");
+		return ret;
+	}
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		log_msg(log_error, "[PROGRAM] failed to setup programming\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue @len bytes of raw data, read from @image at @offset or, when @fill is
+ * given, repeated from that payload sized buffer. @eot terminates the data
+ * of the program command with the final transfer.
+ */
+static int firehose_program_data(struct qdl_device *qdl, struct program *program,
+				 struct image *image, off_t offset, const void *fill,
+				 size_t len, bool eot, struct sha256 *sha)
+{
+	const void *data;
+	size_t chunk_size;
+	size_t n;
+
+	chunk_size = qdl->max_payload_size - qdl->max_payload_size % program->sector_size;
+
+	/*
+	 * Slices of the mapped image are queued directly, without waiting
+	 * for completion; the bounce and read-ahead buffers must be flushed
+	 * out before they are reused. Data being verified is hashed while
+	 * its transfer is in flight.
+	 */
+	while (len > 0) {
+		if (fill) {
+			data = fill;
+			n = MIN(len, chunk_size);
+		} else {
+			data = image_read(image, offset, MIN(len, chunk_size), &n);
+			if (!data) {
+				log_msg(log_error, "[PROGRAM] failed to read \"%s\"\n", program->filename);
+				return -EIO;
+			}
+		}
+
+		/*
+		 * The programmer knows the size of the raw data, so only the
+		 * final chunk needs to be terminated by a zero length packet.
+		 */
+		if (qdl_write_queue(qdl, data, n, eot && n == len) != n)
+			goto err;
+
+		if (sha)
+			sha256_update(sha, data, n);
+
+		if (!fill && image->bounced && qdl_write_flush(qdl) < 0)
+			goto err;
+
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+
+err:
+	log_msg(log_error, "[PROGRAM] failed to write \"%s\"\n", program->label);
+	qdl_write_flush(qdl);
+	return -EIO;
+}
+
+/**
+ * firehose_digest() - get the digest of sectors from the programmer
+ * @qdl:		device to query
+ * @program:		program describing the sector size and partition
+ * @start_sector:	first sector to hash
+ * @num_sectors:	number of sectors to hash
+ *
+ * On success the digest is left in qdl->digest.
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the programmer refused the command,
+ * other negative errno on failure
+ */
+static int firehose_digest(struct qdl_device *qdl, struct program *program,
+			   const char *start_sector, unsigned num_sectors)
+{
+	unsigned long bytes;
+	int wait;
+	int ret;
+
+	firehose_cmd_begin(qdl, "getsha256digest");
+	firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	firehose_cmd_attr(qdl, "num_partition_sectors", "%d", num_sectors);
+	firehose_cmd_attr(qdl, "physical_partition_number", "%d", program->partition);
+	firehose_cmd_attr(qdl, "start_sector", "%s", start_sector);
+
+	qdl->digest_valid = false;
+	ret = firehose_cmd_send(qdl);
+	if (ret < 0) {
+		log_msg(log_error, "[PROGRAM] failed to write getsha256digest command\n");
+		return ret;
+	}
+
+	/* The programmer reads back everything before responding */
+	bytes = (unsigned long)num_sectors * program->sector_size;
+	wait = FIREHOSE_DIGEST_TIMEOUT + bytes / FIREHOSE_DIGEST_RATE;
+
+	ret = firehose_read(qdl, wait, firehose_nop_parser);
+	if (ret < 0)
+		return ret;
+	else if (ret)
+		return -EOPNOTSUPP;
+
+	return qdl->digest_valid ? 0 : -EIO;
+}
+
+/*
+ * Compare the digest of the data sent with the one the programmer computes
+ * over the written sectors
+ */
+static int firehose_verify(struct qdl_device *qdl, struct program *program,
+			   struct sha256 *sha, const char *start_sector,
+			   unsigned num_sectors)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	int ret;
+
+	sha256_final(sha, digest);
+
+	ret = firehose_digest(qdl, program, start_sector, num_sectors);
+	if (ret < 0) {
+		log_msg(log_error, "[PROGRAM] failed to get digest of \"%s\"\n", program->label);
+		return ret;
+	}
+
+	if (memcmp(digest, qdl->digest, sizeof(digest))) {
+		log_msg(log_error, "[PROGRAM] verification of \"%s\" failed\n", program->label);
+		return -EIO;
+	}
+
+	if (qdl_debug)
+		log_msg(log_info, "[PROGRAM] verified %u sectors of \"%s\" at %s\n",
+			num_sectors, program->label, start_sector);
+
+	return 0;
+}
+
+/* Wait for the programmer to complete the program command, then verify it */
+static int firehose_program_end(struct qdl_device *qdl, struct program *program,
+				struct sha256 *sha, const char *start_sector,
+				unsigned num_sectors)
+{
+	int ret;
+
+	if (qdl_write_flush(qdl) < 0) {
+		log_msg(log_error, "[PROGRAM] failed to write \"%s\"\n", program->label);
+		return -EIO;
+	}
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret) {
+		log_msg(log_error, "[PROGRAM] failed\n");
+		return ret;
+	}
+
+	if (sha)
+		ret = firehose_verify(qdl, program, sha, start_sector, num_sectors);
+
+	return ret;
+}
+
+static void firehose_program_stats(struct qdl_device *qdl, off_t bytes,
+				   unsigned long transfers, unsigned long zlps)
+{
+	double mib;
+
+	if (!qdl_debug)
+		return;
+
+	mib = (double)bytes / (1024 * 1024);
+	if (mib < 1)
+		mib = 1;
+	log_msg(log_info, "[PROGRAM] %lu transfers, %lu ZLPs (%.1f/%.1f per MiB)\n",
+		qdl->out_transfers - transfers, qdl->out_zlps - zlps,
+		(qdl->out_transfers - transfers) / mib,
+		(qdl->out_zlps - zlps) / mib);
+}
+
+static int firehose_erase(struct qdl_device *qdl, struct program *program,
+			  unsigned long start, unsigned num_sectors)
+{
+	int ret;
+
+	firehose_cmd_begin(qdl, "erase");
+	firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
+	firehose_cmd_attr(qdl, "num_partition_sectors", "%d", num_sectors);
+	firehose_cmd_attr(qdl, "physical_partition_number", "%d", program->partition);
+	firehose_cmd_attr(qdl, "start_sector", "%lu", start);
+
+	ret = firehose_cmd_send(qdl);
+	if (ret < 0) {
+		log_msg(log_error, "[PROGRAM] failed to write erase command\n");
+		return ret;
+	}
+
+	ret = firehose_read(qdl, -1, firehose_nop_parser);
+	if (ret)
+		log_msg(log_error, "[PROGRAM] failed to erase %u sectors at %lu\n",
+			num_sectors, start);
+
+	return ret;
+}
+
+/*
+ * Find the end of the run of chunks starting at @i that are either all
+ * DONT_CARE or all data, clipped to @limit, and return its size in @len
+ */
+static unsigned firehose_sparse_run(struct sparse *sparse, unsigned i, off_t limit, off_t *len)
+{
+	struct sparse_chunk *chunk;
+	bool hole;
+	unsigned j;
+
+	hole = sparse->chunks[i].type == SPARSE_CHUNK_DONT_CARE;
+
+	*len = 0;
+	for (j = i; j < sparse->count; j++) {
+		chunk = &sparse->chunks[j];
+		if ((chunk->type == SPARSE_CHUNK_DONT_CARE) != hole || chunk->offset >= limit)
 			break;
+		*len += MIN(chunk->size, limit - chunk->offset);
+	}
+
+	return j;
+}
+
+/*
+ * Program the RAW and FILL chunks of @sparse, one program command per run of
+ * chunks not interrupted by a DONT_CARE chunk. The DONT_CARE regions are
+ * skipped altogether, or erased if @erase is set.
+ */
+static int firehose_program_runs(struct qdl_device *qdl, struct program *program,
+				 struct image *image, struct sparse *sparse, bool erase)
+{
+	struct sha256 *sha = NULL;
+	struct sparse_chunk *chunk;
+	unsigned long transfers;
+	unsigned long zlps;
+	struct sha256 ctx;
+	unsigned long start;
+	char start_sector[32];
+	uint32_t *fill = NULL;
+	bool filled = false;
+	off_t erased = 0;
+	off_t sent = 0;
+	off_t limit;
+	off_t size;
+	off_t len;
+	unsigned i;
+	unsigned j;
+	unsigned k;
+	char *end;
+	size_t m;
+	time_t t0;
+	time_t t;
+	int ret;
+
+	start = strtoul(program->start_sector, &end, 10);
+	if (end == program->start_sector || *end) {
+		log_msg(log_error, "[PROGRAM] \"%s\" needs a numeric start_sector to be split\n",
+			program->label);
+		return -EINVAL;
 	}
 
-	if (!node) {
-		log_msg(log_error, "firehose packet without data tag\n");
-		*error = -EINVAL;
-		xmlFreeDoc(doc);
-		return NULL;
+	if (sparse->block_size % program->sector_size) {
+		log_msg(log_error, "[PROGRAM] block size %u is not a multiple of the sector size\n",
+			sparse->block_size);
+		return -EINVAL;
+	}
+
+	limit = (off_t)program_num_sectors(program, sparse->size) * program->sector_size;
+	if (limit < sparse->size) {
+		log_msg(log_info, "[PROGRAM] %s truncated to %ld\n",
+			program->label, (long)limit);
+	}
+
+	if (qdl_debug) {
+		for (i = 0; i < sparse->count && sparse->chunks[i].offset < limit; i = j) {
+			j = firehose_sparse_run(sparse, i, limit, &len);
+			log_msg(log_info, "[PROGRAM] plan \"%s\": %s %lu sectors at %lu\n",
+				program->label,
+				sparse->chunks[i].type != SPARSE_CHUNK_DONT_CARE ? "write" :
+				erase ? "erase" : "skip",
+				(unsigned long)(len / program->sector_size),
+				start + sparse->chunks[i].offset / program->sector_size);
+		}
 	}
 
-	for (node = node->children; node && node->type != XML_ELEMENT_NODE; node = node->next)
-		;
+	fill = malloc(qdl->max_payload_size);
+	if (!fill)
+		return -ENOMEM;
+
+	if (qdl->verify)
+		sha = &ctx;
+
+	t0 = time(NULL);
+	transfers = qdl->out_transfers;
+	zlps = qdl->out_zlps;
+
+	ret = 0;
+	for (i = 0; i < sparse->count && sparse->chunks[i].offset < limit; i = j) {
+		j = firehose_sparse_run(sparse, i, limit, &len);
+
+		if (sparse->chunks[i].type == SPARSE_CHUNK_DONT_CARE) {
+			if (!erase)
+				continue;
+
+			ret = firehose_erase(qdl, program,
+					     start + sparse->chunks[i].offset / program->sector_size,
+					     len / program->sector_size);
+			if (ret)
+				goto out;
+
+			erased += len;
+			continue;
+		}
+
+		snprintf(start_sector, sizeof(start_sector), "%lu",
+			 start + sparse->chunks[i].offset / program->sector_size);
+		ret = firehose_program_start(qdl, program, len / program->sector_size, start_sector);
+		if (ret)
+			goto out;
+
+		if (sha)
+			sha256_init(sha);
+
+		for (k = i; k < j; k++) {
+			chunk = &sparse->chunks[k];
+			size = MIN(chunk->size, limit - chunk->offset);
+
+			if (chunk->type == SPARSE_CHUNK_FILL) {
+				/* The fill buffer might still be queued */
+				if (!filled || fill[0] != chunk->fill) {
+					ret = qdl_write_flush(qdl);
+					if (ret < 0)
+						goto out;
+					for (m = 0; m < qdl->max_payload_size / sizeof(*fill); m++)
+						fill[m] = chunk->fill;
+					filled = true;
+				}
+
+				ret = firehose_program_data(qdl, program, image, 0, fill,
+							    size, k == j - 1, sha);
+			} else {
+				ret = firehose_program_data(qdl, program, image, chunk->file_offset,
+							    NULL, size, k == j - 1, sha);
+			}
+			if (ret)
+				goto out;
+
+			sent += size;
+		}
+
+		ret = firehose_program_end(qdl, program, sha, start_sector,
+					   len / program->sector_size);
+		if (ret)
+			goto out;
+	}
+
+	t = time(NULL) - t0;
+
+	firehose_program_stats(qdl, sent, transfers, zlps);
+
+	if (erased)
+		log_msg(log_info, "[PROGRAM] erased %ld kB of \"%s\"\n",
+			(long)(erased / 1024), program->label);
+
+	if (t) {
+		log_msg(log_info,
+			"[PROGRAM] flashed \"%s\" successfully at %ldkB/s, %ld of %ld kB sent\n",
+			program->label, (long)(sent / t / 1024),
+			(long)(sent / 1024), (long)(limit / 1024));
+	} else {
+		log_msg(log_info, "[PROGRAM] flashed \"%s\" successfully, %ld of %ld kB sent\n",
+			program->label, (long)(sent / 1024), (long)(limit / 1024));
+	}
+
+out:
+	free(fill);
+	return ret;
+}
+
+/* Program the RAW and FILL chunks of an Android sparse image */
+static int firehose_program_sparse(struct qdl_device *qdl, struct program *program,
+				   struct image *image)
+{
+	struct sparse sparse;
+	int ret;
+
+	if (image->fd < 0) {
+		log_msg(log_error, "[PROGRAM] \"%s\" can't be read as a sparse image\n",
+			program->filename);
+		return -EINVAL;
+	}
+
+	ret = sparse_open(&sparse, image->fd, (off_t)program->file_offset * program->sector_size);
+	if (ret < 0) {
+		log_msg(log_error, "[PROGRAM] \"%s\" is not a valid sparse image\n", program->filename);
+		return ret;
+	}
+
+	ret = firehose_program_runs(qdl, program, image, &sparse, false);
+
+	sparse_close(&sparse);
+	return ret;
+}
+
+/*
+ * Program the data of an image, leaving out or erasing the payload sized
+ * blocks that are all zeros
+ */
+static int firehose_program_zeros(struct qdl_device *qdl, struct program *program,
+				  struct image *image)
+{
+	unsigned num_sectors;
+	struct sparse plan;
+	size_t block;
+	int ret;
+
+	num_sectors = program_num_sectors(program, image->size);
+	block = qdl->max_payload_size - qdl->max_payload_size % program->sector_size;
+
+	ret = zero_scan(&plan, image->map, image->size,
+			(off_t)program->file_offset * program->sector_size,
+			(off_t)num_sectors * program->sector_size, block);
+	if (ret < 0)
+		return ret;
+
+	if (qdl_debug)
+		log_msg(log_info, "[PROGRAM] scanned \"%s\" for zeros using %s\n",
+			program->filename, zero_impl_name());
+
+	ret = firehose_program_runs(qdl, program, image, &plan,
+				    program->zero_policy == PROGRAM_ZERO_ERASE);
+
+	sparse_close(&plan);
+	return ret;
+}
+
+/*
+ * Hash each chunk of a delta program, the part beyond the end of the file
+ * reading as zeros. The digests are cached by the identity of the file.
+ */
+static void firehose_delta_digests(struct image *image, off_t base, off_t length,
+				   size_t chunk, uint8_t *digests, unsigned count)
+{
+	static const char zeros[4096];
+	struct sha256 sha;
+	struct stat sb;
+	char name[192];
+	bool cached;
+	off_t offset;
+	off_t avail;
+	off_t len;
+	off_t n;
+	unsigned i;
+
+	cached = !fstat(image->fd, &sb);
+	if (cached) {
+		snprintf(name, sizeof(name), "delta-%lx-%lx-%llx-%llx-%llx-%llx-%llx-%zx",
+			 (unsigned long)sb.st_dev, (unsigned long)sb.st_ino,
+			 (unsigned long long)sb.st_size,
+			 (unsigned long long)cache_mtime(&sb), (unsigned long long)cache_ctime(&sb),
+			 (unsigned long long)base, (unsigned long long)length, chunk);
+		if (!cache_load(name, digests, count * SHA256_DIGEST_SIZE)) {
+			if (qdl_debug)
+				log_msg(log_info, "[PROGRAM] using cached digests %s\n", name);
+			return;
+		}
+	}
 
-	return node;
-}
+	for (i = 0; i < count; i++) {
+		offset = base + (off_t)i * chunk;
+		len = MIN((off_t)chunk, base + length - offset);
+		avail = offset < image->size ? MIN(len, image->size - offset) : 0;
 
-static void firehose_response_log(xmlNode *node)
-{
-	xmlChar *value;
+		sha256_init(&sha);
+		sha256_update(&sha, (char *)image->map + offset, avail);
+		for (len -= avail; len; len -= n) {
+			n = MIN(len, (off_t)sizeof(zeros));
+			sha256_update(&sha, zeros, n);
+		}
+		sha256_final(&sha, digests + i * SHA256_DIGEST_SIZE);
+	}
 
-	value = xmlGetProp(node, (xmlChar*)"value");
-	log_msg(log_info, "LOG: %s\n", value);
+	if (cached)
+		cache_store(name, digests, count * SHA256_DIGEST_SIZE);
 }
 
-static int firehose_read(struct qdl_device *qdl, int wait, int (*response_parser)(xmlNode *node))
+/**
+ * firehose_program_delta() - program only the chunks differing on the device
+ * @qdl:	device to program
+ * @program:	program to apply
+ * @image:	the mapped image file
+ *
+ * The program is split in chunks of delta_chunk bytes, the digest of each is
+ * compared with the one the programmer computes over the same sectors and
+ * only the chunks that differ are programmed, coalesced into runs.
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the program can't be split, other
+ * negative errno on failure
+ */
+static int firehose_program_delta(struct qdl_device *qdl, struct program *program,
+				  struct image *image)
 {
-	char buf[4096];
-	xmlNode *nodes;
-	xmlNode *node;
-	int error;
-	char *msg;
+	struct sparse_chunk *chunks;
+	char start_sector[32];
+	unsigned num_sectors;
+	unsigned long start;
+	struct sparse plan;
+	unsigned differ = 0;
+	bool refused = false;
+	uint8_t *digests;
+	unsigned count;
+	off_t length;
+	size_t chunk;
+	off_t base;
+	off_t len;
+	unsigned i;
 	char *end;
-	bool done = false;
-	int ret = -ENXIO;
-	int n;
-	int timeout = 1000;
-
-	if (wait > 0)
-		timeout = wait;
-
-	for (;;) {
-		n = qdl_read(qdl, buf, sizeof(buf), timeout);
-		if (n < 0) {
-			if (done)
-				break;
-
-			warn("failed to read");
-			return -ETIMEDOUT;
-		}
-		buf[n] = '\0';
+	int ret;
 
-		if (qdl_debug)
-			log_msg(log_info, "FIREHOSE READ: %s\n", buf);
+	start = strtoul(program->start_sector, &end, 10);
+	if (end == program->start_sector || *end)
+		return -EOPNOTSUPP;
+
+	chunk = program->delta_chunk - program->delta_chunk % program->sector_size;
+	if (!chunk)
+		chunk = program->sector_size;
+
+	num_sectors = program_num_sectors(program, image->size);
+	base = (off_t)program->file_offset * program->sector_size;
+	length = (off_t)num_sectors * program->sector_size;
+	count = (length + chunk - 1) / chunk;
+	if (!count)
+		return -EOPNOTSUPP;
+
+	digests = malloc(count * SHA256_DIGEST_SIZE);
+	chunks = calloc(count, sizeof(*chunks));
+	if (!digests || !chunks) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-		for (msg = buf; msg[0]; msg = end) {
-			end = strstr(msg, "</data>");
-			if (!end) {
-				log_msg(log_error, "firehose response truncated\n");
-				exit(1);
+	firehose_delta_digests(image, base, length, chunk, digests, count);
+
+	for (i = 0; i < count; i++) {
+		len = MIN((off_t)chunk, length - (off_t)i * chunk);
+
+		chunks[i].offset = (off_t)i * chunk;
+		chunks[i].size = len;
+		chunks[i].file_offset = base + chunks[i].offset;
+		chunks[i].type = SPARSE_CHUNK_RAW;
+
+		/*
+		 * Once the programmer refuses to hash a chunk, the rest are
+		 * simply written, without a round trip for each of them
+		 */
+		if (!refused) {
+			snprintf(start_sector, sizeof(start_sector), "%lu",
+				 start + (unsigned long)(i * (chunk / program->sector_size)));
+			ret = firehose_digest(qdl, program, start_sector, len / program->sector_size);
+			if (ret == -EOPNOTSUPP) {
+				log_msg(log_info, "[PROGRAM] \"%s\": programmer can't hash chunks, writing the rest\n",
+					program->label);
+				refused = true;
+			} else if (ret < 0) {
+				goto out;
+			} else if (!memcmp(qdl->digest, digests + i * SHA256_DIGEST_SIZE,
+					   SHA256_DIGEST_SIZE)) {
+				chunks[i].type = SPARSE_CHUNK_DONT_CARE;
 			}
+		}
 
-			end += strlen("</data>");
-
-			nodes = firehose_response_parse(msg, end - msg, &error);
-			if (!nodes) {
-				log_msg(log_error, "unable to parse response\n");
-				return error;
-			}
+		if (chunks[i].type == SPARSE_CHUNK_RAW)
+			differ++;
+	}
 
-			for (node = nodes; node; node = node->next) {
-				if (xmlStrcmp(node->name, (xmlChar*)"log") == 0) {
-					firehose_response_log(node);
-				} else if (xmlStrcmp(node->name, (xmlChar*)"response") == 0) {
-					if (!response_parser)
-						log_msg(log_error, "received response with no parser\n");
-					else
-						ret = response_parser(node);
-					done = true;
-					timeout = 1;
-				}
-			}
+	log_msg(log_info, "[PROGRAM] \"%s\": %u of %u chunks differ\n",
+		program->label, differ, count);
 
-			xmlFreeDoc(nodes->doc);
-		}
+	ret = 0;
+	if (differ) {
+		plan.block_size = chunk;
+		plan.size = length;
+		plan.chunks = chunks;
+		plan.count = count;
 
-		if (wait > 0)
-			timeout = 100;
+		ret = firehose_program_runs(qdl, program, image, &plan, false);
 	}
 
+out:
+	free(digests);
+	free(chunks);
 	return ret;
 }
 
-static int firehose_write(struct qdl_device *qdl, xmlDoc *doc)
+/*
+ * Program @num_sectors sectors of @image from @offset at @start, returning
+ * in @ms the time taken by the transfer and the programmer to commit it
+ */
+static int firehose_program_slice(struct qdl_device *qdl, struct program *program,
+				  struct image *image, off_t offset, unsigned long start,
+				  unsigned num_sectors, long *ms)
 {
-	int saved_errno;
-	xmlChar *s;
-	int len;
+	struct sha256 *sha = NULL;
+	char start_sector[32];
+	struct timespec t0;
+	struct sha256 ctx;
 	int ret;
 
-	xmlDocDumpMemory(doc, &s, &len);
+	snprintf(start_sector, sizeof(start_sector), "%lu", start);
 
-	if (qdl_debug)
-		log_msg(log_info, "FIREHOSE WRITE: %s\n", s);
+	ret = firehose_program_start(qdl, program, num_sectors, start_sector);
+	if (ret)
+		return ret;
 
-	ret = qdl_write(qdl, s, len, true);
-	saved_errno = errno;
-	xmlFree(s);
-	return ret < 0 ? -saved_errno : 0;
-}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-static int firehose_nop_parser(xmlNode *node)
-{
-	xmlChar *value;
+	if (qdl->verify) {
+		sha256_init(&ctx);
+		sha = &ctx;
+	}
 
-	value = xmlGetProp(node, (xmlChar*)"value");
-	return !!xmlStrcmp(value, (xmlChar*)"ACK");
-}
+	ret = firehose_program_data(qdl, program, image, offset, NULL,
+				    (size_t)num_sectors * program->sector_size, true, sha);
+	if (ret)
+		return ret;
+
+	ret = firehose_program_end(qdl, program, NULL, start_sector, num_sectors);
+	if (ret)
+		return ret;
+
+	*ms = firehose_elapsed_ms(&t0);
 
-static size_t max_payload_size = 1048576;
+	if (sha)
+		ret = firehose_verify(qdl, program, sha, start_sector, num_sectors);
+
+	return ret;
+}
 
 /**
- * firehose_configure_response_parser() - parse a configure response
- * @node:	response xmlNode
+ * firehose_program_tune() - program an image while probing payload sizes
+ * @qdl:	device to program
+ * @program:	program describing where the image goes
+ * @image:	image to program
+ * @offset:	offset of the data in @image
+ * @num_sectors: number of sectors to program
  *
- * Return: max size supported by the remote, or negative errno on failure
+ * A slice of FIREHOSE_TUNE_STEP bytes of the image is programmed with each
+ * payload size of firehose_tune_sizes[] the programmer supports, which is
+ * reconfigured in between, and the rest of the image with the fastest size.
+ * That size is kept for the rest of the session and cached for the next ones
+ * with the same programmer and storage.
+ *
+ * Images streamed by the read-ahead reader are left alone, as the reader
+ * slices them in chunks of the payload size in effect when it was started.
+ *
+ * Return: 0 on success, -EOPNOTSUPP if the image is streamed or too small to
+ * be split in slices for all the sizes, other negative errno on failure
  */
-static int firehose_configure_response_parser(xmlNode *node)
+static int firehose_program_tune(struct qdl_device *qdl, struct program *program,
+				 struct image *image, off_t offset, unsigned num_sectors)
 {
-	xmlChar *payload;
-	xmlChar *value;
-	size_t max_size;
-
-	value = xmlGetProp(node, (xmlChar*)"value");
-	payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytes");
-	if (!value || !payload)
-		return -EINVAL;
+	unsigned step = FIREHOSE_TUNE_STEP / program->sector_size;
+	size_t current = qdl->max_payload_size;
+	unsigned long rate_best = 0;
+	unsigned long start;
+	unsigned long rate;
+	unsigned count;
+	size_t best = 0;
+	unsigned done;
+	unsigned i;
+	char *end;
+	long ms;
+	int ret;
 
-	max_size = strtoul((char*)payload, NULL, 10);
+	if (image->reader)
+		return -EOPNOTSUPP;
 
-	/*
-	 * When receiving an ACK the remote may indicate that we should attempt
-	 * a larger payload size
-	 */
-	if (!xmlStrcmp(value, (xmlChar*)"ACK")) {
-		payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytesSupported");
-		if (!payload)
-			return -EINVAL;
+	start = strtoul(program->start_sector, &end, 10);
+	if (end == program->start_sector || *end)
+		return -EOPNOTSUPP;
 
-		max_size = strtoul((char*)payload, NULL, 10);
+	for (count = 0; count < FIREHOSE_TUNE_COUNT; count++) {
+		if (firehose_tune_sizes[count] > current)
+			break;
 	}
 
-	return max_size;
-}
+	if (count < 2 || num_sectors <= count * step)
+		return -EOPNOTSUPP;
 
-static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size, bool skip_storage_init, const char *storage)
-{
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
-	int ret;
+	for (i = 0, done = 0; i < count; i++, done += step) {
+		if (firehose_tune_sizes[i] != current) {
+			ret = firehose_send_configure(qdl, firehose_tune_sizes[i], true, qdl->storage);
+			if (ret < 0)
+				return ret;
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+			/* Refused, the previous size remains in effect */
+			if ((size_t)ret < firehose_tune_sizes[i])
+				break;
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"configure", NULL);
-	xml_setpropf(node, "MemoryName", storage);
-	xml_setpropf(node, "MaxPayloadSizeToTargetInBytes", "%d", payload_size);
-	xml_setpropf(node, "verbose", "%d", 0);
-	xml_setpropf(node, "ZLPAwareHost", "%d", 1);
-	xml_setpropf(node, "SkipStorageInit", "%d", skip_storage_init);
+			current = firehose_tune_sizes[i];
+			qdl->max_payload_size = current;
+		}
 
-	ret = firehose_write(qdl, doc);
-	xmlFreeDoc(doc);
-	if (ret < 0)
-		return ret;
+		ret = firehose_program_slice(qdl, program, image,
+					     offset + (off_t)done * program->sector_size,
+					     start + done, step, &ms);
+		if (ret)
+			return ret;
 
-	return firehose_read(qdl, -1, firehose_configure_response_parser);
-}
+		rate = (uint64_t)FIREHOSE_TUNE_STEP * 1000 / 1024 / (ms ? ms : 1);
+		if (qdl_debug)
+			log_msg(log_info, "[TUNE] payload size %zu kB: %lu kB/s\n",
+				current / 1024, rate);
 
-static int firehose_configure(struct qdl_device *qdl, bool skip_storage_init, const char *storage)
-{
-	int ret;
+		/* Ties go to the larger size, with fewer transfers */
+		if (rate >= rate_best) {
+			rate_best = rate;
+			best = current;
+		}
+	}
 
-	ret = firehose_send_configure(qdl, max_payload_size, skip_storage_init, storage);
-	if (ret < 0)
-		return ret;
+	qdl->tune_pending = false;
 
-	/* Retry if remote proposed different size */
-	if (ret != max_payload_size) {
-		ret = firehose_send_configure(qdl, ret, skip_storage_init, storage);
+	if (best && best != current) {
+		ret = firehose_send_configure(qdl, best, true, qdl->storage);
 		if (ret < 0)
 			return ret;
 
-		max_payload_size = ret;
+		if ((size_t)ret >= best)
+			current = best;
+		qdl->max_payload_size = current;
 	}
 
-	if (qdl_debug) {
-		log_msg(log_info, "[CONFIGURE] max payload size: %zu\n",
-			max_payload_size);
-	}
+	log_msg(log_info, "[TUNE] picked payload size of %zu kB\n", current / 1024);
+	if (best)
+		firehose_tune_store(qdl, current);
+
+	ret = firehose_program_slice(qdl, program, image,
+				     offset + (off_t)done * program->sector_size,
+				     start + done, num_sectors - done, &ms);
+	if (ret)
+		return ret;
+
+	log_msg(log_info, "[PROGRAM] flashed \"%s\" successfully\n", program->label);
 
 	return 0;
 }
 
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
-#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
-
-static int firehose_program(struct qdl_device *qdl, struct program *program, int fd)
+static int firehose_program(struct qdl_device *qdl, struct program *program, struct image *image)
 {
 	unsigned num_sectors;
-	struct stat sb;
-	size_t chunk_size;
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
-	void *buf;
+	struct sha256 ctx;
+	unsigned long transfers;
+	unsigned long zlps;
+	off_t offset;
 	time_t t0;
 	time_t t;
-	int left;
 	int ret;
-	int n;
 
-	num_sectors = program->num_sectors;
+	offset = (off_t)program->file_offset * program->sector_size;
 
-	ret = fstat(fd, &sb);
-	if (ret < 0)
-		err(1, "failed to stat \"%s\"\n", program->filename);
+	if (program->sparse || (image->fd >= 0 && sparse_detect(image->fd, offset)))
+		return firehose_program_sparse(qdl, program, image);
+
+	if (program->delta_chunk) {
+		ret = image->map ? firehose_program_delta(qdl, program, image) : -EOPNOTSUPP;
+		if (ret != -EOPNOTSUPP)
+			return ret;
 
-	num_sectors = (sb.st_size + program->sector_size - 1) / program->sector_size;
+		if (qdl_debug)
+			log_msg(log_info, "[PROGRAM] \"%s\" can't be compared, programming all of it\n",
+				program->label);
+	}
 
-	if (program->num_sectors && num_sectors > program->num_sectors) {
+	if (program->zero_policy != PROGRAM_ZERO_WRITE && image->map)
+		return firehose_program_zeros(qdl, program, image);
+
+	num_sectors = program_num_sectors(program, image->size);
+	if (num_sectors * (off_t)program->sector_size < image->size) {
 		log_msg(log_info, "[PROGRAM] %s truncated to %d\n",
 			program->label,
 			program->num_sectors * program->sector_size);
-		num_sectors = program->num_sectors;
 	}
 
-	buf = malloc(max_payload_size);
-	if (!buf)
-		err(1, "failed to allocate sector buffer");
+	if (qdl->tune_pending) {
+		ret = firehose_program_tune(qdl, program, image, offset, num_sectors);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+
+	ret = firehose_program_start(qdl, program, num_sectors, program->start_sector);
+	if (ret)
+		return ret;
+
+	t0 = time(NULL);
+	transfers = qdl->out_transfers;
+	zlps = qdl->out_zlps;
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+	if (qdl->verify)
+		sha256_init(&ctx);
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
-	xml_setpropf(node, "start_sector", "%s", program->start_sector);
-	if (program->filename)
-		xml_setpropf(node, "filename", "%s", program->filename);
+	ret = firehose_program_data(qdl, program, image, offset, NULL,
+				    (size_t)num_sectors * program->sector_size, true,
+				    qdl->verify ? &ctx : NULL);
+	if (ret)
+		return ret;
+
+	firehose_program_stats(qdl, (off_t)num_sectors * program->sector_size,
+			       transfers, zlps);
+
+	ret = firehose_program_end(qdl, program, qdl->verify ? &ctx : NULL,
+				   program->start_sector, num_sectors);
+	if (ret)
+		return ret;
+
+	t = time(NULL) - t0;
+
+	if (t) {
+		log_msg(log_info,
+			"[PROGRAM] flashed \"%s\" successfully at %ldkB/s\n",
+			program->label,
+			program->sector_size * num_sectors / t / 1024);
+	} else {
+		log_msg(log_info, "[PROGRAM] flashed \"%s\" successfully\n",
+			program->label);
+	}
+
+	return 0;
+}
+
+/* Time allowed for each bulk-IN transfer of read back data, in ms */
+#define FIREHOSE_READ_TIMEOUT	10000
+
+/**
+ * firehose_dump() - read sectors back from the device into a file
+ * @qdl:	device to read from
+ * @dump:	sectors to read
+ * @file:	file receiving the data
+ *
+ * The raw data following the read command's ACK is received through a queue
+ * of bulk-IN transfers of up to max payload size, keeping the host controller
+ * busy while the previously received data is written out. The transfers in
+ * flight never add up to more than the raw data still expected, even after
+ * one completes short, so the closing response is not mistaken for data.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int firehose_dump(struct qdl_device *qdl, struct dump *dump, struct dump_file *file)
+{
+	size_t lens[QDL_IN_QUEUE_DEFAULT];
+	unsigned depth = QDL_IN_QUEUE_DEFAULT;
+	unsigned long queued_xfers = 0;
+	unsigned long reaped_xfers = 0;
+	uint64_t received = 0;
+	uint64_t pending = 0;
+	uint64_t total;
+	size_t xfer_size;
+	unsigned slot;
+	char *bufs;
+	time_t t0;
+	time_t t;
+	size_t n;
+	int ret;
+
+	total = (uint64_t)dump->num_sectors * dump->sector_size;
+
+	/* Full packets only, a short packet ends the transfer */
+	xfer_size = qdl->max_payload_size - qdl->max_payload_size % qdl->in_maxpktsize;
+	if (!xfer_size)
+		xfer_size = qdl->in_maxpktsize;
+
+	bufs = malloc(depth * xfer_size);
+	if (!bufs)
+		return -ENOMEM;
 
-	ret = firehose_write(qdl, doc);
+	firehose_cmd_begin(qdl, "read");
+	firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", dump->sector_size);
+	firehose_cmd_attr(qdl, "num_partition_sectors", "%d", dump->num_sectors);
+	firehose_cmd_attr(qdl, "physical_partition_number", "%d", dump->partition);
+	firehose_cmd_attr(qdl, "start_sector", "%s", dump->start_sector);
+
+	ret = firehose_cmd_send(qdl);
 	if (ret < 0) {
-		log_msg(log_error, "[PROGRAM] failed to write program command\n");
+		log_msg(log_error, "[READ] failed to write read command\n");
 		goto out;
 	}
 
 	ret = firehose_read(qdl, -1, firehose_nop_parser);
 	if (ret) {
-		log_msg(log_error, "[PROGRAM] failed to setup programming\n");
+		log_msg(log_error, "[READ] failed to read \"%s\"\n", dump->label);
+		ret = -EIO;
 		goto out;
 	}
 
 	t0 = time(NULL);
 
-	lseek(fd, program->file_offset * program->sector_size, SEEK_SET);
-	left = num_sectors;
-	while (left > 0) {
-		chunk_size = MIN(max_payload_size / program->sector_size, left);
-
-		n = read(fd, buf, chunk_size * program->sector_size);
-		if (n < 0)
-			err(1, "failed to read");
+	/* Raw data received along with the response */
+	if (qdl->rx_len) {
+		n = MIN((uint64_t)qdl->rx_len, total);
+		ret = dump_write(file, qdl->rx, n);
+		if (ret < 0)
+			goto out;
 
-		if (n < max_payload_size)
-			memset(buf + n, 0, max_payload_size - n);
+		qdl->rx_len -= n;
+		memmove(qdl->rx, qdl->rx + n, qdl->rx_len);
+		received = n;
+	}
 
-		n = qdl_write(qdl, buf, chunk_size * program->sector_size, true);
-		if (n < 0)
-			err(1, "failed to write");
+	while (received < total) {
+		/* Only what is still expected and not already being received */
+		while (received + pending < total && queued_xfers - reaped_xfers < depth) {
+			slot = queued_xfers % depth;
+			lens[slot] = MIN(xfer_size, total - received - pending);
+			if (qdl_read_queue(qdl, bufs + slot * xfer_size, lens[slot]) < 0)
+				goto err;
 
-		if (n != chunk_size * program->sector_size)
-			err(1, "failed to write full sector");
+			pending += lens[slot];
+			queued_xfers++;
+		}
 
-		left -= chunk_size;
+		slot = reaped_xfers % depth;
+		ret = qdl_read_reap(qdl, FIREHOSE_READ_TIMEOUT);
+		if (ret < 0)
+			goto err;
+		n = ret;
+		reaped_xfers++;
+
+		/* The rest of a short transfer arrives in the following ones */
+		pending -= lens[slot];
+		received += n;
+
+		ret = dump_write(file, bufs + slot * xfer_size, n);
+		if (ret < 0) {
+			qdl_read_cancel(qdl);
+			goto out;
+		}
 	}
 
-	t = time(NULL) - t0;
+	if (qdl_debug)
+		log_msg(log_info, "[READ] %lu bulk-IN transfers for %llu kB\n",
+			reaped_xfers, (unsigned long long)total / 1024);
 
 	ret = firehose_read(qdl, -1, firehose_nop_parser);
 	if (ret) {
-		log_msg(log_error, "[PROGRAM] failed\n");
-	} else if (t) {
-		log_msg(log_info,
-			"[PROGRAM] flashed \"%s\" successfully at %ldkB/s\n",
-			program->label,
-			program->sector_size * num_sectors / t / 1024);
+		log_msg(log_error, "[READ] failed\n");
+		ret = -EIO;
+		goto out;
+	}
+
+	t = time(NULL) - t0;
+	if (t) {
+		log_msg(log_info, "[READ] read \"%s\" successfully at %llukB/s\n",
+			dump->label, (unsigned long long)total / t / 1024);
 	} else {
-		log_msg(log_info, "[PROGRAM] flashed \"%s\" successfully\n",
-			program->label);
+		log_msg(log_info, "[READ] read \"%s\" successfully\n", dump->label);
 	}
 
+	goto out;
+
+err:
+	log_msg(log_error, "[READ] failed to receive \"%s\"\n", dump->label);
+	qdl_read_cancel(qdl);
+	ret = -EIO;
 out:
-	xmlFreeDoc(doc);
+	free(bufs);
 	return ret;
 }
 
-static int firehose_apply_patch(struct qdl_device *qdl, struct patch *patch)
+static void firehose_cmd_patch(struct qdl_device *qdl, struct patch *patch)
+{
+	firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", patch->sector_size);
+	firehose_cmd_attr(qdl, "byte_offset", "%d", patch->byte_offset);
+	firehose_cmd_attr(qdl, "filename", "%s", patch->filename);
+	firehose_cmd_attr(qdl, "physical_partition_number", "%d", patch->partition);
+	firehose_cmd_attr(qdl, "size_in_bytes", "%d", patch->size_in_bytes);
+	firehose_cmd_attr(qdl, "start_sector", "%s", patch->start_sector);
+	firehose_cmd_attr(qdl, "value", "%s", patch->value);
+}
+
+/* Silence, in ms, ending the responses to a failed batch of patches */
+#define FIREHOSE_PATCH_DRAIN	100
+
+/*
+ * Serialize patches from @patches into a single command, as many as fit in
+ * the XML size accepted by the programmer, and return how many were taken.
+ */
+static unsigned firehose_cmd_patches(struct qdl_device *qdl, struct patch **patches,
+				     unsigned count)
+{
+	size_t trailer = sizeof(FIREHOSE_CMD_TRAILER) - 1;
+	size_t end;
+	unsigned n;
+
+	firehose_cmd_begin(qdl, "patch");
+	firehose_cmd_patch(qdl, patches[0]);
+	end = qdl->cmd_len;
+
+	if (qdl->patch_single || qdl->cmd_error)
+		return 1;
+
+	for (n = 1; n < count; n++) {
+		firehose_cmd_next(qdl, "patch");
+		firehose_cmd_patch(qdl, patches[n]);
+		if (qdl->cmd_error || qdl->cmd_len + trailer > qdl->max_xml_size)
+			break;
+		end = qdl->cmd_len;
+	}
+
+	qdl->cmd_len = end;
+	qdl->cmd[end] = '\0';
+
+	return n;
+}
+
+/**
+ * firehose_apply_patches() - apply patches to the disk
+ * @qdl:	device to apply the patches to
+ * @patches:	patches to apply, in order
+ * @count:	number of entries in @patches
+ *
+ * Rather than waiting for the ACK of each patch in turn, patches are packed
+ * into commands of up to the XML size announced by the programmer and the
+ * responses to each command are collected at once.
+ *
+ * Should any patch of a batch fail, possibly because the programmer handles
+ * a single element per document, the rest of its responses are discarded
+ * and the patches are applied again one at a time, from the start of the
+ * batch; applying a patch twice leaves the same content behind.
+ *
+ * Return: 0 on success, the failing response or negative errno on failure
+ */
+static int firehose_apply_patches(struct qdl_device *qdl, struct patch **patches,
+				  unsigned count)
 {
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
+	unsigned i = 0;
+	unsigned n;
+	unsigned k;
 	int ret;
 
-	log_msg(log_info, "%s\n", patch->what);
+	while (i < count) {
+		n = firehose_cmd_patches(qdl, patches + i, count - i);
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+		ret = firehose_cmd_send(qdl);
+		if (ret < 0)
+			return ret;
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"patch", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", patch->sector_size);
-	xml_setpropf(node, "byte_offset", "%d", patch->byte_offset);
-	xml_setpropf(node, "filename", "%s", patch->filename);
-	xml_setpropf(node, "physical_partition_number", "%d", patch->partition);
-	xml_setpropf(node, "size_in_bytes", "%d", patch->size_in_bytes);
-	xml_setpropf(node, "start_sector", "%s", patch->start_sector);
-	xml_setpropf(node, "value", "%s", patch->value);
+		for (k = 0; k < n; k++)
+			log_msg(log_info, "%s\n", patches[i + k]->what);
 
-	ret = firehose_write(qdl, doc);
-	if (ret < 0)
-		goto out;
+		for (k = 0; k < n; k++) {
+			ret = firehose_read(qdl, -1, firehose_nop_parser);
+			if (ret)
+				break;
+		}
 
-	ret = firehose_read(qdl, -1, firehose_nop_parser);
-	if (ret)
-		log_msg(log_error, "[APPLY PATCH] %d\n", ret);
+		if (!ret) {
+			i += n;
+			continue;
+		}
 
-out:
-	xmlFreeDoc(doc);
-	return ret;
+		if (n == 1) {
+			log_msg(log_error, "[APPLY PATCH] %d\n", ret);
+			return ret;
+		}
+
+		qdl->rx_len = 0;
+		if (firehose_rx_reserve(qdl) < 0)
+			return -ENOMEM;
+
+		while (qdl_read(qdl, qdl->rx, qdl->rx_size, FIREHOSE_PATCH_DRAIN) >= 0)
+			;
+
+		log_msg(log_info, "[APPLY PATCH] batch of %u patches failed, applying them one at a time\n", n);
+		qdl->patch_single = true;
+	}
+
+	return 0;
 }
 
-static int firehose_send_single_tag(struct qdl_device *qdl, xmlNode *node){
-        xmlNode *root;
-        xmlDoc *doc;
+static int firehose_send_single_tag(struct qdl_device *qdl){
         int ret;
 
-        doc = xmlNewDoc((xmlChar*)"1.0");
-        root = xmlNewNode(NULL, (xmlChar*)"data");
-        xmlDocSetRootElement(doc, root);
-        xmlAddChild(root, node);
-
-        ret = firehose_write(qdl, doc);
+        ret = firehose_cmd_send(qdl);
         if (ret < 0)
-                goto out;
+                return ret;
 
         ret = firehose_read(qdl, -1, firehose_nop_parser);
         if (ret) {
@@ -447,29 +1894,26 @@ static int firehose_send_single_tag(struct qdl_device *qdl, xmlNode *node){
                 ret = -EINVAL;
         }
 
-out:
-        xmlFreeDoc(doc);
         return ret;
 }
 
 int firehose_apply_ufs_common(struct qdl_device *qdl, struct ufs_common *ufs)
 {
-	xmlNode *node_to_send;
 	int ret;
 
-	node_to_send = xmlNewNode (NULL, (xmlChar*)"ufs");
+	firehose_cmd_begin(qdl, "ufs");
 
-	xml_setpropf(node_to_send, "bNumberLU", "%d", ufs->bNumberLU);
-	xml_setpropf(node_to_send, "bBootEnable", "%d", ufs->bBootEnable);
-	xml_setpropf(node_to_send, "bDescrAccessEn", "%d", ufs->bDescrAccessEn);
-	xml_setpropf(node_to_send, "bInitPowerMode", "%d", ufs->bInitPowerMode);
-	xml_setpropf(node_to_send, "bHighPriorityLUN", "%d", ufs->bHighPriorityLUN);
-	xml_setpropf(node_to_send, "bSecureRemovalType", "%d", ufs->bSecureRemovalType);
-	xml_setpropf(node_to_send, "bInitActiveICCLevel", "%d", ufs->bInitActiveICCLevel);
-	xml_setpropf(node_to_send, "wPeriodicRTCUpdate", "%d", ufs->wPeriodicRTCUpdate);
-	xml_setpropf(node_to_send, "bConfigDescrLock", "%d", 0/*ufs->bConfigDescrLock*/); //Safety, remove before fly
+	firehose_cmd_attr(qdl, "bNumberLU", "%d", ufs->bNumberLU);
+	firehose_cmd_attr(qdl, "bBootEnable", "%d", ufs->bBootEnable);
+	firehose_cmd_attr(qdl, "bDescrAccessEn", "%d", ufs->bDescrAccessEn);
+	firehose_cmd_attr(qdl, "bInitPowerMode", "%d", ufs->bInitPowerMode);
+	firehose_cmd_attr(qdl, "bHighPriorityLUN", "%d", ufs->bHighPriorityLUN);
+	firehose_cmd_attr(qdl, "bSecureRemovalType", "%d", ufs->bSecureRemovalType);
+	firehose_cmd_attr(qdl, "bInitActiveICCLevel", "%d", ufs->bInitActiveICCLevel);
+	firehose_cmd_attr(qdl, "wPeriodicRTCUpdate", "%d", ufs->wPeriodicRTCUpdate);
+	firehose_cmd_attr(qdl, "bConfigDescrLock", "%d", 0/*ufs->bConfigDescrLock*/); //Safety, remove before fly
 
-	ret = firehose_send_single_tag(qdl, node_to_send);
+	ret = firehose_send_single_tag(qdl);
 	if (ret)
 		log_msg(log_error, "[APPLY UFS common] %d\n", ret);
 
@@ -478,25 +1922,24 @@ int firehose_apply_ufs_common(struct qdl_device *qdl, struct ufs_common *ufs)
 
 int firehose_apply_ufs_body(struct qdl_device *qdl, struct ufs_body *ufs)
 {
-	xmlNode *node_to_send;
 	int ret;
 
-	node_to_send = xmlNewNode (NULL, (xmlChar*)"ufs");
-
-	xml_setpropf(node_to_send, "LUNum", "%d", ufs->LUNum);
-	xml_setpropf(node_to_send, "bLUEnable", "%d", ufs->bLUEnable);
-	xml_setpropf(node_to_send, "bBootLunID", "%d", ufs->bBootLunID);
-	xml_setpropf(node_to_send, "size_in_kb", "%d", ufs->size_in_kb);
-	xml_setpropf(node_to_send, "bDataReliability", "%d", ufs->bDataReliability);
-	xml_setpropf(node_to_send, "bLUWriteProtect", "%d", ufs->bLUWriteProtect);
-	xml_setpropf(node_to_send, "bMemoryType", "%d", ufs->bMemoryType);
-	xml_setpropf(node_to_send, "bLogicalBlockSize", "%d", ufs->bLogicalBlockSize);
-	xml_setpropf(node_to_send, "bProvisioningType", "%d", ufs->bProvisioningType);
-	xml_setpropf(node_to_send, "wContextCapabilities", "%d", ufs->wContextCapabilities);
+	firehose_cmd_begin(qdl, "ufs");
+
+	firehose_cmd_attr(qdl, "LUNum", "%d", ufs->LUNum);
+	firehose_cmd_attr(qdl, "bLUEnable", "%d", ufs->bLUEnable);
+	firehose_cmd_attr(qdl, "bBootLunID", "%d", ufs->bBootLunID);
+	firehose_cmd_attr(qdl, "size_in_kb", "%d", ufs->size_in_kb);
+	firehose_cmd_attr(qdl, "bDataReliability", "%d", ufs->bDataReliability);
+	firehose_cmd_attr(qdl, "bLUWriteProtect", "%d", ufs->bLUWriteProtect);
+	firehose_cmd_attr(qdl, "bMemoryType", "%d", ufs->bMemoryType);
+	firehose_cmd_attr(qdl, "bLogicalBlockSize", "%d", ufs->bLogicalBlockSize);
+	firehose_cmd_attr(qdl, "bProvisioningType", "%d", ufs->bProvisioningType);
+	firehose_cmd_attr(qdl, "wContextCapabilities", "%d", ufs->wContextCapabilities);
 	if(ufs->desc)
-		xml_setpropf(node_to_send, "desc", "%s", ufs->desc);
+		firehose_cmd_attr(qdl, "desc", "%s", ufs->desc);
 
-	ret = firehose_send_single_tag(qdl, node_to_send);
+	ret = firehose_send_single_tag(qdl);
 	if (ret)
 		log_msg(log_error, "[APPLY UFS body] %d\n", ret);
 
@@ -506,15 +1949,14 @@ int firehose_apply_ufs_body(struct qdl_device *qdl, struct ufs_body *ufs)
 int firehose_apply_ufs_epilogue(struct qdl_device *qdl, struct ufs_epilogue *ufs,
 	bool commit)
 {
-	xmlNode *node_to_send;
 	int ret;
 
-	node_to_send = xmlNewNode (NULL, (xmlChar*)"ufs");
+	firehose_cmd_begin(qdl, "ufs");
 
-	xml_setpropf(node_to_send, "LUNtoGrow", "%d", ufs->LUNtoGrow);
-	xml_setpropf(node_to_send, "commit", "%d", commit);
+	firehose_cmd_attr(qdl, "LUNtoGrow", "%d", ufs->LUNtoGrow);
+	firehose_cmd_attr(qdl, "commit", "%d", commit);
 
-	ret = firehose_send_single_tag(qdl, node_to_send);
+	ret = firehose_send_single_tag(qdl);
 	if (ret)
 		log_msg(log_error, "[APPLY UFS epilogue] %d\n", ret);
 
@@ -523,20 +1965,12 @@ int firehose_apply_ufs_epilogue(struct qdl_device *qdl, struct ufs_epilogue *ufs
 
 static int firehose_set_bootable(struct qdl_device *qdl, int part)
 {
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
 	int ret;
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
+	firehose_cmd_begin(qdl, "setbootablestoragedrive");
+	firehose_cmd_attr(qdl, "value", "%d", part);
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"setbootablestoragedrive", NULL);
-	xml_setpropf(node, "value", "%d", part);
-
-	ret = firehose_write(qdl, doc);
-	xmlFreeDoc(doc);
+	ret = firehose_cmd_send(qdl);
 	if (ret < 0)
 		return ret;
 
@@ -552,35 +1986,108 @@ static int firehose_set_bootable(struct qdl_device *qdl, int part)
 
 static int firehose_reset(struct qdl_device *qdl)
 {
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
 	int ret;
 
-	doc = xmlNewDoc((xmlChar*)"1.0");
-	root = xmlNewNode(NULL, (xmlChar*)"data");
-	xmlDocSetRootElement(doc, root);
-
-	node = xmlNewChild(root, NULL, (xmlChar*)"power", NULL);
-	xml_setpropf(node, "value", "reset");
+	firehose_cmd_begin(qdl, "power");
+	firehose_cmd_attr(qdl, "value", "reset");
 
-	ret = firehose_write(qdl, doc);
-	xmlFreeDoc(doc);
+	ret = firehose_cmd_send(qdl);
 	if (ret < 0)
 		return ret;
 
 	return firehose_read(qdl, -1, firehose_nop_parser);
 }
 
+/* Poll interval, and silence after which a nop is sent to the programmer */
+#define FIREHOSE_BOOT_POLL	50
+#define FIREHOSE_BOOT_QUIET	500
+
+/**
+ * firehose_wait_ready() - wait for the programmer to boot
+ * @qdl:	device the programmer was loaded onto
+ *
+ * The programmer is probed with a nop once it prints its first logs, or
+ * after FIREHOSE_BOOT_QUIET ms without output, and is ready when it responds
+ * to the nop; the boot logs preceding the ACK are printed along the way.
+ *
+ * A programmer left running by an earlier session may still have output
+ * queued, possibly responses to commands of that session, so it is drained
+ * first and probed right away.
+ *
+ * Return: 0 once the programmer responds, negative errno on failure
+ */
+static int firehose_wait_ready(struct qdl_device *qdl)
+{
+	unsigned int timeout = qdl->boot_timeout ? : QDL_BOOT_TIMEOUT_DEFAULT;
+	struct timespec start;
+	bool rawmode = false;
+	bool probed = false;
+	long elapsed = 0;
+	int ret;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (qdl->firehose_resumed) {
+		qdl->rx_len = 0;
+		if (firehose_rx_reserve(qdl) < 0)
+			return -ENOMEM;
+
+		while (firehose_elapsed_ms(&start) < timeout &&
+		       (n = qdl_read(qdl, qdl->rx, qdl->rx_size, FIREHOSE_BOOT_POLL)) >= 0) {
+			if (qdl_debug)
+				log_msg(log_info, "FIREHOSE DROP: %.*s\n", n, qdl->rx);
+		}
+
+		firehose_cmd_begin(qdl, "nop");
+		ret = firehose_cmd_send(qdl);
+		if (ret < 0)
+			return ret;
+		probed = true;
+	}
+
+	while (elapsed < timeout) {
+		if (firehose_rx_reserve(qdl) < 0)
+			return -ENOMEM;
+
+		n = qdl_read(qdl, qdl->rx + qdl->rx_len, qdl->rx_size - qdl->rx_len,
+			     FIREHOSE_BOOT_POLL);
+		if (n > 0) {
+			if (qdl_debug)
+				log_msg(log_info, "FIREHOSE READ: %.*s\n", n, qdl->rx + qdl->rx_len);
+			qdl->rx_len += n;
+		}
+
+		elapsed = firehose_elapsed_ms(&start);
+
+		if (!probed && (n > 0 || elapsed >= FIREHOSE_BOOT_QUIET)) {
+			firehose_cmd_begin(qdl, "nop");
+			ret = firehose_cmd_send(qdl);
+			if (ret < 0)
+				return ret;
+			probed = true;
+		}
+
+		/* Even a NAK shows the programmer is up */
+		if (probed && firehose_rx_parse(qdl, firehose_nop_parser, &ret, &rawmode)) {
+			log_msg(log_info, "[FIREHOSE] programmer ready after %ld ms\n",
+				firehose_elapsed_ms(&start));
+			return 0;
+		}
+	}
+
+	log_msg(log_error, "firehose programmer not ready after %u ms\n", timeout);
+	return -ETIMEDOUT;
+}
+
 int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage, void* progress_callback_context)
 {
 	int bootable;
 	int ret;
 
-	/* Wait for the firehose payload to boot */
-	sleep(3);
-
-	firehose_read(qdl, 1000, NULL);
+	ret = firehose_wait_ready(qdl);
+	if (ret)
+		return ret;
 
 	if(ufs_need_provisioning()) {
 		ret = firehose_configure(qdl, true, storage);
@@ -599,11 +2106,19 @@ int firehose_run(struct qdl_device *qdl, const char *incdir, const char *storage
 	if (ret)
 		return ret;
 
+	/* Read back before anything gets programmed */
+	ret = dump_execute(qdl, firehose_dump);
+	if (ret)
+		return ret;
+
+	if (qdl->verify && qdl_debug)
+		log_msg(log_info, "[PROGRAM] verifying with %s sha256\n", sha256_impl_name());
+
 	ret = program_execute(qdl, firehose_program, incdir, progress_callback_context);
 	if (ret)
 		return ret;
 
-	ret = patch_execute(qdl, firehose_apply_patch);
+	ret = patch_execute(qdl, firehose_apply_patches);
 	if (ret)
 		return ret;
 
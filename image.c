@@ -0,0 +1,771 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decompress.h"
+#include "image.h"
+#include "program.h"
+#include "sparse.h"
+
+#include "python_logging.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+int image_open(struct image *image, int fd, unsigned sector_size)
+{
+	struct stat sb;
+	void *map;
+
+	memset(image, 0, sizeof(*image));
+	image->fd = fd;
+	image->sector_size = sector_size;
+
+	if (fstat(fd, &sb) < 0)
+		return -errno;
+
+	image->size = sb.st_size;
+
+	/* Fall back to read() for anything that can't be mapped */
+	if (!S_ISREG(sb.st_mode) || !sb.st_size || (uintmax_t)sb.st_size > SIZE_MAX)
+		return 0;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
+
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+	image->map = map;
+
+	return 0;
+}
+
+static void *image_bounce(struct image *image, size_t len)
+{
+	void *buf;
+
+	if (len > image->bounce_size) {
+		buf = realloc(image->bounce, len);
+		if (!buf)
+			return NULL;
+
+		image->bounce = buf;
+		image->bounce_size = len;
+	}
+
+	image->bounced = true;
+	return image->bounce;
+}
+
+static const void *image_read_mapped(struct image *image, off_t offset, size_t len, size_t *n)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t avail = 0;
+	off_t ahead;
+	void *buf;
+
+	if (offset < image->size)
+		avail = image->size - offset;
+
+	if (avail >= len) {
+		*n = len;
+	} else if (avail >= image->sector_size) {
+		/* Hand out the full sectors, the tail is bounced separately */
+		*n = avail - avail % image->sector_size;
+	} else {
+		buf = image_bounce(image, len);
+		if (!buf)
+			return NULL;
+
+		memcpy(buf, (char *)image->map + offset, avail);
+		memset((char *)buf + avail, 0, len - avail);
+		*n = len;
+		return buf;
+	}
+
+	/* Start reading in the next slice while this one is transferred */
+	ahead = (offset + *n) & ~(off_t)(page_size - 1);
+	if (ahead < image->size)
+		madvise((char *)image->map + ahead, MIN((off_t)len, image->size - ahead),
+			MADV_WILLNEED);
+
+	return (char *)image->map + offset;
+}
+
+static unsigned image_reader_used(struct image_reader *reader)
+{
+	return reader->head - reader->tail;
+}
+
+static void image_reader_release(struct image_reader *reader)
+{
+	if (reader->held) {
+		reader->tail++;
+		reader->held = false;
+		pthread_cond_broadcast(&reader->cond);
+	}
+}
+
+/*
+ * Get slot @index of the ring once the consumer has released it, waiting for
+ * that only if @wait is set; returns NULL when asked to stop
+ */
+static struct image_chunk *image_reader_claim(struct image_reader *reader,
+					      unsigned index, bool wait)
+{
+	struct image_chunk *chunk = NULL;
+
+	pthread_mutex_lock(&reader->lock);
+	while (wait && !reader->stop && index - reader->tail == reader->depth)
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	if (!reader->stop && index - reader->tail < reader->depth)
+		chunk = &reader->ring[index % reader->depth];
+	pthread_mutex_unlock(&reader->lock);
+
+	return chunk;
+}
+
+/* Wait for a free slot, returns NULL when asked to stop */
+static struct image_chunk *image_reader_slot(struct image_reader *reader)
+{
+	return image_reader_claim(reader, reader->head, true);
+}
+
+static bool image_reader_stopped(struct image_reader *reader)
+{
+	bool stop;
+
+	pthread_mutex_lock(&reader->lock);
+	stop = reader->stop;
+	pthread_mutex_unlock(&reader->lock);
+
+	return stop;
+}
+
+static void image_reader_publish(struct image_reader *reader)
+{
+	pthread_mutex_lock(&reader->lock);
+	reader->head++;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/*
+ * Read @chunk->len bytes at @chunk->offset, reading @size bytes from the file
+ * to meet the O_DIRECT alignment, and zero pad past the end of file
+ */
+static void image_reader_pread(int fd, struct image_chunk *chunk, size_t count, size_t size)
+{
+	ssize_t n;
+
+	while (count < size) {
+		n = pread(fd, (char *)chunk->buf + count, size - count, chunk->offset + count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			chunk->error = -errno;
+		if (n <= 0)
+			break;
+		count += n;
+	}
+
+	if (count < chunk->len)
+		memset((char *)chunk->buf + count, 0, chunk->len - count);
+}
+
+/* Keep a read queued in io_uring for every free slot of the ring */
+static int image_reader_uring(struct image_reader *reader, struct program *program,
+			      int fd, off_t offset, size_t left, size_t chunk_size)
+{
+	struct image_chunk *chunk;
+	unsigned queued = reader->head;
+	uint64_t index;
+	int ret = 0;
+	int res;
+
+	while (left > 0 || reader->head != queued) {
+		while (left > 0) {
+			chunk = image_reader_claim(reader, queued, reader->head == queued);
+			if (!chunk)
+				break;
+
+			chunk->program = program;
+			chunk->header = false;
+			chunk->error = 0;
+			chunk->len = MIN(left, chunk_size);
+			chunk->offset = offset;
+			chunk->busy = true;
+
+			/* Read synchronously what can't be queued */
+			if (uring_read(&reader->uring, fd, chunk->buf,
+				       ALIGN_UP(chunk->len, IMAGE_DIRECT_ALIGN), offset, queued) < 0) {
+				image_reader_pread(fd, chunk, 0, ALIGN_UP(chunk->len, IMAGE_DIRECT_ALIGN));
+				chunk->busy = false;
+			}
+
+			offset += chunk->len;
+			left -= chunk->len;
+			queued++;
+		}
+
+		if (left > 0 && image_reader_stopped(reader)) {
+			left = 0;
+			ret = -EINTR;
+		}
+
+		/* Hand out the reads completed synchronously */
+		while (reader->head != queued && !reader->ring[reader->head % reader->depth].busy)
+			image_reader_publish(reader);
+
+		if (reader->head == queued)
+			continue;
+
+		res = uring_wait(&reader->uring, 1);
+		if (res < 0) {
+			/* Only happens if the ring itself is unusable */
+			ret = res;
+			break;
+		}
+
+		while (uring_reap(&reader->uring, &index, &res)) {
+			chunk = &reader->ring[index % reader->depth];
+
+			/* Not supported by the kernel after all, read it again */
+			if (res == -EINVAL)
+				res = 0;
+
+			if (res < 0) {
+				chunk->error = res;
+				res = 0;
+			}
+
+			/* Finish short reads synchronously, they only happen at EOF */
+			if ((size_t)res < chunk->len && !chunk->error)
+				image_reader_pread(fd, chunk, res,
+						   ALIGN_UP(chunk->len, IMAGE_DIRECT_ALIGN));
+
+			chunk->busy = false;
+		}
+
+		/* Hand out the completed reads, in order */
+		while (reader->head != queued && !reader->ring[reader->head % reader->depth].busy)
+			image_reader_publish(reader);
+	}
+
+	return ret;
+}
+
+/* Stream the decompressed data of a compressed file through the ring */
+static int image_reader_decompress(struct image_reader *reader, struct program *program,
+				   int fd, int format, off_t size)
+{
+	struct image_chunk *chunk;
+	struct decompress dec;
+	unsigned num_sectors;
+	size_t chunk_size;
+	uint8_t extra;
+	off_t avail;
+	off_t skip;
+	size_t left;
+	ssize_t n;
+	int ret;
+
+	ret = decompress_open(&dec, fd, format);
+
+	chunk_size = reader->chunk_size - reader->chunk_size % program->sector_size;
+	num_sectors = program_num_sectors(program, size);
+	left = (size_t)num_sectors * program->sector_size;
+	skip = (off_t)program->file_offset * program->sector_size;
+	avail = size > skip ? size - skip : 0;
+
+	while (left > 0) {
+		chunk = image_reader_slot(reader);
+		if (!chunk)
+			break;
+
+		chunk->program = program;
+		chunk->header = false;
+		chunk->error = ret;
+		chunk->len = MIN(left, chunk_size);
+		chunk->offset = 0;
+
+		/* The file offset applies to the decompressed data */
+		for (n = 0; !chunk->error && skip > 0; skip -= n) {
+			n = decompress_read(&dec, chunk->buf, MIN((off_t)chunk->len, skip));
+			if (n <= 0)
+				chunk->error = n < 0 ? n : -EIO;
+		}
+
+		n = 0;
+		if (!chunk->error) {
+			n = decompress_read(&dec, chunk->buf, chunk->len);
+			if (n < 0)
+				chunk->error = n;
+			else if (n < MIN((off_t)chunk->len, avail))
+				chunk->error = -EIO;
+		}
+
+		if (n >= 0 && (size_t)n < chunk->len)
+			memset((char *)chunk->buf + n, 0, chunk->len - n);
+
+		/* Data beyond the expected size would silently be dropped */
+		if (!chunk->error && left == chunk->len && avail <= (off_t)chunk->len &&
+		    decompress_read(&dec, &extra, 1) != 0) {
+			log_msg(log_error, "[PROGRAM] \"%s\" decompresses to more than %ld bytes\n",
+				program->filename, (long)size);
+			chunk->error = -EFBIG;
+		}
+
+		/* Don't decompress any further after an error */
+		if (chunk->error)
+			ret = chunk->error;
+
+		avail -= MIN((off_t)chunk->len, avail);
+		left -= chunk->len;
+		image_reader_publish(reader);
+	}
+
+	decompress_close(&dec);
+	return 0;
+}
+
+/*
+ * Check whether the decompressed data at @offset starts with the sparse
+ * header magic; sparse images are only handled from uncompressed files
+ */
+static bool image_decompressed_sparse(int fd, int format, off_t offset)
+{
+	struct decompress dec;
+	uint8_t buf[4096];
+	uint32_t magic;
+	ssize_t n = 0;
+
+	if (decompress_open(&dec, fd, format) < 0)
+		return false;
+
+	while (offset > 0 && (n = decompress_read(&dec, buf, MIN(offset, (off_t)sizeof(buf)))) > 0)
+		offset -= n;
+
+	if (!offset)
+		n = decompress_read(&dec, &magic, sizeof(magic));
+
+	decompress_close(&dec);
+
+	return !offset && n == sizeof(magic) && magic == SPARSE_HEADER_MAGIC;
+}
+
+static int image_reader_file(struct image_reader *reader, struct program *program)
+{
+	struct image_chunk *chunk;
+	unsigned num_sectors;
+	size_t chunk_size;
+	bool direct = false;
+	struct stat sb;
+	off_t offset;
+	off_t limit;
+	size_t left;
+	size_t size;
+	int format;
+	int ret = 0;
+	int fd;
+
+	chunk = image_reader_slot(reader);
+	if (!chunk)
+		return -EINTR;
+
+	chunk->program = program;
+	chunk->header = true;
+	chunk->error = 0;
+	chunk->mapped = false;
+	chunk->len = 0;
+
+	fd = program_open(program, reader->incdir);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		chunk->error = -errno;
+		chunk->failure = IMAGE_FAILED_OPEN;
+		if (fd >= 0)
+			close(fd);
+		image_reader_publish(reader);
+		return 0;
+	}
+
+	/* Compressed images are sized by their decompressed data */
+	format = decompress_detect(fd, program->filename, program->decompress);
+	if (format > DECOMPRESS_NONE) {
+		log_msg(log_info, "[PROGRAM] decompressing %s image \"%s\"\n",
+			decompress_name(format), program->filename);
+
+		limit = program->num_sectors ?
+			((off_t)program->file_offset + program->num_sectors) * program->sector_size : 0;
+		ret = decompress_size(fd, format, limit, &sb.st_size);
+		if (ret < 0)
+			format = ret;
+	}
+
+	if (format < 0) {
+		chunk->error = format;
+		chunk->failure = IMAGE_FAILED_DECOMPRESS;
+		close(fd);
+		image_reader_publish(reader);
+		return 0;
+	}
+
+	if (format != DECOMPRESS_NONE &&
+	    (program->sparse ||
+	     image_decompressed_sparse(fd, format, (off_t)program->file_offset * program->sector_size))) {
+		chunk->error = -EOPNOTSUPP;
+		chunk->failure = IMAGE_FAILED_SPARSE;
+		close(fd);
+		image_reader_publish(reader);
+		return 0;
+	}
+
+	chunk->size = sb.st_size;
+
+	if (format != DECOMPRESS_NONE) {
+		image_reader_publish(reader);
+		ret = image_reader_decompress(reader, program, fd, format, sb.st_size);
+		close(fd);
+		return ret;
+	}
+
+	offset = (off_t)program->file_offset * program->sector_size;
+
+	/*
+	 * Leave sparse images, zero scanned and delta programs to the consumer,
+	 * which only reads the parts that are sent, as well as anything that's
+	 * not compressed if only asked to decompress
+	 */
+	chunk->mapped = reader->compressed_only || program->sparse ||
+			program->zero_policy != PROGRAM_ZERO_WRITE ||
+			program->delta_chunk || sparse_detect(fd, offset);
+	image_reader_publish(reader);
+
+	if (chunk->mapped) {
+		close(fd);
+		return 0;
+	}
+
+	/* Same chunking as firehose_program() */
+	chunk_size = reader->chunk_size - reader->chunk_size % program->sector_size;
+	num_sectors = program_num_sectors(program, sb.st_size);
+	left = (size_t)num_sectors * program->sector_size;
+
+	/*
+	 * Bypass the page cache when the reads can be aligned, otherwise at
+	 * least drop what was read from it.
+	 */
+#ifdef O_DIRECT
+	if (reader->direct && !(offset % IMAGE_DIRECT_ALIGN) &&
+	    !(chunk_size % IMAGE_DIRECT_ALIGN))
+		direct = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+#endif
+
+	if (direct && reader->uring.fd >= 0) {
+		ret = image_reader_uring(reader, program, fd, offset, left, chunk_size);
+		close(fd);
+		return ret == -EINTR ? ret : 0;
+	}
+
+	while (left > 0) {
+		chunk = image_reader_slot(reader);
+		if (!chunk)
+			break;
+
+		chunk->program = program;
+		chunk->header = false;
+		chunk->error = 0;
+		chunk->len = MIN(left, chunk_size);
+		chunk->offset = offset;
+
+		size = direct ? ALIGN_UP(chunk->len, IMAGE_DIRECT_ALIGN) : chunk->len;
+		image_reader_pread(fd, chunk, 0, size);
+
+#ifdef POSIX_FADV_DONTNEED
+		if (reader->direct && !direct)
+			posix_fadvise(fd, offset, chunk->len, POSIX_FADV_DONTNEED);
+#endif
+
+		offset += chunk->len;
+		left -= chunk->len;
+		image_reader_publish(reader);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void *image_reader_thread(void *data)
+{
+	struct image_reader *reader = data;
+	struct program *program;
+
+	for (program = reader->programs; program; program = program->next) {
+		if (!program->filename)
+			continue;
+
+		if (image_reader_file(reader, program) < 0)
+			break;
+	}
+
+	pthread_mutex_lock(&reader->lock);
+	reader->done = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	return NULL;
+}
+
+/**
+ * image_reader_start() - start reading ahead of the programs
+ * @reader:	reader to initialize
+ * @programs:	list of programs, in the order they will be consumed
+ * @incdir:	directory searched for the program files, or NULL
+ * @chunk_size:	payload size the data is split in, a multiple of the sector
+ *		size of every program
+ * @depth:	number of payload buffers in the ring
+ * @direct:	read the files with O_DIRECT, through io_uring if available
+ * @compressed_only: only stream compressed files, leaving the others to be
+ *		mapped by the consumer
+ *
+ * The memory used is fixed to @depth buffers of @chunk_size bytes. In
+ * @direct mode the files don't go through the page cache either, except when
+ * the program's file offset isn't aligned, in which case the data read is
+ * dropped from the page cache right away.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int image_reader_start(struct image_reader *reader, struct program *programs,
+		       const char *incdir, size_t chunk_size, unsigned depth,
+		       bool direct, bool compressed_only)
+{
+	unsigned i;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->programs = programs;
+	reader->incdir = incdir;
+	reader->chunk_size = chunk_size;
+	reader->depth = depth;
+	reader->direct = direct;
+	reader->compressed_only = compressed_only;
+	reader->uring.fd = -1;
+
+	reader->ring = calloc(depth, sizeof(*reader->ring));
+	if (!reader->ring)
+		return -ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&reader->ring[i].buf, IMAGE_DIRECT_ALIGN,
+				   ALIGN_UP(chunk_size, IMAGE_DIRECT_ALIGN)))
+			goto err;
+	}
+
+	/* Fall back to synchronous reads if io_uring isn't available */
+	if (direct)
+		uring_init(&reader->uring, depth);
+
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+
+	if (pthread_create(&reader->thread, NULL, image_reader_thread, reader))
+		goto err;
+
+	return 0;
+
+err:
+	uring_exit(&reader->uring);
+	for (i = 0; i < depth; i++)
+		free(reader->ring[i].buf);
+	free(reader->ring);
+	return -ENOMEM;
+}
+
+static struct image_chunk *image_reader_peek(struct image_reader *reader)
+{
+	struct image_chunk *chunk;
+
+	pthread_mutex_lock(&reader->lock);
+	image_reader_release(reader);
+	while (!image_reader_used(reader) && !reader->stop && !reader->done)
+		pthread_cond_wait(&reader->cond, &reader->lock);
+	chunk = image_reader_used(reader) ? &reader->ring[reader->tail % reader->depth] : NULL;
+	pthread_mutex_unlock(&reader->lock);
+
+	return chunk;
+}
+
+/**
+ * image_reader_next() - consume the next entry of the ring
+ * @reader:	reader to consume from
+ *
+ * The previously returned entry is released, and the returned one is valid
+ * until the next call.
+ *
+ * Return: next entry, blocking until it's available
+ */
+struct image_chunk *image_reader_next(struct image_reader *reader)
+{
+	struct image_chunk *chunk;
+
+	chunk = image_reader_peek(reader);
+
+	pthread_mutex_lock(&reader->lock);
+	reader->held = chunk != NULL;
+	pthread_mutex_unlock(&reader->lock);
+
+	return chunk;
+}
+
+/**
+ * image_reader_attach() - let an image consume the data of one program
+ * @image:	image to initialize
+ * @reader:	reader the program's data comes from
+ * @header:	header entry of the program, as returned by image_reader_next()
+ * @sector_size: sector size of the program
+ */
+void image_reader_attach(struct image *image, struct image_reader *reader,
+			 const struct image_chunk *header, unsigned sector_size)
+{
+	memset(image, 0, sizeof(*image));
+	image->fd = -1;
+	image->size = header->size;
+	image->sector_size = sector_size;
+	image->reader = reader;
+}
+
+void image_reader_stop(struct image_reader *reader)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&reader->lock);
+	reader->stop = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	pthread_join(reader->thread, NULL);
+
+	uring_exit(&reader->uring);
+	for (i = 0; i < reader->depth; i++)
+		free(reader->ring[i].buf);
+	free(reader->ring);
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->cond);
+}
+
+static const void *image_read_ahead(struct image *image, size_t len, size_t *n)
+{
+	struct image_chunk *chunk;
+
+	chunk = image_reader_peek(image->reader);
+	if (!chunk || chunk->header || chunk->error || chunk->len != len)
+		return NULL;
+
+	image_reader_next(image->reader);
+	image->bounced = true;
+	*n = len;
+	return chunk->buf;
+}
+
+/**
+ * image_read() - get the data at @offset of the image
+ * @image:	image to read from
+ * @offset:	byte offset in the image
+ * @len:	number of bytes wanted, a multiple of the sector size
+ * @n:		number of bytes returned, at most @len
+ *
+ * Data is returned as a zero-copy slice of the mapped file whenever
+ * possible; only the final partial sector, or everything when the file is
+ * not mapped, is copied and zero padded into the bounce buffer. The bounce
+ * buffer is reused by the next call, as indicated by @image->bounced.
+ *
+ * Return: pointer to @n bytes of data, or NULL on failure
+ */
+const void *image_read(struct image *image, off_t offset, size_t len, size_t *n)
+{
+	size_t count = 0;
+	ssize_t ret;
+	void *buf;
+
+	image->bounced = false;
+
+	if (image->reader)
+		return image_read_ahead(image, len, n);
+
+	if (image->map)
+		return image_read_mapped(image, offset, len, n);
+
+	buf = image_bounce(image, len);
+	if (!buf)
+		return NULL;
+
+	while (count < len) {
+		ret = pread(image->fd, (char *)buf + count, len - count, offset + count);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return NULL;
+		if (ret == 0)
+			break;
+		count += ret;
+	}
+
+	memset((char *)buf + count, 0, len - count);
+	*n = len;
+	return buf;
+}
+
+void image_close(struct image *image)
+{
+	struct image_chunk *chunk;
+
+	/* Skip whatever the consumer didn't use of this program */
+	if (image->reader) {
+		while ((chunk = image_reader_peek(image->reader)) && !chunk->header)
+			image_reader_next(image->reader);
+		image->reader = NULL;
+	}
+
+	if (image->map)
+		munmap(image->map, image->size);
+
+	free(image->bounce);
+	image->map = NULL;
+	image->bounce = NULL;
+}
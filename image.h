@@ -0,0 +1,130 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "uring.h"
+
+struct program;
+struct image_reader;
+
+/* Alignment of O_DIRECT buffers, offsets and lengths */
+#define IMAGE_DIRECT_ALIGN	4096
+
+/**
+ * struct image - source of the data sent by a program command
+ * @fd:		file descriptor of the image
+ * @size:	size of the image file
+ * @sector_size: granularity of the data handed out
+ * @map:	read-only mapping of the whole file, or NULL when the file
+ *		could not be mapped and is read() into @bounce instead
+ * @bounce:	zero padded copy of data not available from @map
+ * @bounce_size: allocated size of @bounce
+ * @bounced:	last image_read() returned data from @bounce, or from a
+ *		read-ahead buffer, which must be flushed out before the next
+ *		call
+ * @reader:	read-ahead pipeline providing the data, or NULL
+ */
+struct image {
+	int fd;
+	off_t size;
+	unsigned sector_size;
+
+	void *map;
+
+	void *bounce;
+	size_t bounce_size;
+	bool bounced;
+
+	struct image_reader *reader;
+};
+
+/* Why the file of a header entry can't be programmed */
+enum {
+	IMAGE_FAILED_OPEN,
+	IMAGE_FAILED_DECOMPRESS,
+	IMAGE_FAILED_SPARSE,
+};
+
+/**
+ * struct image_chunk - entry in the read-ahead ring
+ * @program:	program this entry belongs to
+ * @header:	first entry of a program, carrying @size or @error
+ * @error:	negative errno if the file could not be opened or read
+ * @failure:	IMAGE_FAILED_* stage @error comes from, for header entries
+ * @size:	size of the image file, for header entries
+ * @mapped:	the file is mapped by the consumer instead, for header entries
+ *		of sparse images, zero scanned and delta programs; no data entries
+ *		follow
+ * @buf:	payload buffer, zero padded to @len
+ * @len:	number of bytes in @buf
+ * @offset:	file offset of @buf
+ * @busy:	an io_uring read into @buf is still in flight
+ */
+struct image_chunk {
+	struct program *program;
+	bool header;
+	int error;
+	int failure;
+	off_t size;
+	bool mapped;
+
+	void *buf;
+	size_t len;
+	off_t offset;
+	bool busy;
+};
+
+/**
+ * struct image_reader - read-ahead pipeline feeding firehose_program()
+ *
+ * A reader thread walks the list of programs, opening each file in turn and
+ * reading it in payload sized chunks into a ring of buffers, running ahead
+ * of the USB writer across file boundaries. The consumer holds at most one
+ * entry, which is released on its next request.
+ *
+ * In @direct mode the files are read with O_DIRECT, bypassing the page
+ * cache, into buffers aligned to IMAGE_DIRECT_ALIGN; when io_uring is
+ * available every free buffer of the ring has a read queued in @uring.
+ *
+ * Compressed files are decompressed by the reader thread into the ring; with
+ * @compressed_only set, all other files are left to the consumer.
+ */
+struct image_reader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct image_chunk *ring;
+	unsigned depth;
+	unsigned head;
+	unsigned tail;
+	bool held;
+	bool stop;
+	bool done;
+
+	struct program *programs;
+	const char *incdir;
+	size_t chunk_size;
+
+	bool direct;
+	struct uring uring;
+	bool compressed_only;
+};
+
+int image_open(struct image *image, int fd, unsigned sector_size);
+const void *image_read(struct image *image, off_t offset, size_t len, size_t *n);
+void image_close(struct image *image);
+
+int image_reader_start(struct image_reader *reader, struct program *programs,
+		       const char *incdir, size_t chunk_size, unsigned depth,
+		       bool direct, bool compressed_only);
+struct image_chunk *image_reader_next(struct image_reader *reader);
+void image_reader_attach(struct image *image, struct image_reader *reader,
+			 const struct image_chunk *header, unsigned sector_size);
+void image_reader_stop(struct image_reader *reader);
+
+#endif
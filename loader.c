@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "loader.h"
+#include "qdl.h"
+#include "sha256.h"
+
+#include "python_logging.h"
+
+/*
+ * A directory of firehose programmers is indexed by the HW ID and root
+ * certificate each one is signed for, as found in its attestation
+ * certificate, or in the "<hwid>_<pkhash>_..." naming used by programmer
+ * collections. The index is cached, so that only a stat() of each file is
+ * needed on later runs.
+ */
+
+#define LOADER_MAGIC		"QDLLDR1"
+#define LOADER_NAME_MAX		256
+#define LOADER_HWID_DIGITS	16
+
+/**
+ * struct loader_entry - indexed programmer
+ * @name:		file name within the directory
+ * @size:		size of the file when indexed
+ * @mtime:		modification time of the file when indexed, in ns
+ * @hwid:		HW ID the programmer is signed for, 0 if unknown
+ * @pk_hash:		hash of its root certificate, or a prefix of it
+ * @pk_hash_len:	number of bytes in @pk_hash, 0 if unknown
+ */
+struct loader_entry {
+	char name[LOADER_NAME_MAX];
+	int64_t size;
+	int64_t mtime;
+	uint64_t hwid;
+	uint8_t pk_hash[SHA256_DIGEST_SIZE];
+	uint32_t pk_hash_len;
+};
+
+struct loader_index {
+	char magic[8];
+	uint32_t count;
+	struct loader_entry entries[];
+};
+
+static bool loader_parse_hex(const char *s, size_t digits, uint8_t *out)
+{
+	unsigned v;
+	size_t i;
+
+	for (i = 0; i < digits; i += 2) {
+		if (!isxdigit((unsigned char)s[i]) || !isxdigit((unsigned char)s[i + 1]) ||
+		    sscanf(s + i, "%2x", &v) != 1)
+			return false;
+		out[i / 2] = v;
+	}
+
+	return true;
+}
+
+static uint64_t loader_be64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+/* "02 <16 hex digits> HW_ID", in the OU of the attestation certificate */
+static bool loader_find_hwid(const uint8_t *data, size_t size, uint64_t *hwid)
+{
+	const size_t len = 3 + LOADER_HWID_DIGITS + 1;
+	uint8_t raw[8];
+	size_t i;
+
+	for (i = len; i + 5 <= size; i++) {
+		if (memcmp(data + i, "HW_ID", 5))
+			continue;
+
+		if (memcmp(data + i - len, "02 ", 3) || data[i - 1] != ' ')
+			continue;
+
+		if (loader_parse_hex((const char *)data + i - len + 3, LOADER_HWID_DIGITS, raw)) {
+			*hwid = loader_be64(raw);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Certificates are DER sequences with a two byte length, directly holding
+ * the sequence of the signed part; the root certificate ends the chain.
+ */
+static bool loader_find_root(const uint8_t *data, size_t size, uint8_t *hash)
+{
+	const uint8_t *root = NULL;
+	struct sha256 sha;
+	size_t root_len = 0;
+	size_t len;
+	size_t i;
+
+	for (i = 0; i + 8 <= size; i++) {
+		if (data[i] != 0x30 || data[i + 1] != 0x82 ||
+		    data[i + 4] != 0x30 || data[i + 5] != 0x82)
+			continue;
+
+		len = 4 + (data[i + 2] << 8 | data[i + 3]);
+		if (i + len > size)
+			continue;
+
+		root = data + i;
+		root_len = len;
+		i += len - 1;
+	}
+
+	if (!root)
+		return false;
+
+	sha256_init(&sha);
+	sha256_update(&sha, root, root_len);
+	sha256_final(&sha, hash);
+
+	return true;
+}
+
+static void loader_scan_file(struct loader_entry *entry, int fd, size_t size)
+{
+	uint8_t raw[8];
+	void *data;
+
+	/* Names like "<hwid>_<pkhash prefix>_..." */
+	if (strlen(entry->name) > 2 * LOADER_HWID_DIGITS + 1 &&
+	    entry->name[LOADER_HWID_DIGITS] == '_' &&
+	    loader_parse_hex(entry->name, LOADER_HWID_DIGITS, raw)) {
+		entry->hwid = loader_be64(raw);
+		if (loader_parse_hex(entry->name + LOADER_HWID_DIGITS + 1, 16, entry->pk_hash))
+			entry->pk_hash_len = 8;
+	}
+
+	if (!size)
+		return;
+
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return;
+
+	if (!entry->hwid)
+		loader_find_hwid(data, size, &entry->hwid);
+
+	if (loader_find_root(data, size, entry->pk_hash))
+		entry->pk_hash_len = SHA256_DIGEST_SIZE;
+
+	munmap(data, size);
+}
+
+static int loader_index_build(const char *dir, struct loader_index **out, size_t *out_len)
+{
+	struct loader_entry *entry;
+	struct loader_index *index;
+	struct dirent **names;
+	char path[PATH_MAX];
+	struct stat sb;
+	size_t len;
+	int count;
+	int fd;
+	int i;
+
+	count = scandir(dir, &names, NULL, alphasort);
+	if (count < 0)
+		return -errno;
+
+	len = sizeof(*index) + count * sizeof(*entry);
+	index = calloc(1, len);
+	if (!index) {
+		for (i = 0; i < count; i++)
+			free(names[i]);
+		free(names);
+		return -ENOMEM;
+	}
+
+	memcpy(index->magic, LOADER_MAGIC, sizeof(index->magic));
+
+	for (i = 0; i < count; i++) {
+		entry = &index->entries[index->count];
+
+		if (strlen(names[i]->d_name) >= sizeof(entry->name) ||
+		    snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name) >= (int)sizeof(path))
+			goto next;
+
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			goto next;
+
+		if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+			close(fd);
+			goto next;
+		}
+
+		strcpy(entry->name, names[i]->d_name);
+		entry->size = sb.st_size;
+		entry->mtime = cache_mtime(&sb);
+		loader_scan_file(entry, fd, sb.st_size);
+		close(fd);
+
+		if (qdl_debug)
+			log_msg(log_info, "[LOADER] %s: hwid 0x%016" PRIx64 "%s\n", entry->name,
+				entry->hwid, entry->pk_hash_len ? "" : ", no pk hash");
+
+		if (entry->hwid)
+			index->count++;
+		else
+			memset(entry, 0, sizeof(*entry));
+next:
+		free(names[i]);
+	}
+	free(names);
+
+	*out = index;
+	*out_len = sizeof(*index) + index->count * sizeof(*entry);
+	return 0;
+}
+
+/* The cached index is only used while none of its files changed */
+static bool loader_index_valid(const char *dir, const struct loader_index *index, size_t len)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	unsigned i;
+
+	if (len < sizeof(*index) || memcmp(index->magic, LOADER_MAGIC, sizeof(index->magic)) ||
+	    len != sizeof(*index) + index->count * sizeof(index->entries[0]))
+		return false;
+
+	for (i = 0; i < index->count; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, index->entries[i].name);
+		if (stat(path, &sb) < 0 || sb.st_size != index->entries[i].size ||
+		    cache_mtime(&sb) != index->entries[i].mtime)
+			return false;
+	}
+
+	return true;
+}
+
+static int loader_index_get(const char *dir, struct loader_index **index)
+{
+	struct stat sb;
+	char name[128];
+	void *buf;
+	size_t len;
+	int ret;
+
+	if (stat(dir, &sb) < 0)
+		return -errno;
+
+	/* Adding, removing or renaming programmers changes the directory */
+	snprintf(name, sizeof(name), "loaders-%lx-%lx-%llx-%llx",
+		 (unsigned long)sb.st_dev, (unsigned long)sb.st_ino,
+		 (unsigned long long)cache_mtime(&sb),
+		 (unsigned long long)cache_ctime(&sb));
+
+	if (!cache_read(name, &buf, &len)) {
+		if (loader_index_valid(dir, buf, len)) {
+			if (qdl_debug)
+				log_msg(log_info, "[LOADER] using cached index %s\n", name);
+			*index = buf;
+			return 0;
+		}
+		free(buf);
+	}
+
+	ret = loader_index_build(dir, index, &len);
+	if (ret < 0)
+		return ret;
+
+	cache_store(name, *index, len);
+
+	return 0;
+}
+
+/* Higher is better, negative if @entry is not meant for the device */
+static int loader_score(const struct loader_entry *entry, const struct loader_id *id)
+{
+	size_t n;
+	int score;
+
+	if (entry->hwid == id->hwid)
+		score = 2;
+	else if (entry->hwid >> 32 == id->hwid >> 32 && !(uint32_t)entry->hwid)
+		score = 1;
+	else
+		return -1;
+
+	/* A SHA-384 root hash can't be told from the SHA-256 we compute */
+	if (entry->pk_hash_len && id->pk_hash_len == SHA256_DIGEST_SIZE) {
+		n = entry->pk_hash_len;
+		if (memcmp(entry->pk_hash, id->pk_hash, n))
+			return -1;
+		score += 2;
+	}
+
+	return score;
+}
+
+/**
+ * loader_select() - pick the programmer for a device
+ * @dir:	directory of programmers
+ * @id:		identity of the device
+ * @path:	buffer receiving the path of the programmer
+ * @len:	size of @path
+ *
+ * Programmers signed for the exact HW ID of the device are preferred over
+ * those signed for its MSM ID only, and any known root certificate hash must
+ * match the PK hash of the device.
+ *
+ * Return: 0 on success, -ENOENT if no programmer matches, negative errno on
+ * failure
+ */
+int loader_select(const char *dir, const struct loader_id *id, char *path, size_t len)
+{
+	const struct loader_entry *best = NULL;
+	struct loader_index *index;
+	int best_score = -1;
+	unsigned i;
+	int score;
+	int ret;
+
+	ret = loader_index_get(dir, &index);
+	if (ret < 0) {
+		log_msg(log_error, "[LOADER] unable to index %s: %s\n", dir, strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < index->count; i++) {
+		score = loader_score(&index->entries[i], id);
+		if (score > best_score) {
+			best = &index->entries[i];
+			best_score = score;
+		}
+	}
+
+	if (!best) {
+		log_msg(log_error, "[LOADER] no programmer for hwid 0x%016" PRIx64 " in %s\n",
+			id->hwid, dir);
+		ret = -ENOENT;
+	} else if (snprintf(path, len, "%s/%s", dir, best->name) >= (int)len) {
+		ret = -ENAMETOOLONG;
+	} else {
+		log_msg(log_info, "[LOADER] selected %s\n", path);
+	}
+
+	free(index);
+	return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct loader_id - identity of a device, read in Sahara command mode
+ * @serial:		serial number of the chip
+ * @hwid:		MSM HW ID, the MSM ID in the upper 32 bits followed by
+ *			the OEM ID and model ID
+ * @pk_hash:		hash of the OEM root certificate
+ * @pk_hash_len:	number of bytes in @pk_hash, 0 if unknown
+ */
+struct loader_id {
+	uint32_t serial;
+	uint64_t hwid;
+	uint8_t pk_hash[64];
+	size_t pk_hash_len;
+};
+
+int loader_select(const char *dir, const struct loader_id *id, char *path, size_t len);
+
+#endif
@@ -29,6 +29,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -98,19 +99,43 @@ int patch_load(const char *patch_file)
 	return 0;
 }
 	
-int patch_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct patch *patch))
+/**
+ * patch_execute() - apply the patches targeting the disk
+ * @qdl:	device to apply the patches to
+ * @apply:	handler applying @count patches, in order
+ *
+ * All the patches are handed to @apply at once, allowing it to batch them.
+ *
+ * Return: 0 on success, the error of @apply or negative errno on failure
+ */
+int patch_execute(struct qdl_device *qdl,
+		  int (*apply)(struct qdl_device *qdl, struct patch **patches, unsigned count))
 {
+	struct patch **list;
 	struct patch *patch;
+	unsigned count = 0;
 	int ret;
 
 	for (patch = patches; patch; patch = patch->next) {
-		if (strcmp(patch->filename, "DISK"))
-			continue;
+		if (!strcmp(patch->filename, "DISK"))
+			count++;
+	}
 
-		ret = apply(qdl, patch);
-		if (ret)
-			return ret;
+	if (!count)
+		return 0;
+
+	list = calloc(count, sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	count = 0;
+	for (patch = patches; patch; patch = patch->next) {
+		if (!strcmp(patch->filename, "DISK"))
+			list[count++] = patch;
 	}
 
-	return 0;
+	ret = apply(qdl, list, count);
+	free(list);
+
+	return ret;
 }
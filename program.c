@@ -30,11 +30,15 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include "decompress.h"
+#include "image.h"
 #include "program.h"
 #include "qdl.h"
 
@@ -43,11 +47,109 @@
 static struct program *programes;
 static struct program *programes_last;
 
+struct program_zero_rule {
+	char *label;
+	int policy;
+
+	struct program_zero_rule *next;
+};
+
+static struct program_zero_rule *program_zero_rules;
+static int program_zero_default = PROGRAM_ZERO_WRITE;
+
+static size_t program_delta_chunk;
+static bool program_decompress_any;
+
+/**
+ * program_delta() - only program the chunks that differ on the device
+ * @chunk:	size of the chunks compared, in bytes, 0 to program everything
+ *
+ * Must be called before program_load().
+ */
+void program_delta(size_t chunk)
+{
+	program_delta_chunk = chunk;
+}
+
+/**
+ * program_decompress() - decompress program files whatever their name
+ * @any:	detect compressed files by their content, not only by their
+ *		.gz, .xz or .zst extension
+ *
+ * Must be called before program_load().
+ */
+void program_decompress(bool any)
+{
+	program_decompress_any = any;
+}
+
+/**
+ * program_zero_policy() - select how all-zero extents are programmed
+ * @spec:	"<policy>" to set the default, or "<label>=<policy>" for the
+ *		partition with the given label, where policy is one of "write",
+ *		"skip" or "erase"
+ *
+ * Must be called before program_load(). By default every sector is written.
+ *
+ * Return: 0 on success, -EINVAL if @spec is invalid
+ */
+int program_zero_policy(const char *spec)
+{
+	static const char * const names[] = {
+		[PROGRAM_ZERO_WRITE] = "write",
+		[PROGRAM_ZERO_SKIP] = "skip",
+		[PROGRAM_ZERO_ERASE] = "erase",
+	};
+	struct program_zero_rule *rule;
+	const char *policy;
+	const char *eq;
+	int i;
+
+	eq = strchr(spec, '=');
+	policy = eq ? eq + 1 : spec;
+
+	for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+		if (!strcmp(policy, names[i]))
+			break;
+	}
+	if (i == (int)(sizeof(names) / sizeof(names[0])) || eq == spec)
+		return -EINVAL;
+
+	if (!eq) {
+		program_zero_default = i;
+		return 0;
+	}
+
+	rule = calloc(1, sizeof(*rule));
+	if (!rule)
+		return -ENOMEM;
+
+	rule->label = strndup(spec, eq - spec);
+	rule->policy = i;
+	rule->next = program_zero_rules;
+	program_zero_rules = rule;
+
+	return 0;
+}
+
+static int program_zero_lookup(const char *label)
+{
+	struct program_zero_rule *rule;
+
+	for (rule = program_zero_rules; rule; rule = rule->next) {
+		if (label && !strcmp(rule->label, label))
+			return rule->policy;
+	}
+
+	return program_zero_default;
+}
+
 int program_load(const char *program_file)
 {
 	struct program *program;
 	xmlNode *node;
 	xmlNode *root;
+	xmlChar *value;
 	xmlDoc *doc;
 	int errors;
 
@@ -79,6 +181,16 @@ int program_load(const char *program_file)
 		program->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
 		program->start_sector = attr_as_string(node, "start_sector", &errors);
 
+		value = xmlGetProp(node, (xmlChar*)"sparse");
+		if (value) {
+			program->sparse = !xmlStrcmp(value, (xmlChar*)"true");
+			xmlFree(value);
+		}
+
+		program->zero_policy = program_zero_lookup(program->label);
+		program->delta_chunk = program_delta_chunk;
+		program->decompress = program_decompress_any;
+
 		if (errors) {
 			log_msg(log_error, "[PROGRAM] errors while parsing program\n");
 			free(program);
@@ -99,14 +211,81 @@ int program_load(const char *program_file)
 	return 0;
 }
 
+/**
+ * program_open() - open the file of a program
+ * @program:	program to open the file of
+ * @incdir:	directory searched first for the file, or NULL
+ *
+ * Return: file descriptor, or -1 with errno set on failure
+ */
+int program_open(struct program *program, const char *incdir)
+{
+	const char *filename;
+	char tmp[PATH_MAX];
+
+	filename = program->filename;
+	if (incdir) {
+		snprintf(tmp, PATH_MAX, "%s/%s", incdir, filename);
+		if (access(tmp, F_OK) != -1)
+			filename = tmp;
+	}
+
+	return open(filename, O_RDONLY);
+}
+
+/**
+ * program_num_sectors() - number of sectors to send for an image
+ * @program:	program the image belongs to
+ * @size:	size of the image, in bytes
+ *
+ * Returns the size of the image rounded up to whole sectors, truncated to
+ * the size of the partition when the program specifies one.
+ */
+unsigned program_num_sectors(struct program *program, off_t size)
+{
+	unsigned num_sectors;
+
+	num_sectors = (size + program->sector_size - 1) / program->sector_size;
+	if (program->num_sectors && num_sectors > program->num_sectors)
+		num_sectors = program->num_sectors;
+
+	return num_sectors;
+}
+
+/* Check if any of the program files is compressed */
+static bool program_compressed(const char *incdir)
+{
+	struct program *program;
+	bool compressed = false;
+	int fd;
+
+	for (program = programes; program && !compressed; program = program->next) {
+		if (!program->filename)
+			continue;
+
+		fd = program_open(program, incdir);
+		if (fd < 0)
+			continue;
+
+		compressed = decompress_detect(fd, program->filename,
+					       program->decompress) != DECOMPRESS_NONE;
+		close(fd);
+	}
+
+	return compressed;
+}
+
 int program_execute(struct qdl_device *qdl,
                     int (*apply)(struct qdl_device *qdl,
-                                 struct program *program, int fd),
+                                 struct program *program, struct image *image),
                     const char *incdir, void *progress_callback_context) {
+  struct image_reader reader;
+  struct image_chunk *header;
   struct program *program;
-  const char *filename;
-  char tmp[PATH_MAX];
-  int ret;
+  struct image image;
+  unsigned read_ahead;
+  bool compressed_only;
+  int ret = 0;
   int fd;
 
   int program_count = 0;
@@ -116,6 +295,23 @@ int program_execute(struct qdl_device *qdl,
     ++program_count;
 	}
 
+	/* Compressed images can only be streamed through the reader */
+	read_ahead = qdl->read_ahead;
+	compressed_only = !read_ahead && program_compressed(incdir);
+	if (compressed_only)
+		read_ahead = QDL_READ_AHEAD_DEFAULT;
+
+	if (read_ahead) {
+		ret = image_reader_start(&reader, programes, incdir,
+					 qdl->max_payload_size, read_ahead,
+					 qdl->direct_io, compressed_only);
+		if (ret < 0)
+			return ret;
+
+		if (qdl_debug && qdl->direct_io && reader.uring.fd < 0)
+			log_msg(log_info, "[PROGRAM] io_uring unavailable, using synchronous O_DIRECT reads\n");
+	}
+
   int current_program = 0;
 	for (program = programes; program; program = program->next) {
 		if (!program->filename)
@@ -123,28 +319,63 @@ int program_execute(struct qdl_device *qdl,
     log_msg(log_info, "[PROGRAM] %d/%d\n", ++current_program, program_count);
     progress_callback(progress_callback_context, current_program, program_count);
 
-		filename = program->filename;
-		if (incdir) {
-			snprintf(tmp, PATH_MAX, "%s/%s", incdir, filename);
-			if (access(tmp, F_OK) != -1)
-				filename = tmp;
+		fd = -1;
+		header = NULL;
+		if (read_ahead) {
+			header = image_reader_next(&reader);
+			if (header && header->error &&
+			    header->failure == IMAGE_FAILED_SPARSE) {
+				log_msg(log_error, "[PROGRAM] \"%s\" is a compressed sparse image, decompress it first\n",
+					program->filename);
+				ret = header->error;
+				break;
+			}
+
+			if (header && header->error &&
+			    header->failure == IMAGE_FAILED_DECOMPRESS) {
+				log_msg(log_error, "[PROGRAM] unable to decompress \"%s\"\n",
+					program->filename);
+				ret = header->error;
+				break;
+			}
+
+			if (!header || header->error) {
+				log_msg(log_info, "Unable to open %s...ignoring\n", program->filename);
+				continue;
+			}
 		}
 
-		fd = open(filename, O_RDONLY);
+		/* Sparse and zero scanned images are mapped instead */
+		if (header && !header->mapped) {
+			image_reader_attach(&image, &reader, header, program->sector_size);
+		} else {
+			fd = program_open(program, incdir);
+			if (fd < 0) {
+				log_msg(log_info, "Unable to open %s...ignoring\n", program->filename);
+				continue;
+			}
 
-		if (fd < 0) {
-			log_msg(log_info, "Unable to open %s...ignoring\n", program->filename);
-			continue;
+			ret = image_open(&image, fd, program->sector_size);
+			if (ret < 0) {
+				log_msg(log_error, "[PROGRAM] failed to stat \"%s\"\n", program->filename);
+				close(fd);
+				break;
+			}
 		}
 
-		ret = apply(qdl, program, fd);
+		ret = apply(qdl, program, &image);
 
-		close(fd);
+		image_close(&image);
+		if (fd >= 0)
+			close(fd);
 		if (ret)
-			return ret;
+			break;
 	}
 
-	return 0;
+	if (read_ahead)
+		image_reader_stop(&reader);
+
+	return ret;
 }
 
 /**
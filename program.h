@@ -2,8 +2,21 @@
 #define __PROGRAM_H__
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include "qdl.h"
 
+struct image;
+
+/* Size of the chunks compared by delta programming, unless specified */
+#define PROGRAM_DELTA_CHUNK_DEFAULT	(1024 * 1024)
+
+/* What to do with the all-zero extents of a program's image */
+enum {
+	PROGRAM_ZERO_WRITE,
+	PROGRAM_ZERO_SKIP,
+	PROGRAM_ZERO_ERASE,
+};
+
 struct program {
 	unsigned sector_size;
 	unsigned file_offset;
@@ -12,13 +25,22 @@ struct program {
 	unsigned num_sectors;
 	unsigned partition;
 	const char *start_sector;
+	bool sparse;
+	bool decompress;
+	int zero_policy;
+	size_t delta_chunk;
 
 	struct program *next;
 };
 
+int program_zero_policy(const char *spec);
+void program_delta(size_t chunk);
+void program_decompress(bool any);
 int program_load(const char *program_file);
-int program_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct program *program, int fd),
+int program_execute(struct qdl_device *qdl, int (*apply)(struct qdl_device *qdl, struct program *program, struct image *image),
                     const char *incdir, void* progress_callback_context);
+int program_open(struct program *program, const char *incdir);
+unsigned program_num_sectors(struct program *program, off_t size);
 int program_find_bootable_partition(void);
 void progress_callback(void *context, int current, int total);
 #endif
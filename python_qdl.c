@@ -25,7 +25,7 @@ static PyObject *qdl_run(PyObject *self, PyObject *args) {
   const char *patch;
   int type;
   int ret;
-  struct qdl_device qdl;
+  struct qdl_device qdl = {};
   PyObject *py_progress_callback;
 
   if (!PyArg_ParseTuple(args, "ssssO", &storage, &mbn, &program, &patch, &py_progress_callback))
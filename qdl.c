@@ -46,6 +46,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "patch.h"
 #include "qdl.h"
@@ -84,6 +85,10 @@ int detect_type(const char *xml_file) {
         type = QDL_FILE_UFS;
         break;
       }
+      if (!xmlStrcmp(node->name, (xmlChar *)"read")) {
+        type = QDL_FILE_READ;
+        break;
+      }
     }
   } else if (!xmlStrcmp(root->name, (xmlChar *)"contents")) {
     type = QDL_FILE_CONTENTS;
@@ -168,17 +173,63 @@ int parse_sc20_device(libusb_device *device, struct qdl_device *qdl, int *intf,
   return -ENOENT;
 }
 
-int find_device(struct qdl_device *qdl) {
+static void qdl_libusb_path(libusb_device *device, char *path, size_t len) {
+  uint8_t ports[8];
+  int n;
+  int i;
+  int off;
+
+  off = snprintf(path, len, "%d", libusb_get_bus_number(device));
+  n = libusb_get_port_numbers(device, ports, sizeof(ports));
+  for (i = 0; i < n && off < len; i++)
+    off += snprintf(path + off, len - off, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+static int qdl_libusb_list(char (*paths)[QDL_PATH_MAX], int max) {
+  struct qdl_device tmp = {};
   libusb_device **list;
-  libusb_device *found = NULL;
   ssize_t cnt = libusb_get_device_list(NULL, &list);
+  ssize_t i;
+  int count = 0;
+  int intf;
+
+  if (cnt < 0)
+    return 0;
+
+  for (i = 0; i < cnt && count < max; i++) {
+    bool is_an_sc20 = false;
+
+    if (parse_sc20_device(list[i], &tmp, &intf, &is_an_sc20) || !is_an_sc20)
+      continue;
+
+    qdl_libusb_path(list[i], paths[count++], QDL_PATH_MAX);
+  }
+
+  libusb_free_device_list(list, 1);
+  return count;
+}
+
+static int qdl_libusb_open(struct qdl_device *qdl) {
+  char path[QDL_PATH_MAX];
+  libusb_device **list;
+  libusb_device *found = NULL;
+  ssize_t cnt;
   ssize_t i = 0;
   int err = 0;
   int intf;
 
+  /*
+   * Each device gets its own context, so that completions of its
+   * asynchronous transfers are only ever handled by the thread driving it.
+   */
+  if (!qdl->ctx && (err = libusb_init(&qdl->ctx))) {
+    log_msg(log_error, "Could not initialize libusb\n");
+    return err;
+  }
+
+  cnt = libusb_get_device_list(qdl->ctx, &list);
   if (cnt < 0) {
     log_msg(log_error, "No USB device found\n");
-    libusb_free_device_list(list, 1);
     return -ENOENT;
   }
 
@@ -192,26 +243,39 @@ int find_device(struct qdl_device *qdl) {
       return err;
     }
 
-    if (is_an_sc20) {
-      found = device;
-      break;
+    if (!is_an_sc20)
+      continue;
+
+    if (qdl->path[0]) {
+      qdl_libusb_path(device, path, sizeof(path));
+      if (strcmp(path, qdl->path))
+        continue;
     }
+
+    found = device;
+    break;
   }
 
   if (!found) {
     log_msg(log_error, "Device not found");
+    libusb_free_device_list(list, 1);
     return -ENOENT;
   }
 
+  if (!qdl->path[0])
+    qdl_libusb_path(found, qdl->path, sizeof(qdl->path));
+
   err = libusb_open(found, &qdl->device);
   if (err) {
     log_msg(log_error, "Could not open USB device\n");
+    libusb_free_device_list(list, 1);
     return err;
   }
 
   libusb_detach_kernel_driver(qdl->device, intf);
   if ((err = libusb_claim_interface(qdl->device, intf))) {
     log_msg(log_error, "Could not claim USB interface");
+    libusb_free_device_list(list, 1);
     return err;
   }
 
@@ -219,63 +283,448 @@ int find_device(struct qdl_device *qdl) {
   return 0;
 }
 
-int qdl_read(struct qdl_device *qdl, void *buf, size_t len,
-             unsigned int timeout) {
+static int qdl_libusb_read(struct qdl_device *qdl, void *buf, size_t len,
+                           unsigned int timeout) {
   int n;
   int err =
       libusb_bulk_transfer(qdl->device, qdl->in_ep, buf, len, &n, timeout);
   if (err) {
     // log_msg(log_info, "QDL read failed: %d\n", err);
-    return -1;
+    return err == LIBUSB_ERROR_TIMEOUT ? -ETIMEDOUT : -1;
   }
   return n;
 }
 
-int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot) {
-  unsigned char *data = (unsigned char *)buf;
-  unsigned count = 0;
-  size_t len_orig = len;
-  int n;
+static void qdl_write_complete(struct libusb_transfer *transfer) {
+  struct qdl_xfer *xfer = transfer->user_data;
+  struct qdl_device *qdl = xfer->qdl;
+
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+      log_msg(log_error, "ERROR: bulk write transfer failed: %d\n",
+              transfer->status);
+    qdl->out_error = -1;
+  } else if (transfer->actual_length != transfer->length) {
+    log_msg(log_error, "ERROR: short bulk write: %d of %d\n",
+            transfer->actual_length, transfer->length);
+    qdl->out_error = -1;
+  }
+
+  xfer->busy = false;
+  qdl->out_inflight--;
+}
+
+unsigned int qdl_out_queue_depth(struct qdl_device *qdl) {
+  unsigned int depth = qdl->out_queue_depth;
+
+  if (depth == 0)
+    return QDL_OUT_QUEUE_DEFAULT;
+  if (depth > QDL_OUT_QUEUE_MAX)
+    return QDL_OUT_QUEUE_MAX;
+  return depth;
+}
+
+/*
+ * Cancel and retire all outstanding bulk-OUT transfers after an error, so
+ * that none of them still points at the caller's buffers once it returns
+ */
+static void qdl_write_discard(struct qdl_device *qdl) {
+  unsigned int i;
   int err;
 
-  if (len == 0) {
-    n = libusb_bulk_transfer(qdl->device, qdl->out_ep, data, 0, NULL, 1000);
-    if (n != 0) {
-      log_msg(log_error, "ERROR: n = %d, errno = %d (%s)\n", n, errno,
-              strerror(errno));
+  for (i = 0; i < QDL_OUT_QUEUE_MAX; i++) {
+    if (qdl->out_xfers[i].busy)
+      libusb_cancel_transfer(qdl->out_xfers[i].transfer);
+  }
+
+  while (qdl->out_inflight) {
+    err = libusb_handle_events_completed(qdl->ctx, NULL);
+    if (err && err != LIBUSB_ERROR_INTERRUPTED)
+      break;
+  }
+
+  qdl->out_error = -1;
+}
+
+/* Block until at most @limit bulk-OUT transfers are in flight */
+static int qdl_write_wait(struct qdl_device *qdl, unsigned int limit) {
+  int err;
+
+  while (qdl->out_inflight > limit) {
+    err = libusb_handle_events_completed(qdl->ctx, NULL);
+    if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+      log_msg(log_error, "ERROR: failed to handle USB events: %d\n", err);
+      qdl_write_discard(qdl);
       return -1;
     }
-    return 0;
   }
 
-  while (len > 0) {
-    int xfer;
-    xfer = (len > qdl->out_maxpktsize) ? qdl->out_maxpktsize : len;
+  return 0;
+}
+
+static int qdl_libusb_submit(struct qdl_device *qdl, const void *data,
+                             size_t len) {
+  unsigned int depth = qdl_out_queue_depth(qdl);
+  struct qdl_xfer *xfer = NULL;
+  unsigned int i;
+  int err;
+
+  if (qdl_write_wait(qdl, depth - 1) < 0)
+    return -1;
+
+  for (i = 0; i < depth; i++) {
+    if (!qdl->out_xfers[i].busy) {
+      xfer = &qdl->out_xfers[i];
+      break;
+    }
+  }
+  assert(xfer);
 
-    err = libusb_bulk_transfer(qdl->device, qdl->out_ep, data, xfer, &n, 1000);
-    if (err != 0) {
-      log_msg(log_error, "ERROR: bulk write transfer failed: %d\n", err);
+  if (!xfer->transfer) {
+    xfer->transfer = libusb_alloc_transfer(0);
+    if (!xfer->transfer) {
+      log_msg(log_error, "ERROR: failed to allocate bulk transfer\n");
+      qdl_write_discard(qdl);
       return -1;
     }
-    if (n != xfer) {
-      log_msg(log_error, "ERROR: n = %d, errno = %d (%s)\n", n, errno,
-              strerror(errno));
+    xfer->qdl = qdl;
+  }
+
+  libusb_fill_bulk_transfer(xfer->transfer, qdl->device, qdl->out_ep,
+                            (unsigned char *)data, len, qdl_write_complete,
+                            xfer, 1000);
+
+  err = libusb_submit_transfer(xfer->transfer);
+
+  /* usbfs_memory_mb is shared by all devices, wait for ours to free some */
+  while (err == LIBUSB_ERROR_NO_MEM && qdl->out_inflight) {
+    if (qdl_write_wait(qdl, qdl->out_inflight - 1) < 0)
+      return -1;
+    err = libusb_submit_transfer(xfer->transfer);
+  }
+
+  if (err) {
+    log_msg(log_error, "ERROR: failed to submit bulk write: %d\n", err);
+    qdl_write_discard(qdl);
+    return -1;
+  }
+
+  xfer->busy = true;
+  qdl->out_inflight++;
+  return 0;
+}
+
+static int qdl_libusb_flush(struct qdl_device *qdl) {
+  return qdl_write_wait(qdl, 0);
+}
+
+static void qdl_read_complete(struct libusb_transfer *transfer) {
+  struct qdl_in_xfer *xfer = transfer->user_data;
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    xfer->actual = transfer->actual_length;
+  } else {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+      log_msg(log_error, "ERROR: bulk read transfer failed: %d\n",
+              transfer->status);
+    xfer->actual = -1;
+  }
+
+  xfer->done = true;
+}
+
+static int qdl_libusb_read_submit(struct qdl_device *qdl,
+                                  struct qdl_in_xfer *xfer) {
+  int err;
+
+  if (!xfer->transfer) {
+    xfer->transfer = libusb_alloc_transfer(0);
+    if (!xfer->transfer) {
+      log_msg(log_error, "ERROR: failed to allocate bulk transfer\n");
       return -1;
     }
+    xfer->qdl = qdl;
+  }
+
+  libusb_fill_bulk_transfer(xfer->transfer, qdl->device, qdl->in_ep, xfer->buf,
+                            xfer->len, qdl_read_complete, xfer, 0);
+
+  err = libusb_submit_transfer(xfer->transfer);
+  if (err) {
+    log_msg(log_error, "ERROR: failed to submit bulk read: %d\n", err);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int qdl_libusb_read_reap(struct qdl_device *qdl,
+                                struct qdl_in_xfer *xfer,
+                                unsigned int timeout) {
+  struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+  struct timespec start;
+  struct timespec now;
+  long elapsed;
+  int err;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (!xfer->done) {
+    err = libusb_handle_events_timeout_completed(qdl->ctx, &tv, NULL);
+    if (err && err != LIBUSB_ERROR_INTERRUPTED) {
+      log_msg(log_error, "ERROR: failed to handle USB events: %d\n", err);
+      return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+              (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (!xfer->done && elapsed >= timeout) {
+      log_msg(log_error, "ERROR: bulk read timed out\n");
+      return -ETIMEDOUT;
+    }
+  }
+
+  return xfer->actual;
+}
+
+static void qdl_libusb_read_cancel(struct qdl_device *qdl) {
+  struct qdl_in_xfer *xfer;
+  unsigned int i;
+
+  for (i = 0; i < qdl->in_count; i++) {
+    xfer = &qdl->in_xfers[(qdl->in_head + i) % QDL_IN_QUEUE_MAX];
+    if (!xfer->done)
+      libusb_cancel_transfer(xfer->transfer);
+  }
+
+  for (i = 0; i < qdl->in_count; i++) {
+    xfer = &qdl->in_xfers[(qdl->in_head + i) % QDL_IN_QUEUE_MAX];
+    while (!xfer->done && !libusb_handle_events_completed(qdl->ctx, NULL))
+      ;
+  }
+}
+
+const struct qdl_transport qdl_libusb_transport = {
+    .name = "libusb",
+    .list = qdl_libusb_list,
+    .open = qdl_libusb_open,
+    .read = qdl_libusb_read,
+    .submit = qdl_libusb_submit,
+    .flush = qdl_libusb_flush,
+    .read_submit = qdl_libusb_read_submit,
+    .read_reap = qdl_libusb_read_reap,
+    .read_cancel = qdl_libusb_read_cancel,
+};
+
+static const struct qdl_transport *qdl_transports[] = {
+    &qdl_libusb_transport,
+    &qdl_sim_transport,
+#ifdef __linux__
+    &qdl_usbfs_transport,
+#endif
+};
+
+const struct qdl_transport *qdl_transport_find(const char *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(qdl_transports) / sizeof(qdl_transports[0]); i++) {
+    if (!strcmp(qdl_transports[i]->name, name))
+      return qdl_transports[i];
+  }
+
+  return NULL;
+}
+
+int find_device(struct qdl_device *qdl) {
+  if (!qdl->transport)
+    qdl->transport = &qdl_libusb_transport;
+
+  return qdl->transport->open(qdl);
+}
+
+/**
+ * find_devices() - list the EDL devices available through a transport
+ * @transport:	backend to use, NULL for the default
+ * @paths:	filled with the bus/port path of each device
+ * @max:	number of entries in @paths
+ *
+ * Return: number of devices found
+ */
+int find_devices(const struct qdl_transport *transport,
+                 char (*paths)[QDL_PATH_MAX], int max) {
+  if (!transport)
+    transport = &qdl_libusb_transport;
+
+  return transport->list(paths, max);
+}
+
+int qdl_read(struct qdl_device *qdl, void *buf, size_t len,
+             unsigned int timeout) {
+  return qdl->transport->read(qdl, buf, len, timeout);
+}
+
+/**
+ * qdl_read_queue() - queue a bulk-IN transfer
+ * @qdl:	device to read from
+ * @buf:	buffer receiving the data, must stay valid until the transfer is
+ *		reaped or cancelled
+ * @len:	size of @buf
+ *
+ * Keeping several transfers queued lets the host controller move data
+ * without waiting for the caller between transfers. Transfers are reaped in
+ * the order they were queued, by qdl_read_reap().
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int qdl_read_queue(struct qdl_device *qdl, void *buf, size_t len) {
+  struct qdl_in_xfer *xfer;
+
+  if (qdl->in_count == QDL_IN_QUEUE_MAX)
+    return -1;
+
+  xfer = &qdl->in_xfers[(qdl->in_head + qdl->in_count) % QDL_IN_QUEUE_MAX];
+  xfer->buf = buf;
+  xfer->len = len;
+  xfer->actual = 0;
+  xfer->done = false;
+
+  if (qdl->transport->read_submit &&
+      qdl->transport->read_submit(qdl, xfer) < 0)
+    return -1;
+
+  qdl->in_count++;
+  return 0;
+}
+
+/**
+ * qdl_read_reap() - wait for the oldest queued bulk-IN transfer
+ * @qdl:	device to read from
+ * @timeout:	time to wait for the transfer to complete, in ms
+ *
+ * A transfer may complete short, when the device ends its write with a short
+ * packet, the data that follows is received by the next transfer.
+ *
+ * Return: number of bytes received, -ETIMEDOUT if the transfer didn't
+ * complete in time, or -EIO on failure
+ */
+int qdl_read_reap(struct qdl_device *qdl, unsigned int timeout) {
+  struct qdl_in_xfer *xfer = &qdl->in_xfers[qdl->in_head];
+  int ret;
+
+  if (!qdl->in_count)
+    return -EIO;
+
+  if (qdl->transport->read_submit)
+    ret = qdl->transport->read_reap(qdl, xfer, timeout);
+  else
+    ret = qdl->transport->read(qdl, xfer->buf, xfer->len, timeout);
+
+  /* Failed transfers are left in the queue, for qdl_read_cancel() */
+  if (ret < 0)
+    return ret == -ETIMEDOUT ? ret : -EIO;
+
+  qdl->in_head = (qdl->in_head + 1) % QDL_IN_QUEUE_MAX;
+  qdl->in_count--;
+  return ret;
+}
+
+/**
+ * qdl_read_cancel() - retire all queued bulk-IN transfers
+ * @qdl:	device to cancel the transfers of
+ */
+void qdl_read_cancel(struct qdl_device *qdl) {
+  if (qdl->in_count && qdl->transport->read_cancel)
+    qdl->transport->read_cancel(qdl);
+
+  qdl->in_head = 0;
+  qdl->in_count = 0;
+}
+
+static int qdl_write_submit(struct qdl_device *qdl, const void *data,
+                            size_t len) {
+  if (qdl->transport->submit(qdl, data, len) < 0)
+    return -1;
+
+  if (len)
+    qdl->out_transfers++;
+  else
+    qdl->out_zlps++;
+  return 0;
+}
+
+/**
+ * qdl_write_queue() - queue a buffer for asynchronous transmission
+ * @qdl:	device to write to
+ * @buf:	data to send, must stay valid until qdl_write_flush() returns
+ * @len:	number of bytes in @buf
+ * @eot:	terminate the transfer with a zero length packet if needed
+ *
+ * The buffer is split in bulk transfers of out_xfer_size bytes, or max packet
+ * size when unset, which are kept in flight up to the configured queue depth;
+ * this only blocks while the queue is full. Large transfers are split in
+ * packets by the host controller and only the end of the buffer is
+ * terminated by a zero length packet, as requested by @eot.
+ *
+ * Return: number of bytes queued, or -1 on failure
+ */
+int qdl_write_queue(struct qdl_device *qdl, const void *buf, size_t len,
+                    bool eot) {
+  unsigned char *data = (unsigned char *)buf;
+  size_t xfer_size = qdl->out_xfer_size;
+  size_t count = 0;
+  size_t len_orig = len;
+
+  if (qdl->out_error)
+    return -1;
+
+  /* A short packet would end the transfer early on the device side */
+  xfer_size -= xfer_size % qdl->out_maxpktsize;
+  if (!xfer_size)
+    xfer_size = qdl->out_maxpktsize;
+
+  while (len > 0) {
+    size_t xfer = (len > xfer_size) ? xfer_size : len;
+
+    if (qdl_write_submit(qdl, data, xfer) < 0)
+      return -1;
+
     count += xfer;
     len -= xfer;
     data += xfer;
   }
 
   if (eot && (len_orig % qdl->out_maxpktsize) == 0) {
-    err = libusb_bulk_transfer(qdl->device, qdl->out_ep, NULL, 0, &n, 1000);
-    if (err != 0) {
-      log_msg(log_error, "ERROR: last bulk write transfer failed\n");
+    if (qdl_write_submit(qdl, NULL, 0) < 0)
       return -1;
-    }
-    if (n < 0)
-      return n;
   }
 
   return count;
 }
+
+/**
+ * qdl_write_flush() - wait for all queued bulk-OUT transfers to complete
+ * @qdl:	device to wait for
+ *
+ * Return: 0 when all transfers succeeded, -1 otherwise
+ */
+int qdl_write_flush(struct qdl_device *qdl) {
+  int ret;
+
+  if (qdl->transport->flush(qdl) < 0)
+    return -1;
+
+  ret = qdl->out_error;
+  qdl->out_error = 0;
+  return ret;
+}
+
+int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot) {
+  int count;
+
+  count = qdl_write_queue(qdl, buf, len, eot);
+  if (qdl_write_flush(qdl) < 0 || count < 0)
+    return -1;
+
+  return count;
+}
@@ -10,14 +10,198 @@
 #include "program.h"
 #include <libxml/tree.h>
 
+#define QDL_PATH_MAX 32
+#define QDL_MAX_DEVICES 64
+
+#define QDL_OUT_QUEUE_DEFAULT 8
+#define QDL_OUT_QUEUE_MAX 64
+#define QDL_READ_AHEAD_DEFAULT 4
+#define QDL_IN_QUEUE_DEFAULT 8
+#define QDL_IN_QUEUE_MAX 64
+#define QDL_BOOT_TIMEOUT_DEFAULT 10000
+
+struct qdl_device;
+struct qdl_in_xfer;
+struct sim_device;
+struct usbdevfs_urb;
+
+/**
+ * struct qdl_transport - USB backend used to talk to the device
+ * @name:	name used to select the backend
+ * @list:	fill @paths with the bus/port paths of all EDL devices, up to
+ *		@max entries, returning the number of devices found
+ * @open:	find and claim a device, the one at qdl->path when set,
+ *		filling in endpoint information
+ * @read:	synchronous bulk-IN read, returns bytes read, -ETIMEDOUT if
+ *		nothing arrived in time or -1
+ * @submit:	queue one bulk-OUT transfer, blocking only while the queue is
+ *		full; the buffer must stay valid until @flush returns
+ * @flush:	wait for all queued bulk-OUT transfers, returns 0 or -1
+ * @read_submit: optional, queue one bulk-IN transfer, returns 0 or -1
+ * @read_reap:	wait for the oldest queued bulk-IN transfer for up to
+ *		@timeout ms, returns bytes read, -ETIMEDOUT or -1
+ * @read_cancel: retire all queued bulk-IN transfers
+ *
+ * Without @read_submit queued bulk-IN transfers are performed one at a time,
+ * as they are reaped, using @read.
+ */
+struct qdl_transport {
+  const char *name;
+  int (*list)(char (*paths)[QDL_PATH_MAX], int max);
+  int (*open)(struct qdl_device *qdl);
+  int (*read)(struct qdl_device *qdl, void *buf, size_t len,
+              unsigned int timeout);
+  int (*submit)(struct qdl_device *qdl, const void *buf, size_t len);
+  int (*flush)(struct qdl_device *qdl);
+  int (*read_submit)(struct qdl_device *qdl, struct qdl_in_xfer *xfer);
+  int (*read_reap)(struct qdl_device *qdl, struct qdl_in_xfer *xfer,
+                   unsigned int timeout);
+  void (*read_cancel)(struct qdl_device *qdl);
+};
+
+extern const struct qdl_transport qdl_libusb_transport;
+extern const struct qdl_transport qdl_sim_transport;
+#ifdef __linux__
+extern const struct qdl_transport qdl_usbfs_transport;
+#endif
+
+/**
+ * struct qdl_sim_config - parameters of the simulated device
+ * @backing:	prefix of the files receiving programmed sectors, one per
+ *		physical partition, or NULL to discard the data
+ * @latency_us:	delay added to every transfer
+ * @bandwidth:	link speed in kB/s, 0 for unlimited
+ * @image_size:	size of the programmer the device requests over Sahara
+ * @devices:	number of simulated devices to report, 0 for one
+ * @ramdump:	size of the memory of a device crashed into memory debug mode,
+ *		0 for a device waiting for a programmer
+ * @firehose:	the device still runs the programmer, left with the response to
+ *		a command of an earlier session queued
+ * @single_command: the programmer accepts a single command per document
+ */
+struct qdl_sim_config {
+  const char *backing;
+  unsigned int latency_us;
+  unsigned int bandwidth;
+  size_t image_size;
+  unsigned int devices;
+  size_t ramdump;
+  bool firehose;
+  bool single_command;
+};
+
+extern struct qdl_sim_config qdl_sim_config;
+
+struct qdl_xfer {
+  struct qdl_device *qdl;
+  struct libusb_transfer *transfer;
+  bool busy;
+};
+
+/* Bulk-IN transfer queued by qdl_read_queue(), @actual is -1 on failure */
+struct qdl_in_xfer {
+  struct qdl_device *qdl;
+  struct libusb_transfer *transfer;
+  void *buf;
+  size_t len;
+  int actual;
+  bool done;
+};
+
 struct qdl_device {
+  const struct qdl_transport *transport;
+
+  /* Bus/port path of the device, e.g. "1-4.2", empty to use the first one */
+  char path[QDL_PATH_MAX];
+
+  libusb_context *ctx;
   libusb_device_handle *device;
 
+  /* usbfs backend */
+  int fd;
+  struct usbdevfs_urb *urbs;
+  struct usbdevfs_urb *in_urbs;
+
+  /* simulated device */
+  struct sim_device *sim;
+
   uint8_t in_ep;
   uint8_t out_ep;
 
   size_t in_maxpktsize;
   size_t out_maxpktsize;
+
+  /* Number of bulk-OUT transfers kept in flight, 0 selects the default */
+  unsigned int out_queue_depth;
+  /* Bytes per bulk-OUT transfer, 0 selects out_maxpktsize */
+  size_t out_xfer_size;
+
+  /* Statistics, used to report transfers and ZLPs per payload */
+  unsigned long out_transfers;
+  unsigned long out_zlps;
+
+  struct qdl_xfer out_xfers[QDL_OUT_QUEUE_MAX];
+  unsigned int out_inflight;
+  int out_error;
+
+  /* Ring of queued bulk-IN transfers, completed in order */
+  struct qdl_in_xfer in_xfers[QDL_IN_QUEUE_MAX];
+  unsigned int in_head;
+  unsigned int in_count;
+
+  /* Time in ms for the programmer to boot, 0 selects the default */
+  unsigned int boot_timeout;
+  /* The programmer was left running by a previous session */
+  bool firehose_resumed;
+
+  /* Storage type the programmer is configured for */
+  const char *storage;
+
+  /* SHA-256 of the programmer loaded over Sahara, unknown when resumed */
+  uint8_t programmer_hash[32];
+  bool programmer_hashed;
+
+  /* Probe payload sizes while programming, the fastest size is cached */
+  bool auto_tune;
+  bool tune_pending;
+
+  /* Negotiated with the firehose programmer */
+  size_t max_payload_size;
+  size_t max_xml_size;
+  /* The programmer failed a document holding multiple patches */
+  bool patch_single;
+
+  /* Payload buffers read ahead of the USB writer, 0 to map files instead */
+  unsigned int read_ahead;
+
+  /* Read ahead with O_DIRECT and io_uring, keeping the page cache clean */
+  bool direct_io;
+
+  /* Firehose responses received but not handled yet */
+  char *rx;
+  size_t rx_len;
+  size_t rx_size;
+
+  /* Firehose command being serialized, the buffer is reused */
+  char *cmd;
+  size_t cmd_len;
+  size_t cmd_size;
+  int cmd_error;
+
+  /* Programmers to pick from by the identity of the device, when none given */
+  const char *programmer_dir;
+
+  /* Directory receiving the memory of a crashed device, NULL to refuse */
+  const char *ramdump_dir;
+  /* Write a single ELF core instead of a file per region */
+  bool ramdump_elf;
+  /* ".gz" or ".zst" to compress the ramdump, NULL to write it as is */
+  const char *ramdump_compress;
+
+  /* Check the SHA-256 digest of each programmed range after writing it */
+  bool verify;
+  uint8_t digest[32];
+  bool digest_valid;
 };
 
 enum {
@@ -26,18 +210,38 @@ enum {
   QDL_FILE_PROGRAM,
   QDL_FILE_UFS,
   QDL_FILE_CONTENTS,
+  QDL_FILE_READ,
 };
 
 int detect_type(const char *xml_file);
 
+const struct qdl_transport *qdl_transport_find(const char *name);
+unsigned int qdl_out_queue_depth(struct qdl_device *qdl);
+
 int find_device(struct qdl_device *qdl);
+int find_devices(const struct qdl_transport *transport,
+                 char (*paths)[QDL_PATH_MAX], int max);
 
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len,
              unsigned int timeout);
+int qdl_read_queue(struct qdl_device *qdl, void *buf, size_t len);
+int qdl_read_reap(struct qdl_device *qdl, unsigned int timeout);
+void qdl_read_cancel(struct qdl_device *qdl);
 int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, bool eot);
+int qdl_write_queue(struct qdl_device *qdl, const void *buf, size_t len,
+                    bool eot);
+int qdl_write_flush(struct qdl_device *qdl);
 
 int firehose_run(struct qdl_device *qdl, const char *incdir,
                  const char *storage, void *progress_callback_context);
+
+/* Successful outcomes of sahara_run() */
+enum {
+  SAHARA_LOADED,
+  SAHARA_RAMDUMP,
+  SAHARA_FIREHOSE,
+};
+
 int sahara_run(struct qdl_device *qdl, char *prog_mbn);
 void print_hex_dump(const char *prefix, const void *buf, size_t len);
 unsigned attr_as_unsigned(xmlNode *node, const char *attr, int *errors);
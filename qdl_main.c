@@ -1,9 +1,16 @@
 
+#include <sys/stat.h>
 #include <err.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "dump.h"
 #include "patch.h"
 #include "qdl.h"
 #include "ufs.h"
@@ -14,24 +21,159 @@ static void print_usage(void) {
   extern const char *__progname;
   log_msg(log_info,
           "%s [--debug] [--storage <emmc|ufs>] [--finalize-provisioning] "
-          "[--include <PATH>] <prog.mbn> [<program> <patch> ...]\n",
+          "[--include <PATH>] [--transport <libusb|usbfs|sim>] "
+          "[--out-queue <N>] [--xfer-size <bytes>] [--read-ahead <N>] "
+          "[--direct-io] [--verify] [--delta[=<bytes>]] [--decompress] [--zero-policy [<label>=]<write|skip|erase>] "
+          "[--boot-timeout <ms>] [--auto-tune] [--programmer-dir <DIR>] "
+          "[--ramdump <DIR> [--ramdump-elf] [--ramdump-compress <gzip|zstd>]] "
+          "[--sim-backing <PATH>] "
+          "[--sim-latency <us>] [--sim-bandwidth <kB/s>] [--sim-devices <N>] "
+          "[--sim-ramdump <bytes>] [--sim-firehose] [--sim-single-command] "
+          "[--all | --device <bus-port> ...] <prog.mbn> [<program> <patch> ...]\n",
           __progname);
 }
 
+struct qdl_worker {
+  struct qdl_device qdl;
+  pthread_t thread;
+  char *prog_mbn;
+  const char *incdir;
+  const char *storage;
+  int ret;
+};
+
+static int qdl_flash(struct qdl_device *qdl, char *prog_mbn,
+                     const char *incdir, const char *storage) {
+  int ret;
+
+  ret = find_device(qdl);
+  if (ret)
+    return -1;
+
+  log_msg(log_info, "Found device %s\n", qdl->path);
+
+  ret = sahara_run(qdl, prog_mbn);
+  if (ret < 0)
+    return ret;
+
+  /* The device had crashed, it was dumped instead */
+  if (ret == SAHARA_RAMDUMP) {
+    log_msg(log_info, "Collected ramdump in %s\n", qdl->ramdump_dir);
+    return 0;
+  }
+
+  if (ret == SAHARA_FIREHOSE)
+    log_msg(log_info, "Firehose already running, skipped Sahara\n");
+  else
+    log_msg(log_info, "Ran Sahara, all good\n");
+
+  ret = firehose_run(qdl, incdir, storage, NULL);
+  if (ret < 0)
+    return ret;
+
+  log_msg(log_info, "Ran Firehose, we're done!\n");
+
+  return 0;
+}
+
+static void *qdl_flash_worker(void *data) {
+  struct qdl_worker *worker = data;
+
+  worker->ret = qdl_flash(&worker->qdl, worker->prog_mbn, worker->incdir,
+                          worker->storage);
+  if (worker->ret)
+    log_msg(log_error, "[%s] flashing failed: %d\n", worker->qdl.path,
+            worker->ret);
+  return NULL;
+}
+
+/*
+ * Run one worker per device, all sharing the program, patch and ufs plans
+ * loaded up front; those are only read while flashing.
+ */
+static int qdl_flash_all(struct qdl_device *template,
+                         char (*devices)[QDL_PATH_MAX], int ndevices,
+                         char *prog_mbn, const char *incdir,
+                         const char *storage) {
+  struct qdl_worker *workers;
+  int failed = 0;
+  int i;
+
+  workers = calloc(ndevices, sizeof(*workers));
+  if (!workers)
+    err(1, "failed to allocate workers");
+
+  for (i = 0; i < ndevices; i++) {
+    workers[i].qdl = *template;
+    memcpy(workers[i].qdl.path, devices[i], QDL_PATH_MAX);
+    workers[i].prog_mbn = prog_mbn;
+    workers[i].incdir = incdir;
+    workers[i].storage = storage;
+
+    if (pthread_create(&workers[i].thread, NULL, qdl_flash_worker,
+                       &workers[i]))
+      err(1, "failed to start worker for %s", devices[i]);
+  }
+
+  for (i = 0; i < ndevices; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  log_msg(log_info, "Flashed %d device(s):\n", ndevices);
+  for (i = 0; i < ndevices; i++) {
+    log_msg(log_info, "  %-16s %s\n", workers[i].qdl.path,
+            workers[i].ret ? "FAILED" : "ok");
+    if (workers[i].ret)
+      failed++;
+  }
+
+  free(workers);
+  return failed ? -1 : 0;
+}
+
 int main(int argc, char **argv) {
   char *prog_mbn, *storage = "ufs";
   char *incdir = NULL;
+  char *end;
   int type;
   int ret;
   int opt;
   bool qdl_finalize_provisioning = false;
-  struct qdl_device qdl;
+  struct qdl_device qdl = {};
+  char devices[QDL_MAX_DEVICES][QDL_PATH_MAX];
+  bool all_devices = false;
+  bool dumping = false;
+  int ndevices = 0;
+  struct stat sb;
 
   static struct option options[] = {
       {"debug", no_argument, 0, 'd'},
       {"include", required_argument, 0, 'i'},
       {"finalize-provisioning", no_argument, 0, 'l'},
       {"storage", required_argument, 0, 's'},
+      {"out-queue", required_argument, 0, 'q'},
+      {"xfer-size", required_argument, 0, 'x'},
+      {"read-ahead", required_argument, 0, 'r'},
+      {"direct-io", no_argument, 0, 'O'},
+      {"zero-policy", required_argument, 0, 'z'},
+      {"verify", no_argument, 0, 'V'},
+      {"delta", optional_argument, 0, 'E'},
+      {"decompress", no_argument, 0, 'C'},
+      {"boot-timeout", required_argument, 0, 'T'},
+      {"auto-tune", no_argument, 0, 'A'},
+      {"programmer-dir", required_argument, 0, 'P'},
+      {"ramdump", required_argument, 0, 'R'},
+      {"ramdump-elf", no_argument, 0, 'F'},
+      {"ramdump-compress", required_argument, 0, 'Z'},
+      {"transport", required_argument, 0, 't'},
+      {"sim-backing", required_argument, 0, 'B'},
+      {"sim-latency", required_argument, 0, 'L'},
+      {"sim-bandwidth", required_argument, 0, 'W'},
+      {"sim-devices", required_argument, 0, 'N'},
+      {"sim-ramdump", required_argument, 0, 'M'},
+      {"sim-firehose", no_argument, 0, 'H'},
+      {"sim-single-command", no_argument, 0, 'S'},
+      {"all", no_argument, 0, 'a'},
+      {"device", required_argument, 0, 'D'},
       {0, 0, 0, 0}};
 
   while ((opt = getopt_long(argc, argv, "di:", options, NULL)) != -1) {
@@ -48,21 +190,130 @@ int main(int argc, char **argv) {
     case 's':
       storage = optarg;
       break;
+    case 'q':
+      qdl.out_queue_depth = strtoul(optarg, NULL, 0);
+      if (!qdl.out_queue_depth || qdl.out_queue_depth > QDL_OUT_QUEUE_MAX)
+        errx(1, "--out-queue must be between 1 and %d", QDL_OUT_QUEUE_MAX);
+      break;
+    case 'x':
+      /* Transfer lengths are int in libusb and usbfs URBs */
+      errno = 0;
+      qdl.out_xfer_size = strtoul(optarg, &end, 0);
+      if (errno || end == optarg || *end || !qdl.out_xfer_size ||
+          qdl.out_xfer_size > INT_MAX)
+        errx(1, "--xfer-size must be between 1 and %d", INT_MAX);
+      break;
+    case 'r':
+      qdl.read_ahead = strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      qdl.direct_io = true;
+      break;
+    case 'V':
+      qdl.verify = true;
+      break;
+    case 'E':
+      program_delta(optarg ? strtoul(optarg, NULL, 0)
+                           : PROGRAM_DELTA_CHUNK_DEFAULT);
+      break;
+    case 'C':
+      program_decompress(true);
+      break;
+    case 'T':
+      qdl.boot_timeout = strtoul(optarg, NULL, 0);
+      if (!qdl.boot_timeout)
+        errx(1, "--boot-timeout must be at least 1 ms");
+      break;
+    case 'A':
+      qdl.auto_tune = true;
+      break;
+    case 'P':
+      qdl.programmer_dir = optarg;
+      break;
+    case 'R':
+      qdl.ramdump_dir = optarg;
+      break;
+    case 'F':
+      qdl.ramdump_elf = true;
+      break;
+    case 'Z':
+      if (!strcmp(optarg, "gzip"))
+        qdl.ramdump_compress = ".gz";
+      else if (!strcmp(optarg, "zstd"))
+        qdl.ramdump_compress = ".zst";
+      else
+        errx(1, "invalid ramdump compression \"%s\"", optarg);
+      break;
+    case 'z':
+      if (program_zero_policy(optarg) < 0)
+        errx(1, "invalid zero policy \"%s\"", optarg);
+      break;
+    case 't':
+      qdl.transport = qdl_transport_find(optarg);
+      if (!qdl.transport)
+        errx(1, "unknown transport \"%s\"", optarg);
+      break;
+    case 'B':
+      qdl_sim_config.backing = optarg;
+      break;
+    case 'L':
+      qdl_sim_config.latency_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'W':
+      qdl_sim_config.bandwidth = strtoul(optarg, NULL, 0);
+      break;
+    case 'N':
+      qdl_sim_config.devices = strtoul(optarg, NULL, 0);
+      break;
+    case 'M':
+      qdl_sim_config.ramdump = strtoul(optarg, NULL, 0);
+      break;
+    case 'H':
+      qdl_sim_config.firehose = true;
+      break;
+    case 'S':
+      qdl_sim_config.single_command = true;
+      break;
+    case 'a':
+      all_devices = true;
+      break;
+    case 'D':
+      if (ndevices == QDL_MAX_DEVICES)
+        errx(1, "at most %d devices can be flashed", QDL_MAX_DEVICES);
+      if (strlen(optarg) >= QDL_PATH_MAX)
+        errx(1, "invalid device path \"%s\"", optarg);
+      strcpy(devices[ndevices++], optarg);
+      break;
     default:
       print_usage();
       return 1;
     }
   }
 
-  /* at least 2 non optional args required */
-  if ((optind + 2) > argc) {
+  /*
+   * at least 2 non optional args required, unless only collecting a ramdump;
+   * the programmer is picked by the device with --programmer-dir
+   */
+  if ((optind + (qdl.programmer_dir ? 1 : 2)) > argc && !qdl.ramdump_dir) {
     print_usage();
     return 1;
   }
 
-  prog_mbn = argv[optind++];
+  prog_mbn = NULL;
+  if (!qdl.programmer_dir && optind < argc)
+    prog_mbn = argv[optind++];
 
-  do {
+  /* O_DIRECT reads go through the read-ahead ring */
+  if (qdl.direct_io && !qdl.read_ahead)
+    qdl.read_ahead = QDL_READ_AHEAD_DEFAULT;
+
+  if (qdl.transport == &qdl_sim_transport && prog_mbn) {
+    if (stat(prog_mbn, &sb) < 0)
+      err(1, "failed to stat %s", prog_mbn);
+    qdl_sim_config.image_size = sb.st_size;
+  }
+
+  for (; optind < argc; optind++) {
     type = detect_type(argv[optind]);
     if (type < 0 || type == QDL_FILE_UNKNOWN)
       errx(1, "failed to detect file type of %s\n", argv[optind]);
@@ -83,35 +334,45 @@ int main(int argc, char **argv) {
       if (ret < 0)
         errx(1, "ufs_load %s failed", argv[optind]);
       break;
+    case QDL_FILE_READ:
+      ret = dump_load(argv[optind]);
+      if (ret < 0)
+        errx(1, "dump_load %s failed", argv[optind]);
+      dumping = true;
+      break;
     default:
       errx(1, "%s type not yet supported", argv[optind]);
       break;
     }
-  } while (++optind < argc);
+  }
+
+  /* Every device would write to the same output files */
+  if (dumping && (all_devices || ndevices > 1))
+    errx(1, "reading back is only supported from a single device");
+  if (qdl.ramdump_dir && (all_devices || ndevices > 1))
+    errx(1, "ramdumps are only supported from a single device");
 
   libusb_init(NULL);
-  ret = find_device(&qdl);
-  if (ret) {
-    libusb_exit(NULL);
-    return 1;
-  }
 
-  log_msg(log_info, "Found device\n");
+  if (!all_devices && ndevices <= 1) {
+    if (ndevices)
+      memcpy(qdl.path, devices[0], QDL_PATH_MAX);
 
-  ret = sahara_run(&qdl, prog_mbn);
-  if (ret < 0) {
+    ret = qdl_flash(&qdl, prog_mbn, incdir, storage);
     libusb_exit(NULL);
-    return 1;
+    return ret < 0 ? 1 : 0;
   }
 
-  log_msg(log_info, "Ran Sahara, all good\n");
-
-  ret = firehose_run(&qdl, incdir, storage, NULL);
-  if (ret < 0) {
-    libusb_exit(NULL);
-    return 1;
+  if (all_devices) {
+    ndevices = find_devices(qdl.transport, devices, QDL_MAX_DEVICES);
+    if (!ndevices) {
+      log_msg(log_error, "No EDL device found\n");
+      libusb_exit(NULL);
+      return 1;
+    }
   }
-  log_msg(log_info, "Ran Firehose, we're done!\n");
 
-  return 0;
+  ret = qdl_flash_all(&qdl, devices, ndevices, prog_mbn, incdir, storage);
+  libusb_exit(NULL);
+  return ret < 0 ? 1 : 0;
 }
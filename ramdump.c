@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/stat.h>
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ramdump.h"
+
+#include "python_logging.h"
+
+#define RAMDUMP_ELF_ALIGN	4096
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+static int ramdump_open(struct ramdump *rd, const char *name)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "%s/%s%s", rd->dir, name,
+		       rd->compress ? rd->compress : "");
+	if (ret >= (int)sizeof(path))
+		return -ENAMETOOLONG;
+
+	ret = dump_open(&rd->file, path);
+	if (ret < 0)
+		return ret;
+
+	rd->open = true;
+	log_msg(log_info, "[RAMDUMP] writing %s\n", path);
+
+	return 0;
+}
+
+static int ramdump_close(struct ramdump *rd)
+{
+	if (!rd->open)
+		return 0;
+
+	rd->open = false;
+	return dump_close(&rd->file);
+}
+
+/* Pad the core with zeros up to @offset */
+static int ramdump_pad(struct ramdump *rd, uint64_t offset)
+{
+	static const char zeros[RAMDUMP_ELF_ALIGN];
+	size_t n;
+	int ret;
+
+	while (rd->file.offset < (off_t)offset) {
+		n = offset - rd->file.offset;
+		if (n > sizeof(zeros))
+			n = sizeof(zeros);
+
+		ret = dump_write(&rd->file, zeros, n);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int ramdump_elf_begin(struct ramdump *rd, const struct ramdump_region *regions,
+			     unsigned count)
+{
+	Elf64_Ehdr ehdr = {};
+	Elf64_Phdr phdr = {};
+	uint64_t offset;
+	unsigned i;
+	int ret;
+
+	ret = ramdump_open(rd, "ramdump.elf");
+	if (ret < 0)
+		return ret;
+
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = ET_CORE;
+	ehdr.e_machine = rd->machine;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(phdr);
+	ehdr.e_phnum = count;
+
+	ret = dump_write(&rd->file, &ehdr, sizeof(ehdr));
+	if (ret < 0)
+		return ret;
+
+	/* One PT_LOAD per region, the data follows the headers in order */
+	offset = ALIGN_UP(sizeof(ehdr) + count * sizeof(phdr), RAMDUMP_ELF_ALIGN);
+	for (i = 0; i < count; i++) {
+		phdr.p_type = PT_LOAD;
+		phdr.p_flags = PF_R | PF_W | PF_X;
+		phdr.p_offset = offset;
+		phdr.p_vaddr = regions[i].addr;
+		phdr.p_paddr = regions[i].addr;
+		phdr.p_filesz = regions[i].length;
+		phdr.p_memsz = regions[i].length;
+		phdr.p_align = RAMDUMP_ELF_ALIGN;
+
+		ret = dump_write(&rd->file, &phdr, sizeof(phdr));
+		if (ret < 0)
+			return ret;
+
+		offset = ALIGN_UP(offset + regions[i].length, RAMDUMP_ELF_ALIGN);
+	}
+
+	rd->offset = ALIGN_UP(sizeof(ehdr) + count * sizeof(phdr), RAMDUMP_ELF_ALIGN);
+
+	return 0;
+}
+
+/**
+ * ramdump_begin() - start writing a memory dump
+ * @rd:		the dump, with its output options filled in
+ * @regions:	regions that will be dumped, in order
+ * @count:	number of entries in @regions
+ *
+ * The output directory is created if needed. For ELF cores the headers
+ * describing all regions are written up front, so that the region data can
+ * be streamed, and compressed, as it is received.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int ramdump_begin(struct ramdump *rd, const struct ramdump_region *regions,
+		  unsigned count)
+{
+	int ret;
+
+	if (mkdir(rd->dir, 0755) < 0 && errno != EEXIST) {
+		log_msg(log_error, "[RAMDUMP] unable to create %s: %s\n", rd->dir, strerror(errno));
+		return -errno;
+	}
+
+	if (!rd->elf)
+		return 0;
+
+	ret = ramdump_elf_begin(rd, regions, count);
+	if (ret < 0)
+		ramdump_close(rd);
+
+	return ret;
+}
+
+int ramdump_region_begin(struct ramdump *rd, const struct ramdump_region *region)
+{
+	char name[sizeof(region->filename) + sizeof(".bin")];
+	char *p;
+
+	if (rd->elf)
+		return ramdump_pad(rd, rd->offset);
+
+	if (region->filename[0])
+		strcpy(name, region->filename);
+	else
+		snprintf(name, sizeof(name), "%s.bin", region->name[0] ? region->name : "region");
+
+	/* The names come from the device, keep them within the directory */
+	for (p = name; *p; p++) {
+		if (!isalnum((unsigned char)*p) && *p != '.' && *p != '_' && *p != '-')
+			*p = '_';
+	}
+	if (name[0] == '.')
+		name[0] = '_';
+
+	return ramdump_open(rd, name);
+}
+
+int ramdump_write(struct ramdump *rd, const void *buf, size_t len)
+{
+	return dump_write(&rd->file, buf, len);
+}
+
+int ramdump_region_end(struct ramdump *rd)
+{
+	if (rd->elf) {
+		rd->offset = ALIGN_UP(rd->file.offset, RAMDUMP_ELF_ALIGN);
+		return 0;
+	}
+
+	return ramdump_close(rd);
+}
+
+int ramdump_end(struct ramdump *rd)
+{
+	return ramdump_close(rd);
+}
@@ -0,0 +1,53 @@
+#ifndef __RAMDUMP_H__
+#define __RAMDUMP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dump.h"
+
+/**
+ * struct ramdump_region - memory region listed by a crashed device
+ * @type:	region type, as reported by the device
+ * @addr:	physical address of the region
+ * @length:	size of the region, in bytes
+ * @name:	description of the region
+ * @filename:	file name suggested by the device
+ */
+struct ramdump_region {
+	uint64_t type;
+	uint64_t addr;
+	uint64_t length;
+	char name[21];
+	char filename[21];
+};
+
+/**
+ * struct ramdump - output of a memory dump
+ * @dir:	directory receiving the dump
+ * @elf:	write a single ELF core instead of a file per region
+ * @compress:	suffix selecting the compression, ".gz" or ".zst", or NULL
+ * @machine:	ELF machine of the device
+ * @file:	file being written
+ * @open:	@file is open
+ * @offset:	offset in @file of the next region, for ELF cores
+ */
+struct ramdump {
+	const char *dir;
+	bool elf;
+	const char *compress;
+	unsigned machine;
+
+	struct dump_file file;
+	bool open;
+	uint64_t offset;
+};
+
+int ramdump_begin(struct ramdump *rd, const struct ramdump_region *regions,
+		  unsigned count);
+int ramdump_region_begin(struct ramdump *rd, const struct ramdump_region *region);
+int ramdump_write(struct ramdump *rd, const void *buf, size_t len);
+int ramdump_region_end(struct ramdump *rd);
+int ramdump_end(struct ramdump *rd);
+
+#endif
@@ -28,23 +28,33 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <elf.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include "loader.h"
 #include "qdl.h"
+#include "ramdump.h"
+#include "sha256.h"
 
 #include "python_logging.h"
 
@@ -84,10 +94,53 @@ struct sahara_pkt {
 			uint64_t offset;
 			uint64_t length;
 		} read64_req;
+		struct {
+			uint32_t mode;
+		} mode_switch;
+		struct {
+			uint32_t command;
+		} exec_req;
+		struct {
+			uint32_t command;
+			uint32_t length;
+		} exec_resp;
+		struct {
+			uint32_t addr;
+			uint32_t length;
+		} debug_req;
+		struct {
+			uint64_t addr;
+			uint64_t length;
+		} debug64_req;
+		struct {
+			uint32_t addr;
+			uint32_t length;
+		} mem_read;
+		struct {
+			uint64_t addr;
+			uint64_t length;
+		} mem_read64;
 	};
 };
 
-static void sahara_hello(struct qdl_device *qdl, struct sahara_pkt *pkt)
+/* Entries of the region table of a device in memory debug mode */
+struct sahara_debug_region {
+	uint32_t type;
+	uint32_t addr;
+	uint32_t length;
+	char name[20];
+	char filename[20];
+};
+
+struct sahara_debug_region64 {
+	uint64_t type;
+	uint64_t addr;
+	uint64_t length;
+	char name[20];
+	char filename[20];
+};
+
+static void sahara_hello(struct qdl_device *qdl, struct sahara_pkt *pkt, uint32_t mode)
 {
 	struct sahara_pkt resp;
 
@@ -101,45 +154,235 @@ static void sahara_hello(struct qdl_device *qdl, struct sahara_pkt *pkt)
 	resp.hello_resp.version = 2;
 	resp.hello_resp.compatible = 1;
 	resp.hello_resp.status = 0;
-	resp.hello_resp.mode = pkt->hello_req.mode;
+	resp.hello_resp.mode = mode;
 
 	qdl_write(qdl, &resp, resp.length, true);
 }
 
-static int sahara_read_common(struct qdl_device *qdl, const char *mbn, off_t offset, size_t len)
+/**
+ * struct sahara_image - programmer image, loaded once per process
+ * @path:	file the image was loaded from
+ * @data:	contents of the file, mapped or read into memory
+ * @size:	size of @data
+ * @next:	next loaded image
+ *
+ * All devices flashed by a process are usually fed the same programmer, the
+ * read requests of each are served straight from the one copy of it.
+ */
+struct sahara_image {
+	char *path;
+	void *data;
+	size_t size;
+	uint8_t hash[SHA256_DIGEST_SIZE];
+
+	struct sahara_image *next;
+};
+
+static struct sahara_image *sahara_images;
+static pthread_mutex_t sahara_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *sahara_image_read(int fd, size_t size)
 {
-	int progfd;
+	size_t off = 0;
 	ssize_t n;
 	void *buf;
+
+	buf = malloc(size ? size : 1);
+	if (!buf)
+		return NULL;
+
+	while (off < size) {
+		n = read(fd, (char *)buf + off, size - off);
+		if (n <= 0) {
+			free(buf);
+			errno = n < 0 ? errno : EIO;
+			return NULL;
+		}
+		off += n;
+	}
+
+	return buf;
+}
+
+static int sahara_image_load(struct sahara_image *image, const char *path)
+{
+	struct stat sb;
+	void *data;
 	int ret = 0;
+	int fd;
 
-	progfd = open(mbn, O_RDONLY);
-	if (progfd < 0)
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
 		return -errno;
 
-	buf = malloc(len);
-	if (!buf)
-		return -ENOMEM;
-
-	lseek(progfd, offset, SEEK_SET);
-	n = read(progfd, buf, len);
-	if (n != len) {
+	if (fstat(fd, &sb) < 0) {
 		ret = -errno;
 		goto out;
 	}
 
-	n = qdl_write(qdl, buf, n, true);
-	if (n != len)
-		err(1, "failed to write %zu bytes to sahara", len);
+	/* Fall back to read() for anything that can't be mapped */
+	data = MAP_FAILED;
+	if (S_ISREG(sb.st_mode) && sb.st_size)
+		data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		data = sahara_image_read(fd, sb.st_size);
+	if (!data) {
+		ret = -errno;
+		goto out;
+	}
 
-	free(buf);
-	close(progfd);
+	image->data = data;
+	image->size = sb.st_size;
 
 out:
+	close(fd);
 	return ret;
 }
 
-static void sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt, const char *mbn)
+/**
+ * sahara_image_get() - get the contents of a programmer image
+ * @path:	path of the image
+ *
+ * The image is loaded and hashed, identifying the programmer, on first use
+ * and kept for the lifetime of the process, shared by all devices.
+ *
+ * Return: the image, or NULL with errno set on failure
+ */
+static const struct sahara_image *sahara_image_get(const char *path)
+{
+	struct sahara_image *image;
+	struct sha256 sha;
+	int ret;
+
+	pthread_mutex_lock(&sahara_images_lock);
+
+	for (image = sahara_images; image; image = image->next) {
+		if (!strcmp(image->path, path))
+			goto out;
+	}
+
+	image = calloc(1, sizeof(*image));
+	if (!image) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	image->path = strdup(path);
+	if (!image->path) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = sahara_image_load(image, path);
+	if (ret < 0)
+		goto err;
+
+	sha256_init(&sha);
+	sha256_update(&sha, image->data, image->size);
+	sha256_final(&sha, image->hash);
+
+	image->next = sahara_images;
+	sahara_images = image;
+
+out:
+	pthread_mutex_unlock(&sahara_images_lock);
+	return image;
+
+err:
+	pthread_mutex_unlock(&sahara_images_lock);
+	if (image)
+		free(image->path);
+	free(image);
+	errno = -ret;
+	return NULL;
+}
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Sahara packets are small, two IN transfers are kept posted to receive them */
+#define SAHARA_PKT_SIZE		4096
+#define SAHARA_IN_QUEUE		2
+/*
+ * Bulk-OUT transfer size for image data, unless configured otherwise. The
+ * URB memory of all devices is bounded by usbfs_memory_mb, 16 MiB by default,
+ * so a full queue of the default depth is kept to 512 kB per device.
+ */
+#define SAHARA_XFER_SIZE	(64 * 1024)
+
+/**
+ * struct sahara_stats - transfer statistics of the image being loaded
+ * @image:	image id from the read requests
+ * @bytes:	number of image bytes sent
+ * @reads:	number of read requests served
+ * @start:	time of the first read request
+ */
+struct sahara_stats {
+	uint64_t image;
+	uint64_t bytes;
+	unsigned long reads;
+	struct timespec start;
+};
+
+static void sahara_stats_account(struct sahara_stats *stats, uint64_t image, uint64_t len)
+{
+	if (!stats->reads || stats->image != image) {
+		stats->image = image;
+		stats->bytes = 0;
+		stats->reads = 0;
+		clock_gettime(CLOCK_MONOTONIC, &stats->start);
+	}
+
+	stats->bytes += len;
+	stats->reads++;
+}
+
+static void sahara_stats_report(struct sahara_stats *stats)
+{
+	struct timespec now;
+	uint64_t us;
+
+	if (!stats->reads)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - stats->start.tv_sec) * 1000000ULL +
+	     (now.tv_nsec - stats->start.tv_nsec) / 1000;
+
+	log_msg(log_info, "image %" PRIu64 ": %" PRIu64 " kB in %lu reads, %" PRIu64 " ms, %" PRIu64 " kB/s\n",
+		stats->image, stats->bytes / 1024, stats->reads, us / 1000,
+		us ? stats->bytes * 1000000 / us / 1024 : 0);
+
+	stats->reads = 0;
+}
+
+/*
+ * The data is queued straight from the image, the transfers complete while
+ * the next request is being received.
+ */
+static int sahara_read_common(struct qdl_device *qdl, const struct sahara_image *image,
+			      struct sahara_stats *stats, uint64_t id,
+			      uint64_t offset, uint64_t len)
+{
+	ssize_t n;
+
+	if (offset > image->size || len > image->size - offset) {
+		log_msg(log_error, "sahara read beyond the end of %s\n", image->path);
+		return -EIO;
+	}
+
+	n = qdl_write_queue(qdl, (char *)image->data + offset, len, true);
+	if (n != len) {
+		log_msg(log_error, "failed to write %" PRIu64 " bytes to sahara\n", len);
+		return -EIO;
+	}
+
+	sahara_stats_account(stats, id, len);
+
+	return 0;
+}
+
+static int sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt,
+		       const struct sahara_image *image, struct sahara_stats *stats)
 {
 	int ret;
 
@@ -148,12 +391,16 @@ static void sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt, const ch
 	log_msg(log_info, "READ image: %d offset: 0x%x length: 0x%x\n",
 	       pkt->read_req.image, pkt->read_req.offset, pkt->read_req.length);
 
-	ret = sahara_read_common(qdl, mbn, pkt->read_req.offset, pkt->read_req.length);
+	ret = sahara_read_common(qdl, image, stats, pkt->read_req.image,
+				 pkt->read_req.offset, pkt->read_req.length);
 	if (ret < 0)
-		errx(1, "failed to read image chunk to sahara");
+		log_msg(log_error, "failed to read image chunk to sahara\n");
+
+	return ret;
 }
 
-static void sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt, const char *mbn)
+static int sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt,
+			 const struct sahara_image *image, struct sahara_stats *stats)
 {
 	int ret;
 
@@ -162,12 +409,17 @@ static void sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt, const
 	log_msg(log_info, "READ64 image: %" PRId64 " offset: 0x%" PRIx64 " length: 0x%" PRIx64 "\n",
 	       pkt->read64_req.image, pkt->read64_req.offset, pkt->read64_req.length);
 
-	ret = sahara_read_common(qdl, mbn, pkt->read64_req.offset, pkt->read64_req.length);
+	ret = sahara_read_common(qdl, image, stats, pkt->read64_req.image,
+				 pkt->read64_req.offset, pkt->read64_req.length);
 	if (ret < 0)
-		errx(1, "failed to read image chunk to sahara");
+		log_msg(log_error, "failed to read image chunk to sahara\n");
+
+	return ret;
 }
 
-static void sahara_eoi(struct qdl_device *qdl, struct sahara_pkt *pkt)
+/* Return: true if the DONE request was sent */
+static bool sahara_eoi(struct qdl_device *qdl, struct sahara_pkt *pkt,
+		       struct sahara_stats *stats)
 {
 	struct sahara_pkt done;
 
@@ -177,12 +429,16 @@ static void sahara_eoi(struct qdl_device *qdl, struct sahara_pkt *pkt)
 
 	if (pkt->eoi.status != 0) {
 		log_msg(log_info, "received non-successful result\n");
-		return;
+		return false;
 	}
 
+	sahara_stats_report(stats);
+
 	done.cmd = 5;
 	done.length = 0x8;
 	qdl_write(qdl, &done, done.length, true);
+
+	return true;
 }
 
 static int sahara_done(struct qdl_device *qdl, struct sahara_pkt *pkt)
@@ -194,48 +450,590 @@ static int sahara_done(struct qdl_device *qdl, struct sahara_pkt *pkt)
 	return pkt->done_resp.status;
 }
 
+/* Memory read requests are answered in blocks of this size */
+#define SAHARA_DEBUG_BLOCK	(512 * 1024)
+#define SAHARA_DEBUG_TABLE_MAX	(64 * 1024)
+#define SAHARA_DEBUG_TIMEOUT	10000
+
+static int sahara_mem_read(struct qdl_device *qdl, bool is64, uint64_t addr, uint64_t len)
+{
+	struct sahara_pkt pkt = {};
+
+	if (is64) {
+		pkt.cmd = 0x11;
+		pkt.length = 0x18;
+		pkt.mem_read64.addr = addr;
+		pkt.mem_read64.length = len;
+	} else {
+		pkt.cmd = 0xa;
+		pkt.length = 0x10;
+		pkt.mem_read.addr = addr;
+		pkt.mem_read.length = len;
+	}
+
+	if (qdl_write(qdl, &pkt, pkt.length, true) != (int)pkt.length) {
+		log_msg(log_error, "failed to request memory at 0x%" PRIx64 "\n", addr);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int sahara_debug_table(struct qdl_device *qdl, bool is64, uint64_t addr, uint64_t len,
+			      struct ramdump_region **regions)
+{
+	const struct sahara_debug_region64 *entry64;
+	const struct sahara_debug_region *entry;
+	struct ramdump_region *region;
+	size_t entry_size;
+	size_t got = 0;
+	unsigned count;
+	unsigned i;
+	char *buf;
+	int ret;
+	int n;
+
+	entry_size = is64 ? sizeof(*entry64) : sizeof(*entry);
+	count = len / entry_size;
+	if (!count || len > SAHARA_DEBUG_TABLE_MAX) {
+		log_msg(log_error, "invalid memory region table of %" PRIu64 " bytes\n", len);
+		return -EINVAL;
+	}
+
+	buf = malloc(len);
+	*regions = calloc(count, sizeof(**regions));
+	if (!buf || !*regions) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = sahara_mem_read(qdl, is64, addr, len);
+	if (ret < 0)
+		goto err;
+
+	while (got < len) {
+		n = qdl_read(qdl, buf + got, len - got, SAHARA_DEBUG_TIMEOUT);
+		if (n < 0) {
+			log_msg(log_error, "failed to read memory region table\n");
+			ret = -EIO;
+			goto err;
+		}
+		got += n;
+	}
+
+	for (i = 0; i < count; i++) {
+		region = &(*regions)[i];
+		if (is64) {
+			entry64 = (const void *)(buf + i * entry_size);
+			region->type = entry64->type;
+			region->addr = entry64->addr;
+			region->length = entry64->length;
+			memcpy(region->name, entry64->name, sizeof(entry64->name));
+			memcpy(region->filename, entry64->filename, sizeof(entry64->filename));
+		} else {
+			entry = (const void *)(buf + i * entry_size);
+			region->type = entry->type;
+			region->addr = entry->addr;
+			region->length = entry->length;
+			memcpy(region->name, entry->name, sizeof(entry->name));
+			memcpy(region->filename, entry->filename, sizeof(entry->filename));
+		}
+
+		log_msg(log_info, "[RAMDUMP] %-20s 0x%010" PRIx64 " %" PRIu64 " kB\n",
+			region->name, region->addr, region->length / 1024);
+	}
+
+	free(buf);
+	return count;
+
+err:
+	free(buf);
+	free(*regions);
+	return ret;
+}
+
+/*
+ * The next block is requested, and its transfer posted, as soon as one is
+ * received, so that it streams in while the previous one is written out.
+ */
+static int sahara_debug_region(struct qdl_device *qdl, bool is64, struct ramdump *rd,
+			       const struct ramdump_region *region, char *bufs[2])
+{
+	uint64_t offset = 0;
+	uint64_t next;
+	size_t len;
+	size_t got;
+	char *buf;
+	int slot = 0;
+	int ret;
+	int n;
+
+	if (!region->length)
+		return 0;
+
+	len = MIN(region->length, SAHARA_DEBUG_BLOCK);
+	ret = sahara_mem_read(qdl, is64, region->addr, len);
+	if (ret < 0)
+		return ret;
+
+	if (qdl_read_queue(qdl, bufs[slot], len) < 0)
+		return -EIO;
+
+	while (offset < region->length) {
+		buf = bufs[slot];
+		len = MIN(region->length - offset, SAHARA_DEBUG_BLOCK);
+
+		/* Transfers completing short are continued by another one */
+		for (got = 0; got < len; got += n) {
+			if (got && qdl_read_queue(qdl, buf + got, len - got) < 0)
+				return -EIO;
+
+			n = qdl_read_reap(qdl, SAHARA_DEBUG_TIMEOUT);
+			if (n < 0) {
+				log_msg(log_error, "failed to read memory at 0x%" PRIx64 "\n",
+					region->addr + offset + got);
+				return -EIO;
+			}
+		}
+
+		next = offset + len;
+		slot = !slot;
+		if (next < region->length) {
+			ret = sahara_mem_read(qdl, is64, region->addr + next,
+					      MIN(region->length - next, SAHARA_DEBUG_BLOCK));
+			if (ret < 0)
+				return ret;
+
+			if (qdl_read_queue(qdl, bufs[slot],
+					   MIN(region->length - next, SAHARA_DEBUG_BLOCK)) < 0)
+				return -EIO;
+		}
+
+		ret = ramdump_write(rd, buf, len);
+		if (ret < 0)
+			return ret;
+
+		offset = next;
+	}
+
+	return 0;
+}
+
+/**
+ * sahara_debug() - collect the memory of a crashed device
+ * @qdl:	device in memory debug mode
+ * @pkt:	the MEMORY DEBUG request, carrying the location of the region table
+ *
+ * Every region listed in the table is read into the ramdump configured for
+ * @qdl, after which the device is reset.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int sahara_debug(struct qdl_device *qdl, struct sahara_pkt *pkt)
+{
+	struct ramdump_region *regions = NULL;
+	struct ramdump rd = {};
+	struct timespec start;
+	struct timespec now;
+	bool is64 = pkt->cmd == 0x10;
+	char *bufs[2] = {};
+	uint64_t total = 0;
+	uint64_t addr;
+	uint64_t len;
+	uint64_t us;
+	int count;
+	int ret;
+	int i;
+
+	if (is64) {
+		assert(pkt->length == 0x18);
+		addr = pkt->debug64_req.addr;
+		len = pkt->debug64_req.length;
+	} else {
+		assert(pkt->length == 0x10);
+		addr = pkt->debug_req.addr;
+		len = pkt->debug_req.length;
+	}
+
+	log_msg(log_info, "MEMORY DEBUG table: 0x%" PRIx64 " length: 0x%" PRIx64 "\n", addr, len);
+
+	if (!qdl->ramdump_dir) {
+		log_msg(log_error, "device is in memory debug mode, use --ramdump to collect its memory\n");
+		return -EOPNOTSUPP;
+	}
+
+	/* Nothing more is sent by the device until memory is requested */
+	qdl_read_cancel(qdl);
+
+	count = sahara_debug_table(qdl, is64, addr, len, &regions);
+	if (count < 0)
+		return count;
+
+	bufs[0] = malloc(SAHARA_DEBUG_BLOCK);
+	bufs[1] = malloc(SAHARA_DEBUG_BLOCK);
+	if (!bufs[0] || !bufs[1]) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	rd.dir = qdl->ramdump_dir;
+	rd.elf = qdl->ramdump_elf;
+	rd.compress = qdl->ramdump_compress;
+	rd.machine = is64 ? EM_AARCH64 : EM_ARM;
+
+	ret = ramdump_begin(&rd, regions, count);
+	if (ret < 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < count; i++) {
+		ret = ramdump_region_begin(&rd, &regions[i]);
+		if (ret < 0)
+			break;
+
+		ret = sahara_debug_region(qdl, is64, &rd, &regions[i], bufs);
+		if (ret < 0)
+			break;
+
+		ret = ramdump_region_end(&rd);
+		if (ret < 0)
+			break;
+
+		total += regions[i].length;
+	}
+
+	qdl_read_cancel(qdl);
+
+	if (ramdump_end(&rd) < 0 && !ret)
+		ret = -EIO;
+
+	if (!ret) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us = (now.tv_sec - start.tv_sec) * 1000000ULL +
+		     (now.tv_nsec - start.tv_nsec) / 1000;
+		log_msg(log_info, "[RAMDUMP] %" PRIu64 " kB in %" PRIu64 " ms, %" PRIu64 " kB/s\n",
+			total / 1024, us / 1000, us ? total * 1000000 / us / 1024 : 0);
+	}
+
+	/* RESET, the device reboots */
+	pkt->cmd = 7;
+	pkt->length = 0x8;
+	qdl_write(qdl, pkt, pkt->length, true);
+
+out:
+	free(bufs[0]);
+	free(bufs[1]);
+	free(regions);
+	return ret;
+}
+
+/* Sahara modes, and client commands run in command mode */
+#define SAHARA_MODE_IMAGE_TX_PENDING	0
+#define SAHARA_MODE_COMMAND		3
+#define SAHARA_EXEC_SERIAL_NUM		1
+#define SAHARA_EXEC_MSM_HW_ID		2
+#define SAHARA_EXEC_OEM_PK_HASH		3
+
+static int sahara_exec(struct qdl_device *qdl, uint32_t command, void *data, size_t size)
+{
+	struct sahara_pkt *resp;
+	struct sahara_pkt pkt = {};
+	char buf[SAHARA_PKT_SIZE];
+	size_t got = 0;
+	size_t len;
+	int n;
+
+	pkt.cmd = 0xd;
+	pkt.length = 0xc;
+	pkt.exec_req.command = command;
+	if (qdl_write(qdl, &pkt, pkt.length, true) != (int)pkt.length)
+		return -EIO;
+
+	n = qdl_read(qdl, buf, sizeof(buf), 1000);
+	resp = (struct sahara_pkt *)buf;
+	if (n < 0x10 || resp->cmd != 0xe || resp->exec_resp.command != command) {
+		log_msg(log_error, "command 0x%x not executed by the device\n", command);
+		return -EIO;
+	}
+
+	len = resp->exec_resp.length;
+	if (len > sizeof(buf))
+		return -EMSGSIZE;
+
+	pkt.cmd = 0xf;
+	if (qdl_write(qdl, &pkt, pkt.length, true) != (int)pkt.length)
+		return -EIO;
+
+	while (got < len) {
+		n = qdl_read(qdl, buf + got, len - got, 1000);
+		if (n < 0)
+			return -EIO;
+		got += n;
+	}
+
+	if (len > size)
+		len = size;
+	memcpy(data, buf, len);
+
+	return len;
+}
+
+/**
+ * sahara_identify() - read the identity of the device in command mode
+ * @qdl:	device that entered command mode
+ * @id:		identity to fill in
+ *
+ * The device is switched back to image transfer mode afterwards, in which it
+ * says HELLO again.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+static int sahara_identify(struct qdl_device *qdl, struct loader_id *id)
+{
+	struct sahara_pkt pkt = {};
+	char hash[2 * sizeof(id->pk_hash) + 1];
+	size_t i;
+	int ret;
+
+	/* Nothing more is sent by the device until a command is executed */
+	qdl_read_cancel(qdl);
+
+	memset(id, 0, sizeof(*id));
+
+	ret = sahara_exec(qdl, SAHARA_EXEC_SERIAL_NUM, &id->serial, sizeof(id->serial));
+	if (ret < 0)
+		return ret;
+
+	ret = sahara_exec(qdl, SAHARA_EXEC_MSM_HW_ID, &id->hwid, sizeof(id->hwid));
+	if (ret < 0)
+		return ret;
+
+	ret = sahara_exec(qdl, SAHARA_EXEC_OEM_PK_HASH, id->pk_hash, sizeof(id->pk_hash));
+	if (ret < 0)
+		return ret;
+	id->pk_hash_len = ret;
+
+	for (i = 0; i < id->pk_hash_len; i++)
+		sprintf(hash + 2 * i, "%02x", id->pk_hash[i]);
+	hash[2 * i] = '\0';
+
+	log_msg(log_info, "SERIAL: 0x%08x HWID: 0x%016" PRIx64 " PK HASH: %s\n",
+		id->serial, id->hwid, hash);
+
+	pkt.cmd = 0xc;
+	pkt.length = 0xc;
+	pkt.mode_switch.mode = SAHARA_MODE_IMAGE_TX_PENDING;
+	if (qdl_write(qdl, &pkt, pkt.length, true) != (int)pkt.length)
+		return -EIO;
+
+	return 0;
+}
+
+/**
+ * sahara_probe_firehose() - check whether a silent device runs firehose
+ * @qdl:	device that didn't say HELLO
+ * @buf:	buffer of the IN transfer to be reaped next
+ *
+ * A device may be silent for other reasons than a programmer waiting for
+ * commands, so it is sent a nop, which only a programmer answers with XML.
+ *
+ * Return: true if the device answered the nop like a firehose programmer
+ */
+static bool sahara_probe_firehose(struct qdl_device *qdl, const char *buf)
+{
+	static const char nop[] = "<?xml version=\"1.0\" ?>\n<data>\n<nop />\n</data>\n";
+	int n;
+
+	if (qdl_write(qdl, nop, sizeof(nop) - 1, true) != sizeof(nop) - 1)
+		return false;
+
+	n = qdl_read_reap(qdl, 1000);
+	if (n <= 0 || buf[0] != '<')
+		return false;
+
+	return memmem(buf, n, "<response", 9) || memmem(buf, n, "<log", 4);
+}
+
+/**
+ * sahara_run() - load the programmer through the Sahara protocol
+ * @qdl:	device in EDL mode
+ * @prog_mbn:	programmer image
+ *
+ * The next request is always posted before a request is answered, and image
+ * data is sent in large asynchronous transfers, so the device never waits
+ * on the host between requests. Once the DONE request is sent only the
+ * transfer receiving its response is left posted, keeping the output of the
+ * programmer for firehose.
+ *
+ * Without @prog_mbn, the identity of the device is first read in command
+ * mode, to pick its programmer from the programmer directory of @qdl. A
+ * device that crashed into memory debug mode has its memory dumped instead.
+ *
+ * A device that talks XML, or doesn't say HELLO but answers a nop, is taken
+ * to still run the programmer loaded by an earlier session, which
+ * firehose_run() resumes.
+ *
+ * Return: SAHARA_LOADED when the programmer was loaded, SAHARA_RAMDUMP when a
+ * ramdump was collected, SAHARA_FIREHOSE when the programmer is already
+ * running, negative value on failure
+ */
 int sahara_run(struct qdl_device *qdl, char *prog_mbn)
 {
+	const struct sahara_image *image = NULL;
+	struct sahara_stats stats = {};
+	char loader[PATH_MAX];
+	struct loader_id id;
+	bool identify = !prog_mbn && qdl->programmer_dir;
+	size_t xfer_size = qdl->out_xfer_size;
 	struct sahara_pkt *pkt;
-	char buf[4096];
+	char bufs[SAHARA_IN_QUEUE][SAHARA_PKT_SIZE];
 	char tmp[32];
+	bool ramdump = false;
+	bool hello = false;
 	bool done = false;
+	bool last = false;
+	char *buf;
+	int slot = 0;
+	int ret = 0;
 	int n;
 
+	for (n = 0; n < SAHARA_IN_QUEUE; n++) {
+		if (qdl_read_queue(qdl, bufs[n], SAHARA_PKT_SIZE) < 0) {
+			ret = -EIO;
+			goto out;
+		}
+	}
+
+	if (!qdl->out_xfer_size)
+		qdl->out_xfer_size = SAHARA_XFER_SIZE;
+
 	while (!done) {
-		n = qdl_read(qdl, buf, sizeof(buf), 1000);
-		if (n < 0)
+		buf = bufs[slot];
+		n = qdl_read_reap(qdl, 1000);
+
+		/* Silence, rather than a failure, may be a programmer running */
+		if (n == -ETIMEDOUT && !hello) {
+			if (!sahara_probe_firehose(qdl, buf)) {
+				log_msg(log_error, "no HELLO and no answer to nop, sahara stalled\n");
+				ret = -ETIMEDOUT;
+				break;
+			}
+			qdl->firehose_resumed = true;
+			break;
+		}
+		if (n < 0) {
+			log_msg(log_error, "failed to read sahara packet: %s\n", strerror(-n));
+			ret = -1;
 			break;
+		}
+
+		if (!hello && n > 0 && buf[0] == '<') {
+			qdl->firehose_resumed = true;
+			break;
+		}
+		hello = true;
 
 		pkt = (struct sahara_pkt*)buf;
 		if (n != pkt->length) {
 			log_msg(log_error, "length not matching");
-			return -EINVAL;
+			ret = -EINVAL;
+			break;
+		}
+
+		/* The programmer is only loaded once the device asks for it */
+		if ((pkt->cmd == 3 || pkt->cmd == 0x12) && !image) {
+			if (!prog_mbn) {
+				log_msg(log_error, "no programmer to load\n");
+				ret = -EINVAL;
+				break;
+			}
+
+			image = sahara_image_get(prog_mbn);
+			if (!image) {
+				ret = -errno;
+				log_msg(log_error, "failed to load %s: %s\n", prog_mbn, strerror(errno));
+				break;
+			}
+
+			memcpy(qdl->programmer_hash, image->hash, sizeof(image->hash));
+			qdl->programmer_hashed = true;
 		}
 
 		switch (pkt->cmd) {
 		case 1:
-			sahara_hello(qdl, pkt);
+			sahara_hello(qdl, pkt, identify ? SAHARA_MODE_COMMAND : pkt->hello_req.mode);
 			break;
+		case 0xb:
+			/* Command mode, entered on request to identify the device */
+			ret = sahara_identify(qdl, &id);
+			if (ret < 0)
+				break;
+
+			ret = loader_select(qdl->programmer_dir, &id, loader, sizeof(loader));
+			if (ret < 0)
+				break;
+
+			prog_mbn = loader;
+			identify = false;
+
+			/* The device says HELLO again, with the transfers reposted */
+			slot = 0;
+			for (n = 0; n < SAHARA_IN_QUEUE && !ret; n++) {
+				if (qdl_read_queue(qdl, bufs[n], SAHARA_PKT_SIZE) < 0)
+					ret = -EIO;
+			}
+			if (ret < 0)
+				break;
+			continue;
 		case 3:
-			sahara_read(qdl, pkt, prog_mbn);
+			ret = sahara_read(qdl, pkt, image, &stats);
 			break;
 		case 4:
-			sahara_eoi(qdl, pkt);
+			last = sahara_eoi(qdl, pkt, &stats);
 			break;
 		case 6:
 			sahara_done(qdl, pkt);
 			done = true;
 			break;
+		case 9:
+		case 0x10:
+			ret = sahara_debug(qdl, pkt);
+			ramdump = done = true;
+			break;
 		case 0x12:
-			sahara_read64(qdl, pkt, prog_mbn);
+			ret = sahara_read64(qdl, pkt, image, &stats);
 			break;
 		default:
 			sprintf(tmp, "CMD%x", pkt->cmd);
 			print_hex_dump(tmp, buf, n);
 			break;
 		}
+
+		if (ret < 0)
+			break;
+
+		if (!last && !done && qdl_read_queue(qdl, buf, SAHARA_PKT_SIZE) < 0) {
+			ret = -EIO;
+			break;
+		}
+		slot = (slot + 1) % SAHARA_IN_QUEUE;
+	}
+
+	if (qdl_write_flush(qdl) < 0 && !ret) {
+		log_msg(log_error, "failed to write image data to sahara\n");
+		ret = -EIO;
 	}
 
-	return done ? 0 : -1;
+out:
+	qdl_read_cancel(qdl);
+	qdl->out_xfer_size = xfer_size;
+
+	if (ret < 0)
+		return ret;
+
+	if (qdl->firehose_resumed)
+		return SAHARA_FIREHOSE;
+
+	return ramdump ? SAHARA_RAMDUMP : SAHARA_LOADED;
 }
@@ -63,6 +63,11 @@ def pkg_get_dylib_paths(lib):
 def main():
     cflags = pkg_get_cflags('libusb-1.0') + pkg_get_cflags('libxml-2.0')
     lflags = pkg_get_lib_flags('libxml-2.0') + pkg_get_lib_flags('libusb-1.0')
+    cflags += pkg_get_cflags('zlib') + pkg_get_cflags('liblzma')
+    lflags += pkg_get_lib_flags('zlib') + pkg_get_lib_flags('liblzma')
+    if subprocess.call(['pkg-config', '--exists', 'libzstd']) == 0:
+        cflags += ['-DHAVE_ZSTD'] + pkg_get_cflags('libzstd')
+        lflags += pkg_get_lib_flags('libzstd')
     files_to_package = []
 
     if platform.system() == 'Darwin':
@@ -77,15 +82,27 @@ def main():
     print("Files to package: {}".format(files_to_package))
 
     qdl = Extension('qdl', sources=[
+        'cache.c',
+        'decompress.c',
+        'dump.c',
         'firehose.c',
+        'image.c',
+        'loader.c',
         'patch.c',
         'program.c',
         'python_logging.c',
         'python_qdl.c',
         'qdl.c',
+        'ramdump.c',
         'sahara.c',
+        'sha256.c',
+        'sim.c',
+        'sparse.c',
         'ufs.c',
-        'util.c'],
+        'uring.c',
+        'usbfs.c',
+        'util.c',
+        'zero.c'],
         extra_compile_args=cflags,
         extra_link_args=lflags,
         extra_objects=files_to_package)
@@ -0,0 +1,27 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+#define SHA256_BLOCK_SIZE	64
+
+/**
+ * struct sha256 - SHA-256 hashing context
+ * @state:	intermediate hash value
+ * @count:	number of bytes hashed
+ * @buf:	partial block not hashed yet
+ */
+struct sha256 {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[SHA256_BLOCK_SIZE];
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+const char *sha256_impl_name(void);
+
+#endif
@@ -0,0 +1,806 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "qdl.h"
+#include "sha256.h"
+
+#include "python_logging.h"
+
+/*
+ * Emulated EDL device, speaking enough Sahara and Firehose to run the full
+ * flash path without hardware. Programmed sectors are written to
+ * <backing>.<physical partition>, or <backing>.<path>.<physical partition>
+ * when more than one device is simulated, if a backing path is configured.
+ */
+
+#define SIM_MAXPKTSIZE 512
+#define SIM_SAHARA_CHUNK (1024 * 1024)
+#define SIM_SAHARA_IMAGE 13
+#define SIM_READ_CHUNK (1024 * 1024)
+
+/* Identity reported in Sahara command mode */
+#define SIM_SERIAL 0x1234abcd
+#define SIM_HWID 0x001350e100000000ULL
+
+/* Memory of a device in memory debug mode, see sim_memory() */
+#define SIM_RAMDUMP_TABLE 0x10000
+#define SIM_RAMDUMP_ZERO 0x20000000
+#define SIM_RAMDUMP_ZERO_SIZE (1024 * 1024)
+#define SIM_RAMDUMP_OCIMEM 0x14680000
+#define SIM_RAMDUMP_OCIMEM_SIZE (256 * 1024)
+#define SIM_RAMDUMP_DDR 0x80000000ULL
+
+struct qdl_sim_config qdl_sim_config;
+
+enum sim_state {
+  SIM_SAHARA_HELLO,
+  SIM_SAHARA_READ,
+  SIM_SAHARA_DONE,
+  SIM_SAHARA_DEBUG,
+  SIM_SAHARA_COMMAND,
+  SIM_FIREHOSE,
+  SIM_FIREHOSE_RAW,
+  SIM_FIREHOSE_READ,
+};
+
+struct sim_msg {
+  size_t len;
+  size_t offset;
+  struct sim_msg *next;
+  char data[];
+};
+
+struct sim_device {
+  enum sim_state state;
+  const char *path;
+
+  struct sim_msg *rx;
+  struct sim_msg *rx_last;
+
+  /* Sahara image transfer */
+  size_t image_size;
+  size_t image_offset;
+  size_t image_pending;
+
+  /* Memory debug, memory being sent */
+  uint64_t debug_addr;
+  uint64_t debug_left;
+
+  /* Firehose command reassembly */
+  char *cmd;
+  size_t cmd_len;
+  size_t cmd_size;
+
+  /* Firehose raw data, received or sent */
+  int raw_fd;
+  off_t raw_offset;
+  size_t raw_left;
+};
+
+static void sim_delay(size_t len) {
+  struct qdl_sim_config *cfg = &qdl_sim_config;
+  uint64_t us = cfg->latency_us;
+  struct timespec ts;
+
+  if (cfg->bandwidth)
+    us += (uint64_t)len * 1000000 / ((uint64_t)cfg->bandwidth * 1024);
+
+  if (!us)
+    return;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+static void sim_queue(struct sim_device *sim, const void *buf, size_t len) {
+  struct sim_msg *msg;
+
+  msg = malloc(sizeof(*msg) + len);
+  if (!msg)
+    return;
+
+  msg->len = len;
+  msg->offset = 0;
+  msg->next = NULL;
+  memcpy(msg->data, buf, len);
+
+  if (sim->rx_last)
+    sim->rx_last->next = msg;
+  else
+    sim->rx = msg;
+  sim->rx_last = msg;
+}
+
+static void sim_sahara_send(struct sim_device *sim, uint32_t cmd,
+                            const uint32_t *args, size_t nargs) {
+  uint32_t pkt[12] = {cmd, (2 + nargs) * sizeof(uint32_t)};
+
+  memcpy(&pkt[2], args, nargs * sizeof(uint32_t));
+  sim_queue(sim, pkt, pkt[1]);
+}
+
+static void sim_firehose_send(struct sim_device *sim, const char *fmt, ...);
+
+static void sim_sahara_next_read(struct sim_device *sim) {
+  size_t left = sim->image_size - sim->image_offset;
+  uint32_t args[6];
+
+  if (!left) {
+    /* END OF IMAGE, success */
+    args[0] = SIM_SAHARA_IMAGE;
+    args[1] = 0;
+    sim_sahara_send(sim, 4, args, 2);
+    sim->state = SIM_SAHARA_DONE;
+    return;
+  }
+
+  /* Start with a small READ of the header, like the PBL does */
+  if (sim->image_offset == 0) {
+    sim->image_pending = left < 0x1000 ? left : 0x1000;
+    args[0] = SIM_SAHARA_IMAGE;
+    args[1] = 0;
+    args[2] = sim->image_pending;
+    sim_sahara_send(sim, 3, args, 3);
+  } else {
+    uint64_t req[3];
+
+    sim->image_pending = left < SIM_SAHARA_CHUNK ? left : SIM_SAHARA_CHUNK;
+    req[0] = SIM_SAHARA_IMAGE;
+    req[1] = sim->image_offset;
+    req[2] = sim->image_pending;
+    memcpy(args, req, sizeof(req));
+    sim_sahara_send(sim, 0x12, args, 6);
+  }
+
+  sim->state = SIM_SAHARA_READ;
+}
+
+/*
+ * Memory of a crashed device: the region table, followed by OCIMEM and DDR
+ * holding 64-bit words equal to their address, and a region of zeros.
+ */
+struct sim_debug_region {
+  uint64_t type;
+  uint64_t addr;
+  uint64_t length;
+  char name[20];
+  char filename[20];
+};
+
+static const struct sim_debug_region *sim_ramdump_table(size_t *len) {
+  static struct sim_debug_region table[3] = {
+      {1, SIM_RAMDUMP_OCIMEM, SIM_RAMDUMP_OCIMEM_SIZE, "OCIMEM", "OCIMEM.BIN"},
+      {1, SIM_RAMDUMP_DDR, 0, "DDR CS0", "DDRCS0.BIN"},
+      {1, SIM_RAMDUMP_ZERO, SIM_RAMDUMP_ZERO_SIZE, "ZERO", ""},
+  };
+
+  table[1].length = qdl_sim_config.ramdump;
+  *len = sizeof(table);
+  return table;
+}
+
+static uint8_t sim_memory(uint64_t addr) {
+  const struct sim_debug_region *table;
+  size_t len;
+
+  table = sim_ramdump_table(&len);
+  if (addr >= SIM_RAMDUMP_TABLE && addr < SIM_RAMDUMP_TABLE + len)
+    return ((const uint8_t *)table)[addr - SIM_RAMDUMP_TABLE];
+
+  if (addr >= SIM_RAMDUMP_ZERO && addr < SIM_RAMDUMP_ZERO + SIM_RAMDUMP_ZERO_SIZE)
+    return 0;
+
+  return (addr & ~7ULL) >> (8 * (addr & 7));
+}
+
+static int sim_read_memory(struct sim_device *sim, void *buf, size_t len) {
+  uint8_t *p = buf;
+  size_t n;
+  size_t i;
+
+  n = len < sim->debug_left ? len : sim->debug_left;
+  if (n > SIM_READ_CHUNK)
+    n = SIM_READ_CHUNK;
+
+  sim_delay(n);
+
+  for (i = 0; i < n; i++)
+    p[i] = sim_memory(sim->debug_addr + i);
+
+  sim->debug_addr += n;
+  sim->debug_left -= n;
+
+  return n;
+}
+
+static void sim_sahara_debug(struct sim_device *sim, const uint32_t *pkt,
+                             size_t len) {
+  uint64_t req[2];
+
+  if (len >= 8 && pkt[0] == 7) {
+    /* RESET response */
+    sim_sahara_send(sim, 8, NULL, 0);
+    return;
+  }
+
+  if (len < 0x18 || pkt[0] != 0x11) {
+    log_msg(log_error, "[SIM] expected MEMORY READ64 request\n");
+    return;
+  }
+
+  memcpy(req, &pkt[2], sizeof(req));
+  sim->debug_addr = req[0];
+  sim->debug_left = req[1];
+}
+
+/* The PK hash is 00 01 02 ... 1f */
+static void sim_sahara_command(struct sim_device *sim, const uint32_t *pkt,
+                               size_t len) {
+  uint32_t hello[10] = {2, 1, SIM_MAXPKTSIZE, 0};
+  uint64_t hwid = SIM_HWID;
+  uint32_t serial = SIM_SERIAL;
+  uint8_t hash[32];
+  uint32_t args[2];
+  int i;
+
+  if (len < 12) {
+    log_msg(log_error, "[SIM] expected command mode request\n");
+    return;
+  }
+
+  switch (pkt[0]) {
+  case 0xc:
+    /* SWITCH MODE, back to image transfer */
+    sim_sahara_send(sim, 1, hello, 10);
+    sim->state = SIM_SAHARA_HELLO;
+    break;
+  case 0xd:
+    args[0] = pkt[2];
+    args[1] = pkt[2] == 1 ? sizeof(serial) : pkt[2] == 2 ? sizeof(hwid) : sizeof(hash);
+    sim_sahara_send(sim, 0xe, args, 2);
+    break;
+  case 0xf:
+    for (i = 0; i < (int)sizeof(hash); i++)
+      hash[i] = i;
+    if (pkt[2] == 1)
+      sim_queue(sim, &serial, sizeof(serial));
+    else if (pkt[2] == 2)
+      sim_queue(sim, &hwid, sizeof(hwid));
+    else
+      sim_queue(sim, hash, sizeof(hash));
+    break;
+  default:
+    log_msg(log_error, "[SIM] unexpected command 0x%x\n", pkt[0]);
+    break;
+  }
+}
+
+static void sim_sahara_write(struct sim_device *sim, const void *buf,
+                             size_t len) {
+  const uint32_t *pkt = buf;
+
+  switch (sim->state) {
+  case SIM_SAHARA_HELLO:
+    if (len < 8 || pkt[0] != 2) {
+      log_msg(log_error, "[SIM] expected HELLO response\n");
+      return;
+    }
+    if (len >= 24 && pkt[5] == 3) {
+      /* Command mode, CMD READY */
+      sim_sahara_send(sim, 0xb, NULL, 0);
+      sim->state = SIM_SAHARA_COMMAND;
+      break;
+    }
+    if (qdl_sim_config.ramdump) {
+      uint64_t req[2] = {SIM_RAMDUMP_TABLE};
+      uint32_t args[4];
+      size_t table_len;
+
+      /* MEMORY DEBUG64, pointing at the region table */
+      sim_ramdump_table(&table_len);
+      req[1] = table_len;
+      memcpy(args, req, sizeof(req));
+      sim_sahara_send(sim, 0x10, args, 4);
+      sim->state = SIM_SAHARA_DEBUG;
+      break;
+    }
+    sim_sahara_next_read(sim);
+    break;
+  case SIM_SAHARA_DEBUG:
+    sim_sahara_debug(sim, pkt, len);
+    break;
+  case SIM_SAHARA_COMMAND:
+    sim_sahara_command(sim, pkt, len);
+    break;
+  case SIM_SAHARA_READ:
+    if (len > sim->image_pending) {
+      log_msg(log_error, "[SIM] sahara overrun\n");
+      len = sim->image_pending;
+    }
+    sim->image_offset += len;
+    sim->image_pending -= len;
+    if (!sim->image_pending)
+      sim_sahara_next_read(sim);
+    break;
+  case SIM_SAHARA_DONE:
+    if (len < 8 || pkt[0] != 5) {
+      log_msg(log_error, "[SIM] expected DONE request\n");
+      return;
+    }
+    /* DONE response, status success */
+    sim_sahara_send(sim, 6, (uint32_t[]){0}, 1);
+    sim->state = SIM_FIREHOSE;
+    sim_firehose_send(sim, "<log value=\"Binary build date: simulated\" />");
+    break;
+  default:
+    break;
+  }
+}
+
+static void sim_firehose_send(struct sim_device *sim, const char *fmt, ...) {
+  char body[512];
+  char buf[640];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  vsnprintf(body, sizeof(body), fmt, ap);
+  va_end(ap);
+
+  n = snprintf(buf, sizeof(buf),
+               "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+               "<data>\n%s\n</data>",
+               body);
+  sim_queue(sim, buf, n);
+}
+
+static unsigned sim_attr(xmlNode *node, const char *attr) {
+  xmlChar *value;
+  unsigned ret;
+
+  value = xmlGetProp(node, (xmlChar *)attr);
+  if (!value)
+    return 0;
+
+  ret = strtoul((char *)value, NULL, 10);
+  xmlFree(value);
+  return ret;
+}
+
+static int sim_backing_open(struct sim_device *sim, unsigned partition,
+                            int flags) {
+  char path[PATH_MAX];
+  int fd;
+
+  if (qdl_sim_config.devices > 1)
+    snprintf(path, sizeof(path), "%s.%s.%u", qdl_sim_config.backing, sim->path,
+             partition);
+  else
+    snprintf(path, sizeof(path), "%s.%u", qdl_sim_config.backing, partition);
+
+  fd = open(path, flags, 0644);
+  if (fd < 0)
+    log_msg(log_error, "[SIM] unable to open %s\n", path);
+
+  return fd;
+}
+
+static void sim_firehose_program(struct sim_device *sim, xmlNode *node) {
+  unsigned sector_size = sim_attr(node, "SECTOR_SIZE_IN_BYTES");
+  unsigned num_sectors = sim_attr(node, "num_partition_sectors");
+  unsigned partition = sim_attr(node, "physical_partition_number");
+  xmlChar *start;
+  char *end;
+
+  sim->raw_left = (size_t)sector_size * num_sectors;
+  sim->raw_fd = -1;
+
+  start = xmlGetProp(node, (xmlChar *)"start_sector");
+  sim->raw_offset = start ? strtoull((char *)start, &end, 10) : 0;
+  sim->raw_offset *= sector_size;
+
+  if (qdl_sim_config.backing && start && *end == '\0') {
+    sim->raw_fd = sim_backing_open(sim, partition, O_WRONLY | O_CREAT);
+  } else if (qdl_sim_config.backing) {
+    sim_firehose_send(sim, "<log value=\"start_sector %s not emulated\" />",
+                      start);
+  }
+  xmlFree(start);
+
+  sim_firehose_send(sim, "<response value=\"ACK\" rawmode=\"true\" />");
+  sim->state = SIM_FIREHOSE_RAW;
+}
+
+/* Erased sectors read back as zeros */
+static void sim_firehose_erase(struct sim_device *sim, xmlNode *node) {
+  unsigned sector_size = sim_attr(node, "SECTOR_SIZE_IN_BYTES");
+  unsigned num_sectors = sim_attr(node, "num_partition_sectors");
+  unsigned partition = sim_attr(node, "physical_partition_number");
+  static const char zeros[65536];
+  off_t offset;
+  size_t left;
+  size_t n;
+  int fd;
+
+  offset = (off_t)sim_attr(node, "start_sector") * sector_size;
+  left = (size_t)num_sectors * sector_size;
+
+  if (qdl_sim_config.backing) {
+    fd = sim_backing_open(sim, partition, O_WRONLY | O_CREAT);
+    for (; fd >= 0 && left; left -= n, offset += n) {
+      n = left < sizeof(zeros) ? left : sizeof(zeros);
+      if (pwrite(fd, zeros, n, offset) < 0) {
+        log_msg(log_error, "[SIM] failed to write backing file\n");
+        break;
+      }
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+
+  sim_firehose_send(sim, "<response value=\"ACK\" />");
+}
+
+/* The raw data is produced by sim_read(), once the ACK has been read */
+static void sim_firehose_read(struct sim_device *sim, xmlNode *node) {
+  unsigned sector_size = sim_attr(node, "SECTOR_SIZE_IN_BYTES");
+  unsigned num_sectors = sim_attr(node, "num_partition_sectors");
+  unsigned partition = sim_attr(node, "physical_partition_number");
+
+  sim->raw_offset = (off_t)sim_attr(node, "start_sector") * sector_size;
+  sim->raw_left = (size_t)sector_size * num_sectors;
+  sim->raw_fd = -1;
+
+  if (qdl_sim_config.backing)
+    sim->raw_fd = sim_backing_open(sim, partition, O_RDONLY | O_CREAT);
+
+  sim_firehose_send(sim, "<response value=\"ACK\" rawmode=\"true\" />");
+  sim->state = SIM_FIREHOSE_READ;
+}
+
+/* Sectors beyond the end of the backing file read back as zeros */
+static void sim_firehose_digest(struct sim_device *sim, xmlNode *node) {
+  unsigned sector_size = sim_attr(node, "SECTOR_SIZE_IN_BYTES");
+  unsigned num_sectors = sim_attr(node, "num_partition_sectors");
+  unsigned partition = sim_attr(node, "physical_partition_number");
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  char hex[2 * SHA256_DIGEST_SIZE + 1];
+  struct sha256 sha;
+  char buf[65536];
+  off_t offset;
+  size_t left;
+  ssize_t n;
+  int fd;
+  int i;
+
+  if (!qdl_sim_config.backing) {
+    sim_firehose_send(sim, "<log value=\"getsha256digest not emulated\" />");
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+    return;
+  }
+
+  offset = (off_t)sim_attr(node, "start_sector") * sector_size;
+  left = (size_t)num_sectors * sector_size;
+
+  fd = sim_backing_open(sim, partition, O_RDONLY | O_CREAT);
+  if (fd < 0) {
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+    return;
+  }
+
+  sha256_init(&sha);
+  for (; left; left -= n, offset += n) {
+    n = pread(fd, buf, left < sizeof(buf) ? left : sizeof(buf), offset);
+    if (n < 0) {
+      log_msg(log_error, "[SIM] failed to read backing file\n");
+      break;
+    } else if (n == 0) {
+      n = left < sizeof(buf) ? left : sizeof(buf);
+      memset(buf, 0, n);
+    }
+    sha256_update(&sha, buf, n);
+  }
+  close(fd);
+
+  if (left) {
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+    return;
+  }
+
+  sha256_final(&sha, digest);
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    sprintf(hex + 2 * i, "%02X", digest[i]);
+
+  sim_firehose_send(sim, "<log value=\"Digest %s\" />", hex);
+  sim_firehose_send(sim, "<response value=\"ACK\" />");
+}
+
+static void sim_firehose_command(struct sim_device *sim, xmlNode *node) {
+  const char *name = (const char *)node->name;
+  unsigned payload;
+
+  if (!strcmp(name, "configure")) {
+    payload = sim_attr(node, "MaxPayloadSizeToTargetInBytes");
+    sim_firehose_send(sim,
+                      "<response value=\"ACK\" MinVersionSupported=\"1\" "
+                      "MaxPayloadSizeToTargetInBytes=\"%u\" "
+                      "MaxPayloadSizeToTargetInBytesSupported=\"%u\" "
+                      "MaxXMLSizeInBytes=\"4096\" />",
+                      payload, payload);
+  } else if (!strcmp(name, "program")) {
+    sim_firehose_program(sim, node);
+  } else if (!strcmp(name, "erase")) {
+    sim_firehose_erase(sim, node);
+  } else if (!strcmp(name, "read")) {
+    sim_firehose_read(sim, node);
+  } else if (!strcmp(name, "getsha256digest")) {
+    sim_firehose_digest(sim, node);
+  } else if (!strcmp(name, "patch") || !strcmp(name, "nop") ||
+             !strcmp(name, "setbootablestoragedrive") ||
+             !strcmp(name, "power") || !strcmp(name, "ufs")) {
+    sim_firehose_send(sim, "<response value=\"ACK\" />");
+  } else {
+    sim_firehose_send(sim, "<log value=\"unsupported command %s\" />", name);
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+  }
+}
+
+static void sim_firehose_parse(struct sim_device *sim, const char *buf,
+                               size_t len) {
+  xmlNode *node;
+  xmlDoc *doc;
+
+  doc = xmlReadMemory(buf, len, NULL, NULL, 0);
+  if (!doc) {
+    sim_firehose_send(sim, "<log value=\"XML parse error\" />");
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+    return;
+  }
+
+  node = xmlDocGetRootElement(doc);
+  if (qdl_sim_config.single_command && node &&
+      xmlChildElementCount(node) > 1) {
+    sim_firehose_send(sim, "<log value=\"one command per document\" />");
+    sim_firehose_send(sim, "<response value=\"NAK\" />");
+    xmlFreeDoc(doc);
+    return;
+  }
+
+  for (node = node ? node->children : NULL; node; node = node->next) {
+    if (node->type == XML_ELEMENT_NODE)
+      sim_firehose_command(sim, node);
+  }
+
+  xmlFreeDoc(doc);
+}
+
+static void sim_firehose_raw(struct sim_device *sim, const void *buf,
+                             size_t len) {
+  if (len > sim->raw_left) {
+    log_msg(log_error, "[SIM] raw data overrun\n");
+    len = sim->raw_left;
+  }
+
+  if (sim->raw_fd >= 0 && pwrite(sim->raw_fd, buf, len, sim->raw_offset) < 0)
+    log_msg(log_error, "[SIM] failed to write backing file\n");
+
+  sim->raw_offset += len;
+  sim->raw_left -= len;
+
+  if (!sim->raw_left) {
+    if (sim->raw_fd >= 0)
+      close(sim->raw_fd);
+    sim->state = SIM_FIREHOSE;
+    sim_firehose_send(sim, "<response value=\"ACK\" rawmode=\"false\" />");
+  }
+}
+
+static void sim_firehose_write(struct sim_device *sim, const void *buf,
+                               size_t len) {
+  char *end;
+  size_t n;
+
+  if (sim->cmd_len + len + 1 > sim->cmd_size) {
+    sim->cmd_size = sim->cmd_len + len + 1;
+    sim->cmd = realloc(sim->cmd, sim->cmd_size);
+  }
+  memcpy(sim->cmd + sim->cmd_len, buf, len);
+  sim->cmd_len += len;
+  sim->cmd[sim->cmd_len] = '\0';
+
+  /* Commands may span multiple transfers, wait for the closing tag */
+  while ((end = strstr(sim->cmd, "</data>")) != NULL) {
+    n = end + strlen("</data>") - sim->cmd;
+    sim_firehose_parse(sim, sim->cmd, n);
+
+    while (n < sim->cmd_len && sim->cmd[n] != '<')
+      n++;
+    memmove(sim->cmd, sim->cmd + n, sim->cmd_len - n + 1);
+    sim->cmd_len -= n;
+  }
+}
+
+static int sim_list(char (*paths)[QDL_PATH_MAX], int max) {
+  int count = qdl_sim_config.devices ? qdl_sim_config.devices : 1;
+  int i;
+
+  for (i = 0; i < count && i < max; i++)
+    snprintf(paths[i], QDL_PATH_MAX, "sim%d", i);
+
+  return i;
+}
+
+static int sim_open(struct qdl_device *qdl) {
+  struct sim_device *sim;
+  uint32_t hello[10] = {2, 1, SIM_MAXPKTSIZE, 0};
+
+  sim = calloc(1, sizeof(*sim));
+  if (!sim)
+    return -ENOMEM;
+
+  sim->image_size = qdl_sim_config.image_size;
+  sim->raw_fd = -1;
+  if (!qdl->path[0])
+    strcpy(qdl->path, "sim0");
+  sim->path = qdl->path;
+
+  qdl->sim = sim;
+  qdl->in_maxpktsize = SIM_MAXPKTSIZE;
+  qdl->out_maxpktsize = SIM_MAXPKTSIZE;
+
+  if (qdl_sim_config.firehose) {
+    sim->state = SIM_FIREHOSE;
+    sim_firehose_send(sim, "<response value=\"ACK\" />");
+    return 0;
+  }
+
+  /* HELLO version 2, compatible 1, image transfer pending or memory debug */
+  if (qdl_sim_config.ramdump)
+    hello[3] = 2;
+  sim_sahara_send(sim, 1, hello, 10);
+  return 0;
+}
+
+/* Send the sectors requested by a read command, in chunks */
+static int sim_read_raw(struct sim_device *sim, void *buf, size_t len) {
+  ssize_t ret = 0;
+  size_t n;
+
+  n = len < sim->raw_left ? len : sim->raw_left;
+  if (n > SIM_READ_CHUNK)
+    n = SIM_READ_CHUNK;
+
+  sim_delay(n);
+
+  if (sim->raw_fd >= 0)
+    ret = pread(sim->raw_fd, buf, n, sim->raw_offset);
+  if (ret < 0) {
+    log_msg(log_error, "[SIM] failed to read backing file\n");
+    ret = 0;
+  }
+  memset((char *)buf + ret, 0, n - ret);
+
+  sim->raw_offset += n;
+  sim->raw_left -= n;
+
+  if (!sim->raw_left) {
+    if (sim->raw_fd >= 0)
+      close(sim->raw_fd);
+    sim->state = SIM_FIREHOSE;
+    sim_firehose_send(sim, "<response value=\"ACK\" rawmode=\"false\" />");
+  }
+
+  return n;
+}
+
+static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
+                    unsigned int timeout) {
+  struct sim_device *sim = qdl->sim;
+  struct sim_msg *msg = sim->rx;
+  size_t n;
+
+  if (!msg && sim->state == SIM_FIREHOSE_READ)
+    return sim_read_raw(sim, buf, len);
+
+  if (!msg && sim->debug_left)
+    return sim_read_memory(sim, buf, len);
+
+  if (!msg) {
+    usleep(timeout * 1000);
+    return -ETIMEDOUT;
+  }
+
+  n = msg->len - msg->offset;
+  if (n > len)
+    n = len;
+
+  sim_delay(n);
+  memcpy(buf, msg->data + msg->offset, n);
+  msg->offset += n;
+
+  if (msg->offset == msg->len) {
+    sim->rx = msg->next;
+    if (!sim->rx)
+      sim->rx_last = NULL;
+    free(msg);
+  }
+
+  return n;
+}
+
+static int sim_submit(struct qdl_device *qdl, const void *buf, size_t len) {
+  struct sim_device *sim = qdl->sim;
+
+  sim_delay(len);
+
+  if (!len)
+    return 0;
+
+  switch (sim->state) {
+  case SIM_FIREHOSE:
+    sim_firehose_write(sim, buf, len);
+    break;
+  case SIM_FIREHOSE_RAW:
+    sim_firehose_raw(sim, buf, len);
+    break;
+  default:
+    sim_sahara_write(sim, buf, len);
+    break;
+  }
+
+  return 0;
+}
+
+static int sim_flush(struct qdl_device *qdl) {
+  return 0;
+}
+
+const struct qdl_transport qdl_sim_transport = {
+    .name = "sim",
+    .list = sim_list,
+    .open = sim_open,
+    .read = sim_read,
+    .submit = sim_submit,
+    .flush = sim_flush,
+};
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse.h"
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+};
+
+static uint16_t sparse_le16(const void *p)
+{
+	const uint8_t *b = p;
+
+	return b[0] | b[1] << 8;
+}
+
+static uint32_t sparse_le32(const void *p)
+{
+	const uint8_t *b = p;
+
+	return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static int sparse_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	do {
+		n = pread(fd, buf, len, offset);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)
+		return -errno;
+
+	return (size_t)n == len ? 0 : -EINVAL;
+}
+
+static int sparse_read_header(int fd, off_t base, struct sparse_header *hdr)
+{
+	uint8_t buf[sizeof(*hdr)];
+	int ret;
+
+	ret = sparse_pread(fd, buf, sizeof(buf), base);
+	if (ret < 0)
+		return ret;
+
+	hdr->magic = sparse_le32(buf);
+	hdr->major_version = sparse_le16(buf + 4);
+	hdr->minor_version = sparse_le16(buf + 6);
+	hdr->file_hdr_sz = sparse_le16(buf + 8);
+	hdr->chunk_hdr_sz = sparse_le16(buf + 10);
+	hdr->blk_sz = sparse_le32(buf + 12);
+	hdr->total_blks = sparse_le32(buf + 16);
+	hdr->total_chunks = sparse_le32(buf + 20);
+	hdr->image_checksum = sparse_le32(buf + 24);
+
+	return 0;
+}
+
+/**
+ * sparse_detect() - check for an Android sparse image
+ * @fd:		file to check
+ * @base:	offset of the image in @fd
+ *
+ * Return: true if the image at @base starts with the sparse header magic
+ */
+bool sparse_detect(int fd, off_t base)
+{
+	struct sparse_header hdr;
+
+	if (sparse_read_header(fd, base, &hdr) < 0)
+		return false;
+
+	return hdr.magic == SPARSE_HEADER_MAGIC;
+}
+
+/**
+ * sparse_open() - parse the chunk list of an Android sparse image
+ * @sparse:	sparse image to initialize
+ * @fd:		file holding the image
+ * @base:	offset of the image in @fd
+ *
+ * Only the headers are read, the data of RAW chunks stays in the file at
+ * the recorded offsets. Adjacent chunks of the same type are not merged.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int sparse_open(struct sparse *sparse, int fd, off_t base)
+{
+	struct sparse_chunk_header chdr;
+	struct sparse_header hdr;
+	struct sparse_chunk *chunk;
+	uint8_t buf[sizeof(chdr)];
+	off_t offset;
+	off_t pos;
+	off_t size;
+	uint32_t i;
+	int ret;
+
+	memset(sparse, 0, sizeof(*sparse));
+
+	ret = sparse_read_header(fd, base, &hdr);
+	if (ret < 0)
+		return ret;
+
+	if (hdr.magic != SPARSE_HEADER_MAGIC || hdr.major_version != 1 ||
+	    hdr.file_hdr_sz < sizeof(hdr) || hdr.chunk_hdr_sz < sizeof(chdr) ||
+	    !hdr.blk_sz || hdr.blk_sz % 4)
+		return -EINVAL;
+
+	sparse->chunks = calloc(hdr.total_chunks ? hdr.total_chunks : 1, sizeof(*sparse->chunks));
+	if (!sparse->chunks)
+		return -ENOMEM;
+
+	sparse->block_size = hdr.blk_sz;
+
+	pos = base + hdr.file_hdr_sz;
+	offset = 0;
+	for (i = 0; i < hdr.total_chunks; i++) {
+		ret = sparse_pread(fd, buf, sizeof(buf), pos);
+		if (ret < 0)
+			goto err;
+
+		chdr.chunk_type = sparse_le16(buf);
+		chdr.chunk_sz = sparse_le32(buf + 4);
+		chdr.total_sz = sparse_le32(buf + 8);
+
+		size = (off_t)chdr.chunk_sz * hdr.blk_sz;
+		chunk = &sparse->chunks[sparse->count];
+		chunk->type = chdr.chunk_type;
+		chunk->offset = offset;
+		chunk->size = size;
+		chunk->file_offset = pos + hdr.chunk_hdr_sz;
+
+		ret = -EINVAL;
+		switch (chdr.chunk_type) {
+		case SPARSE_CHUNK_RAW:
+			if (chdr.total_sz != hdr.chunk_hdr_sz + size)
+				goto err;
+			break;
+		case SPARSE_CHUNK_FILL:
+			if (chdr.total_sz != hdr.chunk_hdr_sz + 4u)
+				goto err;
+			ret = sparse_pread(fd, buf, 4, chunk->file_offset);
+			if (ret < 0)
+				goto err;
+			chunk->fill = sparse_le32(buf);
+			break;
+		case SPARSE_CHUNK_DONT_CARE:
+			if (chdr.total_sz != hdr.chunk_hdr_sz)
+				goto err;
+			break;
+		case SPARSE_CHUNK_CRC32:
+			/* Covers no blocks, nothing to program */
+			pos += chdr.total_sz;
+			continue;
+		default:
+			goto err;
+		}
+
+		if (size)
+			sparse->count++;
+
+		offset += size;
+		pos += chdr.total_sz;
+	}
+
+	if (offset != (off_t)hdr.total_blks * hdr.blk_sz) {
+		ret = -EINVAL;
+		goto err;
+	}
+
+	sparse->size = offset;
+	return 0;
+
+err:
+	sparse_close(sparse);
+	return ret;
+}
+
+void sparse_close(struct sparse *sparse)
+{
+	free(sparse->chunks);
+	sparse->chunks = NULL;
+	sparse->count = 0;
+}
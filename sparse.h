@@ -0,0 +1,50 @@
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+
+#define SPARSE_CHUNK_RAW	0xcac1
+#define SPARSE_CHUNK_FILL	0xcac2
+#define SPARSE_CHUNK_DONT_CARE	0xcac3
+#define SPARSE_CHUNK_CRC32	0xcac4
+
+/**
+ * struct sparse_chunk - region of the unsparsed image
+ * @type:	SPARSE_CHUNK_RAW, SPARSE_CHUNK_FILL or SPARSE_CHUNK_DONT_CARE
+ * @offset:	byte offset of the region in the unsparsed image
+ * @size:	size of the region, in bytes
+ * @file_offset: offset of the data in the sparse file, for RAW chunks
+ * @fill:	32-bit pattern the region is filled with, for FILL chunks
+ */
+struct sparse_chunk {
+	unsigned type;
+	off_t offset;
+	off_t size;
+	off_t file_offset;
+	uint32_t fill;
+};
+
+/**
+ * struct sparse - parsed Android sparse image
+ * @block_size:	size of the blocks the chunks are made of
+ * @size:	size of the unsparsed image, in bytes
+ * @chunks:	regions of the unsparsed image, in order and without gaps
+ * @count:	number of entries in @chunks
+ */
+struct sparse {
+	unsigned block_size;
+	off_t size;
+
+	struct sparse_chunk *chunks;
+	unsigned count;
+};
+
+bool sparse_detect(int fd, off_t base);
+int sparse_open(struct sparse *sparse, int fd, off_t base);
+void sparse_close(struct sparse *sparse);
+
+#endif
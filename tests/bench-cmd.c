@@ -0,0 +1,169 @@
+/*
+ * Serialize firehose program and patch commands with the command buffer of
+ * firehose.c and, for comparison, as libxml2 documents dumped to memory,
+ * the way they were built before.
+ *
+ * usage: bench-cmd [<commands>]
+ */
+#include "../firehose.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+void begin_allow_threads() {}
+
+void end_allow_threads() {}
+
+void log_msg(int type, char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+void progress_callback(void *context, int current, int total) {}
+
+static const struct program bench_program = {
+	.sector_size = 4096,
+	.filename = "system.img",
+	.num_sectors = 1048576,
+	.partition = 0,
+};
+
+static const struct patch bench_patch = {
+	.sector_size = 4096,
+	.byte_offset = 1064,
+	.filename = "DISK",
+	.partition = 0,
+	.size_in_bytes = 8,
+	.start_sector = "NUM_DISK_SECTORS-5.",
+	.value = "NUM_DISK_SECTORS-6.",
+};
+
+static void bench_setpropf(xmlNode *node, const char *attr, const char *fmt, ...)
+{
+	xmlChar buf[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf((char *)buf, sizeof(buf), fmt, ap);
+	xmlSetProp(node, (xmlChar *)attr, buf);
+	va_end(ap);
+}
+
+static size_t bench_dom(const char *tag, unsigned i)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+	xmlChar *s;
+	int len;
+
+	doc = xmlNewDoc((xmlChar *)"1.0");
+	root = xmlNewNode(NULL, (xmlChar *)"data");
+	xmlDocSetRootElement(doc, root);
+	node = xmlNewChild(root, NULL, (xmlChar *)tag, NULL);
+
+	if (!strcmp(tag, "program")) {
+		bench_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", bench_program.sector_size);
+		bench_setpropf(node, "num_partition_sectors", "%d", bench_program.num_sectors);
+		bench_setpropf(node, "physical_partition_number", "%d", bench_program.partition);
+		bench_setpropf(node, "start_sector", "%u", i);
+		bench_setpropf(node, "filename", "%s", bench_program.filename);
+	} else {
+		bench_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", bench_patch.sector_size);
+		bench_setpropf(node, "byte_offset", "%d", bench_patch.byte_offset);
+		bench_setpropf(node, "filename", "%s", bench_patch.filename);
+		bench_setpropf(node, "physical_partition_number", "%d", bench_patch.partition);
+		bench_setpropf(node, "size_in_bytes", "%d", bench_patch.size_in_bytes);
+		bench_setpropf(node, "start_sector", "%s", bench_patch.start_sector);
+		bench_setpropf(node, "value", "%s", bench_patch.value);
+	}
+
+	xmlDocDumpMemory(doc, &s, &len);
+	xmlFree(s);
+	xmlFreeDoc(doc);
+
+	return len;
+}
+
+static size_t bench_cmd(struct qdl_device *qdl, const char *tag, unsigned i)
+{
+	struct patch patch = bench_patch;
+
+	firehose_cmd_begin(qdl, tag);
+
+	if (!strcmp(tag, "program")) {
+		firehose_cmd_attr(qdl, "SECTOR_SIZE_IN_BYTES", "%d", bench_program.sector_size);
+		firehose_cmd_attr(qdl, "num_partition_sectors", "%d", bench_program.num_sectors);
+		firehose_cmd_attr(qdl, "physical_partition_number", "%d", bench_program.partition);
+		firehose_cmd_attr(qdl, "start_sector", "%u", i);
+		firehose_cmd_attr(qdl, "filename", "%s", bench_program.filename);
+	} else {
+		firehose_cmd_patch(qdl, &patch);
+	}
+
+	/* As firehose_cmd_send(), without the write */
+	firehose_cmd_append(qdl, FIREHOSE_CMD_TRAILER, sizeof(FIREHOSE_CMD_TRAILER) - 1);
+
+	return qdl->cmd_len;
+}
+
+static double bench_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const tags[] = { "program", "patch" };
+	struct qdl_device qdl = {};
+	struct timespec start;
+	unsigned long count;
+	unsigned long i;
+	size_t dom_len;
+	size_t cmd_len;
+	double dom;
+	double cmd;
+	unsigned t;
+
+	count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+	if (!count) {
+		fprintf(stderr, "usage: %s [<commands>]\n", argv[0]);
+		return 1;
+	}
+
+	for (t = 0; t < 2; t++) {
+		dom_len = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			dom_len += bench_dom(tags[t], i);
+		dom = bench_elapsed(&start);
+
+		cmd_len = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; i++)
+			cmd_len += bench_cmd(&qdl, tags[t], i);
+		cmd = bench_elapsed(&start);
+
+		if (qdl.cmd_error) {
+			fprintf(stderr, "%s: failed to serialize: %d\n", tags[t], qdl.cmd_error);
+			return 1;
+		}
+
+		printf("%s, %lu commands:\n", tags[t], count);
+		printf("  libxml2: %6.0f ns, %3zu bytes per command\n",
+		       dom * 1e9 / count, dom_len / count);
+		printf("  buffer:  %6.0f ns, %3zu bytes per command (%.1fx faster)\n",
+		       cmd * 1e9 / count, cmd_len / count, dom / cmd);
+	}
+
+	free(qdl.cmd);
+
+	return 0;
+}
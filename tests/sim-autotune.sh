@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Flash an image with --auto-tune through the simulated device and check
+# that the payload size is probed once, then taken from the cache, and that
+# images streamed by the read-ahead reader are not probed.
+#
+# usage: sim-autotune.sh [path to qdl]
+
+QDL=$(realpath "${1:-./qdl}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cd "$DIR" || exit 1
+
+export XDG_CACHE_HOME="$DIR/cache"
+
+# Large enough for a slice of each probed payload size
+head -c 65536 /dev/urandom > prog.mbn
+truncate -s 112M system.img
+cat > rawprogram0.xml <<XML
+<?xml version="1.0" ?>
+<data>
+  <program SECTOR_SIZE_IN_BYTES="4096" file_sector_offset="0" filename="system.img" label="system" num_partition_sectors="28672" physical_partition_number="0" start_sector="0" />
+</data>
+XML
+
+fail=0
+
+# check <description> <expected pattern> <unexpected pattern> [qdl options]
+check() {
+	desc=$1
+	expect=$2
+	reject=$3
+	shift 3
+
+	out=$("$QDL" --debug --auto-tune --transport sim "$@" prog.mbn rawprogram0.xml 2>&1)
+	if [ $? -ne 0 ]; then
+		echo "FAIL: $desc: qdl failed"
+		fail=1
+	elif ! echo "$out" | grep -q "$expect"; then
+		echo "FAIL: $desc: no \"$expect\""
+		fail=1
+	elif echo "$out" | grep -q "$reject"; then
+		echo "FAIL: $desc: unexpected \"$reject\""
+		fail=1
+	else
+		echo "PASS: $desc: $(echo "$out" | grep -m1 "$expect")"
+	fi
+}
+
+check "read-ahead" "flashed \"system\"" "\[TUNE\] picked" --read-ahead 4
+check "first session" "\[TUNE\] picked" "\[TUNE\] using cached"
+check "next session" "\[TUNE\] using cached" "\[TUNE\] payload size"
+
+exit $fail
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Apply a GPT sized set of patches through the simulated device and check
+# that they are batched into a few documents, and replayed one at a time
+# when the programmer only takes one command per document.
+#
+# usage: sim-patches.sh [path to qdl]
+
+QDL=$(realpath "${1:-./qdl}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cd "$DIR" || exit 1
+
+PATCHES=120
+
+head -c 65536 /dev/urandom > prog.mbn
+{
+	echo '<?xml version="1.0" ?>'
+	echo '<patches>'
+	i=0
+	while [ $i -lt $PATCHES ]; do
+		echo "  <patch SECTOR_SIZE_IN_BYTES=\"4096\" byte_offset=\"$((i * 8))\" filename=\"DISK\" physical_partition_number=\"0\" size_in_bytes=\"8\" start_sector=\"1\" value=\"NUM_DISK_SECTORS-$i.\" what=\"Patch $i\" />"
+		i=$((i + 1))
+	done
+	echo '</patches>'
+} > patch0.xml
+
+fail=0
+
+# Print the number of documents holding patches, then those holding just one
+documents() {
+	awk '/^FIREHOSE WRITE/ { doc = 1; n = 0; next }
+	     doc && /^<patch/ { n++ }
+	     doc && /^<\/data>/ { if (n) docs++; if (n == 1) single++; doc = 0 }
+	     END { print docs + 0, single + 0 }'
+}
+
+out=$("$QDL" --debug --transport sim prog.mbn patch0.xml 2>&1) || {
+	echo "FAIL: batched patches: qdl failed"
+	fail=1
+}
+set -- $(echo "$out" | documents)
+if [ "$1" -gt 10 ]; then
+	echo "FAIL: batched patches: $PATCHES patches sent in $1 documents"
+	fail=1
+else
+	echo "PASS: batched patches: $PATCHES patches sent in $1 documents"
+fi
+
+out=$("$QDL" --debug --transport sim --sim-single-command prog.mbn patch0.xml 2>&1) || {
+	echo "FAIL: single command programmer: qdl failed"
+	fail=1
+}
+set -- $(echo "$out" | documents)
+if ! echo "$out" | grep -q "applying them one at a time" || [ "$2" -ne $PATCHES ]; then
+	echo "FAIL: single command programmer: $2 of $PATCHES patches sent alone"
+	fail=1
+else
+	echo "PASS: single command programmer: $2 of $PATCHES patches sent alone"
+fi
+
+exit $fail
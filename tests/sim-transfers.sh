@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Flash an image through the simulated device and check the number of
+# bulk-OUT transfers and zero length packets reported by --debug.
+#
+# usage: sim-transfers.sh [path to qdl]
+
+QDL=$(realpath "${1:-./qdl}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cd "$DIR" || exit 1
+
+# A raw image of 4 MiB and one sector, so the last payload is short
+head -c 65536 /dev/urandom > prog.mbn
+head -c 4198400 /dev/urandom > system.img
+cat > rawprogram0.xml <<XML
+<?xml version="1.0" ?>
+<data>
+  <program SECTOR_SIZE_IN_BYTES="4096" file_sector_offset="0" filename="system.img" label="system" num_partition_sectors="1025" physical_partition_number="0" start_sector="0" />
+</data>
+XML
+
+fail=0
+
+# check <description> <max transfers per MiB> <max ZLPs> [qdl options]
+check() {
+	desc=$1
+	max_transfers=$2
+	max_zlps=$3
+	shift 3
+
+	stats=$("$QDL" --debug --transport sim "$@" prog.mbn rawprogram0.xml 2>&1 |
+		sed -n 's/^\[PROGRAM\] \([0-9]*\) transfers, \([0-9]*\) ZLPs (\([0-9.]*\)\/.*/\1 \2 \3/p')
+	if [ -z "$stats" ]; then
+		echo "FAIL: $desc: no transfer statistics"
+		fail=1
+		return
+	fi
+
+	set -- $stats
+	if ! awk "BEGIN { exit !($3 <= $max_transfers && $2 <= $max_zlps) }"; then
+		echo "FAIL: $desc: $1 transfers ($3 per MiB), $2 ZLPs"
+		fail=1
+		return
+	fi
+
+	echo "PASS: $desc: $1 transfers ($3 per MiB), $2 ZLPs"
+}
+
+# Packet sized transfers, the ZLP is only sent at the end of the data
+check "default transfers" 2048 1
+# Each payload goes out as a single transfer
+check "1 MiB transfers" 2 1 --xfer-size 1048576
+
+exit $fail
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Only the handful of io_uring operations needed to keep a fixed number of
+ * file reads in flight are implemented here, directly on top of the system
+ * calls, to avoid depending on liburing.
+ */
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * io_uring predates IORING_OP_READ, which came with Linux 5.6 along with the
+ * probe; kernels failing the probe don't have it either
+ */
+static bool uring_supports(int fd, unsigned op)
+{
+	struct io_uring_probe *probe;
+	bool supported = false;
+	size_t len;
+
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, len);
+	if (!probe)
+		return false;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+	    op <= probe->last_op)
+		supported = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+
+	free(probe);
+	return supported;
+}
+
+/**
+ * uring_init() - set up an io_uring instance
+ * @ring:	instance to initialize
+ * @entries:	maximum number of requests in flight
+ *
+ * Return: 0 on success, negative errno on failure, e.g. -ENOSYS when the
+ * kernel doesn't support io_uring, -EPERM when it's disabled or -EOPNOTSUPP
+ * when it can't read files yet
+ */
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq;
+	char *cq;
+	int fd;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = -1;
+
+	fd = uring_setup(entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	if (!uring_supports(fd, IORING_OP_READ)) {
+		close(fd);
+		return -EOPNOTSUPP;
+	}
+
+	ring->fd = fd;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	ring->sq_ring = sq;
+
+	if (ring->cq_ring_size) {
+		cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+		ring->cq_ring = cq;
+	} else {
+		cq = sq;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	fd = -errno;
+	uring_exit(ring);
+	return fd;
+}
+
+/**
+ * uring_read() - queue a read request
+ * @ring:	io_uring instance
+ * @fd:		file to read from
+ * @buf:	destination buffer
+ * @len:	number of bytes to read
+ * @offset:	file offset to read from
+ * @data:	cookie returned by uring_reap() on completion
+ *
+ * The request is handed to the kernel by the next uring_wait().
+ *
+ * Return: 0 on success, -EBUSY if the submission queue is full
+ */
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset,
+	       uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+	unsigned tail;
+	unsigned idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	if (tail - head > *ring->sq_mask)
+		return -EBUSY;
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = data;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return 0;
+}
+
+/**
+ * uring_wait() - submit queued requests and wait for completions
+ * @ring:	io_uring instance
+ * @min_complete: number of completions to wait for
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int uring_wait(struct uring *ring, unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = uring_enter(ring->fd, ring->pending, min_complete,
+				  IORING_ENTER_GETEVENTS);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	ring->pending -= ret;
+	return 0;
+}
+
+/**
+ * uring_reap() - consume one completion
+ * @ring:	io_uring instance
+ * @data:	cookie of the completed request
+ * @res:	result of the request, as returned by pread() or negative errno
+ *
+ * Return: 1 if a completion was consumed, 0 if none is available
+ */
+int uring_reap(struct uring *ring, uint64_t *data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+#else
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -ENOSYS;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset,
+	       uint64_t data)
+{
+	return -ENOSYS;
+}
+
+int uring_wait(struct uring *ring, unsigned min_complete)
+{
+	return -ENOSYS;
+}
+
+int uring_reap(struct uring *ring, uint64_t *data, int *res)
+{
+	return 0;
+}
+
+void uring_exit(struct uring *ring)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * struct uring - minimal io_uring instance used for file reads
+ * @fd:		io_uring file descriptor, or -1
+ * @sq_ring:	mapping of the submission queue ring
+ * @sq_ring_size: size of @sq_ring
+ * @cq_ring:	mapping of the completion queue ring, may alias @sq_ring
+ * @cq_ring_size: size of @cq_ring
+ * @sqes:	mapping of the submission queue entries
+ * @sqes_size:	size of @sqes
+ * @sq_head:	kernel's consumer index of the submission queue
+ * @sq_tail:	our producer index of the submission queue
+ * @sq_mask:	mask applied to submission queue indices
+ * @sq_array:	submission queue index array
+ * @cq_head:	our consumer index of the completion queue
+ * @cq_tail:	kernel's producer index of the completion queue
+ * @cq_mask:	mask applied to completion queue indices
+ * @cqes:	completion queue entries
+ * @pending:	number of entries queued but not yet submitted
+ */
+struct uring {
+	int fd;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned pending;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+int uring_read(struct uring *ring, int fd, void *buf, size_t len, off_t offset,
+	       uint64_t data);
+int uring_wait(struct uring *ring, unsigned min_complete);
+int uring_reap(struct uring *ring, uint64_t *data, int *res);
+void uring_exit(struct uring *ring);
+
+#endif
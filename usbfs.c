@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef __linux__
+
+#include <assert.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "qdl.h"
+
+#include "python_logging.h"
+
+#define USBFS_ROOT "/dev/bus/usb"
+#define USBFS_SYSFS "/sys/bus/usb/devices"
+
+/*
+ * Reading a usbfs device node yields the device descriptor followed by the
+ * full configuration descriptor, look for the EDL interface in there.
+ */
+static int usbfs_parse(struct qdl_device *qdl, const void *buf, size_t len,
+                       int *intf) {
+  const struct usb_device_descriptor *dev = buf;
+  const struct usb_interface_descriptor *ifc;
+  const struct usb_endpoint_descriptor *ept;
+  const struct usb_descriptor_header *hdr;
+  const uint8_t *ptr = buf;
+  const uint8_t *end = ptr + len;
+  uint8_t in = 0;
+  uint8_t out = 0;
+  size_t in_size = 0;
+  size_t out_size = 0;
+
+  if (len < sizeof(*dev) || dev->bDescriptorType != USB_DT_DEVICE)
+    return -ENOENT;
+
+  if (le16toh(dev->idVendor) != 0x05c6 || le16toh(dev->idProduct) != 0x9008)
+    return -ENOENT;
+
+  ptr += dev->bLength;
+  while (ptr + sizeof(*hdr) <= end) {
+    hdr = (const struct usb_descriptor_header *)ptr;
+    if (hdr->bLength == 0 || ptr + hdr->bLength > end)
+      break;
+
+    if (hdr->bDescriptorType != USB_DT_INTERFACE) {
+      ptr += hdr->bLength;
+      continue;
+    }
+
+    ifc = (const struct usb_interface_descriptor *)ptr;
+    in = out = 0;
+
+    /* Collect the endpoints up to the next interface descriptor */
+    for (ptr += hdr->bLength; ptr + sizeof(*hdr) <= end;
+         ptr += hdr->bLength) {
+      hdr = (const struct usb_descriptor_header *)ptr;
+      if (hdr->bLength == 0 || ptr + hdr->bLength > end)
+        return -ENOENT;
+      if (hdr->bDescriptorType == USB_DT_INTERFACE)
+        break;
+
+      if (hdr->bDescriptorType != USB_DT_ENDPOINT)
+        continue;
+
+      ept = (const struct usb_endpoint_descriptor *)ptr;
+      if ((ept->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) !=
+          USB_ENDPOINT_XFER_BULK)
+        continue;
+
+      if (ept->bEndpointAddress & USB_DIR_IN) {
+        in = ept->bEndpointAddress;
+        in_size = le16toh(ept->wMaxPacketSize);
+      } else {
+        out = ept->bEndpointAddress;
+        out_size = le16toh(ept->wMaxPacketSize);
+      }
+    }
+
+    if (ifc->bInterfaceClass != 0xff || ifc->bInterfaceSubClass != 0xff)
+      continue;
+    if (ifc->bInterfaceProtocol != 0xff && ifc->bInterfaceProtocol != 0x10)
+      continue;
+    if (!in || !out)
+      continue;
+
+    qdl->in_ep = in;
+    qdl->out_ep = out;
+    qdl->in_maxpktsize = in_size;
+    qdl->out_maxpktsize = out_size;
+    *intf = ifc->bInterfaceNumber;
+    return 0;
+  }
+
+  return -ENOENT;
+}
+
+static int usbfs_claim(struct qdl_device *qdl, int fd, int intf) {
+  struct usbdevfs_ioctl cmd = {
+      .ifno = intf,
+      .ioctl_code = USBDEVFS_DISCONNECT,
+  };
+
+  /* Fails with ENODATA when no kernel driver is bound, which is fine */
+  ioctl(fd, USBDEVFS_IOCTL, &cmd);
+
+  if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0) {
+    log_msg(log_error, "Could not claim USB interface: %s\n",
+            strerror(errno));
+    return -errno;
+  }
+
+  qdl->urbs = calloc(QDL_OUT_QUEUE_MAX, sizeof(struct usbdevfs_urb));
+  qdl->in_urbs = calloc(QDL_IN_QUEUE_MAX, sizeof(struct usbdevfs_urb));
+  if (!qdl->urbs || !qdl->in_urbs)
+    return -ENOMEM;
+
+  qdl->fd = fd;
+  return 0;
+}
+
+static int usbfs_open_node(struct qdl_device *qdl, const char *path) {
+  uint8_t desc[1024];
+  ssize_t n;
+  int intf;
+  int ret;
+  int fd;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+    return -ENOENT;
+
+  n = read(fd, desc, sizeof(desc));
+  if (n < 0 || usbfs_parse(qdl, desc, n, &intf) < 0) {
+    close(fd);
+    return -ENOENT;
+  }
+
+  ret = usbfs_claim(qdl, fd, intf);
+  if (ret < 0)
+    close(fd);
+
+  return ret;
+}
+
+static unsigned long usbfs_sysfs_read(const char *dev, const char *attr,
+                                      int base) {
+  char path[PATH_MAX];
+  char buf[32];
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s/%s", USBFS_SYSFS, dev, attr);
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+
+  buf[n] = '\0';
+  return strtoul(buf, NULL, base);
+}
+
+/* Bus/port paths are the names of the device directories in sysfs */
+static int usbfs_list(char (*paths)[QDL_PATH_MAX], int max) {
+  struct dirent *de;
+  int count = 0;
+  size_t len;
+  DIR *dir;
+
+  dir = opendir(USBFS_SYSFS);
+  if (!dir)
+    return 0;
+
+  while (count < max && (de = readdir(dir)) != NULL) {
+    len = strlen(de->d_name);
+    if (de->d_name[0] == '.' || strchr(de->d_name, ':') || len >= QDL_PATH_MAX)
+      continue;
+
+    if (usbfs_sysfs_read(de->d_name, "idVendor", 16) != 0x05c6 ||
+        usbfs_sysfs_read(de->d_name, "idProduct", 16) != 0x9008)
+      continue;
+
+    memcpy(paths[count++], de->d_name, len + 1);
+  }
+
+  closedir(dir);
+  return count;
+}
+
+static int usbfs_open(struct qdl_device *qdl) {
+  struct dirent *bus_de;
+  struct dirent *dev_de;
+  char path[PATH_MAX];
+  DIR *bus_dir;
+  DIR *dev_dir;
+  int ret = -ENOENT;
+
+  if (qdl->path[0]) {
+    snprintf(path, sizeof(path), "%s/%03lu/%03lu", USBFS_ROOT,
+             usbfs_sysfs_read(qdl->path, "busnum", 10),
+             usbfs_sysfs_read(qdl->path, "devnum", 10));
+    ret = usbfs_open_node(qdl, path);
+    if (ret == -ENOENT)
+      log_msg(log_error, "Device %s not found\n", qdl->path);
+    return ret;
+  }
+
+  bus_dir = opendir(USBFS_ROOT);
+  if (!bus_dir) {
+    log_msg(log_error, "Could not open %s: %s\n", USBFS_ROOT, strerror(errno));
+    return -errno;
+  }
+
+  while (ret == -ENOENT && (bus_de = readdir(bus_dir)) != NULL) {
+    if (bus_de->d_name[0] == '.')
+      continue;
+
+    snprintf(path, sizeof(path), "%s/%s", USBFS_ROOT, bus_de->d_name);
+    dev_dir = opendir(path);
+    if (!dev_dir)
+      continue;
+
+    while (ret == -ENOENT && (dev_de = readdir(dev_dir)) != NULL) {
+      if (dev_de->d_name[0] == '.')
+        continue;
+
+      snprintf(path, sizeof(path), "%s/%s/%s", USBFS_ROOT, bus_de->d_name,
+               dev_de->d_name);
+      ret = usbfs_open_node(qdl, path);
+    }
+
+    closedir(dev_dir);
+  }
+
+  closedir(bus_dir);
+
+  if (ret == -ENOENT)
+    log_msg(log_error, "Device not found");
+
+  return ret;
+}
+
+static int usbfs_read(struct qdl_device *qdl, void *buf, size_t len,
+                      unsigned int timeout) {
+  struct usbdevfs_bulktransfer bulk = {
+      .ep = qdl->in_ep,
+      .len = len,
+      .timeout = timeout,
+      .data = buf,
+  };
+
+  int ret;
+
+  ret = ioctl(qdl->fd, USBDEVFS_BULK, &bulk);
+  if (ret < 0 && errno == ETIMEDOUT)
+    return -ETIMEDOUT;
+
+  return ret;
+}
+
+static void usbfs_complete(struct qdl_device *qdl, struct usbdevfs_urb *urb) {
+  if (urb->status) {
+    log_msg(log_error, "ERROR: bulk write URB failed: %d\n", urb->status);
+    qdl->out_error = -1;
+  } else if (urb->actual_length != urb->buffer_length) {
+    log_msg(log_error, "ERROR: short bulk write: %d of %d\n",
+            urb->actual_length, urb->buffer_length);
+    qdl->out_error = -1;
+  }
+
+  urb->usercontext = NULL;
+  qdl->out_inflight--;
+}
+
+/* Bulk-IN URBs carry their transfer, bulk-OUT ones point to themselves */
+static void usbfs_retire(struct qdl_device *qdl, struct usbdevfs_urb *urb) {
+  struct qdl_in_xfer *xfer = urb->usercontext;
+
+  if (urb->endpoint != qdl->in_ep) {
+    usbfs_complete(qdl, urb);
+    return;
+  }
+
+  if (urb->status && urb->status != -ENOENT)
+    log_msg(log_error, "ERROR: bulk read URB failed: %d\n", urb->status);
+
+  xfer->actual = urb->status ? -1 : urb->actual_length;
+  xfer->done = true;
+  urb->usercontext = NULL;
+}
+
+/* Cancel and retire all outstanding URBs after an error */
+static void usbfs_discard(struct qdl_device *qdl) {
+  struct usbdevfs_urb *urb;
+  int i;
+
+  for (i = 0; i < QDL_OUT_QUEUE_MAX; i++) {
+    if (qdl->urbs[i].usercontext)
+      ioctl(qdl->fd, USBDEVFS_DISCARDURB, &qdl->urbs[i]);
+  }
+
+  while (qdl->out_inflight) {
+    if (ioctl(qdl->fd, USBDEVFS_REAPURB, &urb) < 0)
+      break;
+    if (urb->endpoint == qdl->in_ep) {
+      usbfs_retire(qdl, urb);
+      continue;
+    }
+    urb->usercontext = NULL;
+    qdl->out_inflight--;
+  }
+
+  qdl->out_error = -1;
+}
+
+/*
+ * Wait until at most @limit URBs are in flight. Every wakeup reaps all the
+ * URBs that completed so far, without another trip through poll().
+ */
+static int usbfs_reap(struct qdl_device *qdl, unsigned int limit) {
+  struct pollfd pfd = {.fd = qdl->fd, .events = POLLOUT};
+  struct usbdevfs_urb *urb;
+  int ret;
+
+  while (qdl->out_inflight > limit) {
+    ret = poll(&pfd, 1, 1000);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR)
+        continue;
+      log_msg(log_error, "ERROR: bulk write timed out\n");
+      usbfs_discard(qdl);
+      return -1;
+    }
+
+    while (ioctl(qdl->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+      usbfs_retire(qdl, urb);
+
+    if (errno != EAGAIN) {
+      log_msg(log_error, "ERROR: failed to reap URB: %s\n", strerror(errno));
+      usbfs_discard(qdl);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int usbfs_submit(struct qdl_device *qdl, const void *buf, size_t len) {
+  unsigned int depth = qdl_out_queue_depth(qdl);
+  struct usbdevfs_urb *urb = NULL;
+  unsigned int i;
+
+  if (usbfs_reap(qdl, depth - 1) < 0)
+    return -1;
+
+  for (i = 0; i < depth; i++) {
+    if (!qdl->urbs[i].usercontext) {
+      urb = &qdl->urbs[i];
+      break;
+    }
+  }
+  assert(urb);
+
+  memset(urb, 0, sizeof(*urb));
+  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->endpoint = qdl->out_ep;
+  urb->buffer = (void *)buf;
+  urb->buffer_length = len;
+  urb->usercontext = urb;
+
+  while (ioctl(qdl->fd, USBDEVFS_SUBMITURB, urb) < 0) {
+    urb->usercontext = NULL;
+
+    /* usbfs_memory_mb is shared by all devices, wait for ours to free some */
+    if (errno == ENOMEM && qdl->out_inflight) {
+      if (usbfs_reap(qdl, qdl->out_inflight - 1) < 0)
+        return -1;
+      urb->usercontext = urb;
+      continue;
+    }
+
+    log_msg(log_error, "ERROR: failed to submit URB: %s\n", strerror(errno));
+    usbfs_discard(qdl);
+    return -1;
+  }
+
+  qdl->out_inflight++;
+  return 0;
+}
+
+static int usbfs_flush(struct qdl_device *qdl) {
+  return usbfs_reap(qdl, 0);
+}
+
+static int usbfs_read_submit(struct qdl_device *qdl, struct qdl_in_xfer *xfer) {
+  struct usbdevfs_urb *urb = &qdl->in_urbs[xfer - qdl->in_xfers];
+
+  memset(urb, 0, sizeof(*urb));
+  urb->type = USBDEVFS_URB_TYPE_BULK;
+  urb->endpoint = qdl->in_ep;
+  urb->buffer = xfer->buf;
+  urb->buffer_length = xfer->len;
+  urb->usercontext = xfer;
+
+  if (ioctl(qdl->fd, USBDEVFS_SUBMITURB, urb) < 0) {
+    log_msg(log_error, "ERROR: failed to submit URB: %s\n", strerror(errno));
+    urb->usercontext = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int usbfs_read_reap(struct qdl_device *qdl, struct qdl_in_xfer *xfer,
+                           unsigned int timeout) {
+  struct pollfd pfd = {.fd = qdl->fd, .events = POLLOUT};
+  struct usbdevfs_urb *urb;
+  int ret;
+
+  while (!xfer->done) {
+    ret = poll(&pfd, 1, timeout);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0) {
+        log_msg(log_error, "ERROR: failed to poll: %s\n", strerror(errno));
+        return -1;
+      }
+      log_msg(log_error, "ERROR: bulk read timed out\n");
+      return -ETIMEDOUT;
+    }
+
+    while (ioctl(qdl->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+      usbfs_retire(qdl, urb);
+
+    if (errno != EAGAIN) {
+      log_msg(log_error, "ERROR: failed to reap URB: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  return xfer->actual;
+}
+
+static void usbfs_read_cancel(struct qdl_device *qdl) {
+  struct qdl_in_xfer *xfer;
+  struct usbdevfs_urb *urb;
+  unsigned int i;
+
+  for (i = 0; i < QDL_IN_QUEUE_MAX; i++) {
+    if (qdl->in_urbs[i].usercontext)
+      ioctl(qdl->fd, USBDEVFS_DISCARDURB, &qdl->in_urbs[i]);
+  }
+
+  for (i = 0; i < qdl->in_count; i++) {
+    xfer = &qdl->in_xfers[(qdl->in_head + i) % QDL_IN_QUEUE_MAX];
+    while (!xfer->done) {
+      if (ioctl(qdl->fd, USBDEVFS_REAPURB, &urb) < 0)
+        return;
+      usbfs_retire(qdl, urb);
+    }
+  }
+}
+
+const struct qdl_transport qdl_usbfs_transport = {
+    .name = "usbfs",
+    .list = usbfs_list,
+    .open = usbfs_open,
+    .read = usbfs_read,
+    .submit = usbfs_submit,
+    .flush = usbfs_flush,
+    .read_submit = usbfs_read_submit,
+    .read_reap = usbfs_read_reap,
+    .read_cancel = usbfs_read_cancel,
+};
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2026, The qdl contributors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+#include "zero.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZERO_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ZERO_NEON
+#endif
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Bytes checked between early exits of the vectorized loops */
+#define ZERO_STRIDE	128
+
+static bool zero_check_generic(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = 0;
+	uint64_t w;
+	size_t i;
+
+	for (; len && (uintptr_t)p % sizeof(w); len--)
+		acc |= *p++;
+
+	while (len >= 4 * sizeof(w)) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&w, p + i * sizeof(w), sizeof(w));
+			acc |= w;
+		}
+		if (acc)
+			return false;
+		p += 4 * sizeof(w);
+		len -= 4 * sizeof(w);
+	}
+
+	while (len--)
+		acc |= *p++;
+
+	return !acc;
+}
+
+#ifdef ZERO_X86
+__attribute__((target("sse2")))
+static bool zero_check_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m128i acc;
+	int i;
+
+	while (len >= ZERO_STRIDE) {
+		acc = _mm_setzero_si128();
+		for (i = 0; i < ZERO_STRIDE; i += 16)
+			acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return false;
+		p += ZERO_STRIDE;
+		len -= ZERO_STRIDE;
+	}
+
+	return zero_check_generic(p, len);
+}
+
+__attribute__((target("avx2")))
+static bool zero_check_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i acc;
+	int i;
+
+	while (len >= ZERO_STRIDE) {
+		acc = _mm256_setzero_si256();
+		for (i = 0; i < ZERO_STRIDE; i += 32)
+			acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + i)));
+		if (!_mm256_testz_si256(acc, acc))
+			return false;
+		p += ZERO_STRIDE;
+		len -= ZERO_STRIDE;
+	}
+
+	return zero_check_generic(p, len);
+}
+#endif
+
+#ifdef ZERO_NEON
+static bool zero_check_neon(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint8x16_t acc;
+	int i;
+
+	while (len >= ZERO_STRIDE) {
+		acc = vdupq_n_u8(0);
+		for (i = 0; i < ZERO_STRIDE; i += 16)
+			acc = vorrq_u8(acc, vld1q_u8(p + i));
+		if (vmaxvq_u8(acc))
+			return false;
+		p += ZERO_STRIDE;
+		len -= ZERO_STRIDE;
+	}
+
+	return zero_check_generic(p, len);
+}
+#endif
+
+static bool (*zero_check_impl)(const void *buf, size_t len);
+static const char *zero_check_name;
+static pthread_once_t zero_check_once = PTHREAD_ONCE_INIT;
+
+static void zero_check_select(void)
+{
+	zero_check_impl = zero_check_generic;
+	zero_check_name = "generic";
+
+#ifdef ZERO_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		zero_check_impl = zero_check_avx2;
+		zero_check_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		zero_check_impl = zero_check_sse2;
+		zero_check_name = "sse2";
+	}
+#endif
+
+#ifdef ZERO_NEON
+	zero_check_impl = zero_check_neon;
+	zero_check_name = "neon";
+#endif
+}
+
+/**
+ * zero_check() - check if a buffer is all zeros
+ * @buf:	buffer to check
+ * @len:	size of @buf
+ *
+ * Uses the widest vector instructions supported by the running CPU.
+ *
+ * Return: true if every byte of @buf is zero
+ */
+bool zero_check(const void *buf, size_t len)
+{
+	pthread_once(&zero_check_once, zero_check_select);
+
+	return zero_check_impl(buf, len);
+}
+
+const char *zero_impl_name(void)
+{
+	pthread_once(&zero_check_once, zero_check_select);
+
+	return zero_check_name;
+}
+
+static int zero_scan_add(struct sparse *sparse, unsigned *alloc, unsigned type,
+			 off_t offset, off_t size, off_t base)
+{
+	struct sparse_chunk *chunks;
+	struct sparse_chunk *chunk;
+
+	if (sparse->count) {
+		chunk = &sparse->chunks[sparse->count - 1];
+		if (chunk->type == type) {
+			chunk->size += size;
+			return 0;
+		}
+	}
+
+	if (sparse->count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		chunks = realloc(sparse->chunks, *alloc * sizeof(*chunks));
+		if (!chunks)
+			return -ENOMEM;
+		sparse->chunks = chunks;
+	}
+
+	chunk = &sparse->chunks[sparse->count++];
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->type = type;
+	chunk->offset = offset;
+	chunk->size = size;
+	chunk->file_offset = base + offset;
+
+	return 0;
+}
+
+/**
+ * zero_scan() - find the all-zero extents of an image
+ * @sparse:	chunk list to initialize
+ * @data:	the mapped image file
+ * @size:	size of the image file
+ * @base:	offset in the file of the region to scan
+ * @length:	size of the region to scan, the part beyond @size reads as zero
+ * @block:	granularity of the extents
+ *
+ * The region is described as a sparse image, with RAW chunks referring to
+ * the data in the file and DONT_CARE chunks covering the extents of @block
+ * sized, @block aligned, all-zero blocks.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int zero_scan(struct sparse *sparse, const void *data, off_t size,
+	      off_t base, off_t length, size_t block)
+{
+	unsigned alloc = 0;
+	unsigned type;
+	off_t offset;
+	off_t avail;
+	off_t len;
+	int ret;
+
+	memset(sparse, 0, sizeof(*sparse));
+	sparse->block_size = block;
+	sparse->size = length;
+
+	for (offset = 0; offset < length; offset += len) {
+		len = MIN((off_t)block, length - offset);
+
+		/* Only the part within the file needs to be checked */
+		avail = 0;
+		if (base + offset < size)
+			avail = MIN(len, size - base - offset);
+
+		if (zero_check((const char *)data + base + offset, avail))
+			type = SPARSE_CHUNK_DONT_CARE;
+		else
+			type = SPARSE_CHUNK_RAW;
+
+		ret = zero_scan_add(sparse, &alloc, type, offset, len, base);
+		if (ret < 0) {
+			sparse_close(sparse);
+			return ret;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef __ZERO_H__
+#define __ZERO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct sparse;
+
+bool zero_check(const void *buf, size_t len);
+const char *zero_impl_name(void);
+int zero_scan(struct sparse *sparse, const void *data, off_t size,
+	      off_t base, off_t length, size_t block);
+
+#endif